@@ -0,0 +1,52 @@
+#ifndef CRUCIBLE_BENCH_H
+#define CRUCIBLE_BENCH_H
+
+#include "crucible/time.h"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Output is one line per benchmark, tab-separated:
+//	name	ns_per_op	iterations
+
+namespace crucible {
+	using namespace std;
+
+	// Keep the optimizer from discarding a computed value
+	template <class T>
+	inline void
+	bench_keep(const T &t)
+	{
+		asm volatile("" : : "g"(&t) : "memory");
+	}
+
+	// Report a result measured some other way
+	inline void
+	bench_report(const string &name, double elapsed, uint64_t iterations)
+	{
+		cout << name << "\t" << (elapsed * 1e9 / iterations) << "\t" << iterations << endl;
+	}
+
+	// Run f in batches until at least min_seconds have elapsed
+	template <class F>
+	void
+	bench_run(const string &name, F f, double min_seconds = 0.5)
+	{
+		uint64_t iterations = 0;
+		uint64_t batch = 1;
+		Timer timer;
+		double elapsed = 0;
+		while (elapsed < min_seconds) {
+			for (uint64_t i = 0; i < batch; ++i) {
+				f();
+			}
+			iterations += batch;
+			batch *= 2;
+			elapsed = timer.age();
+		}
+		bench_report(name, elapsed, iterations);
+	}
+}
+
+#endif // CRUCIBLE_BENCH_H
@@ -0,0 +1,62 @@
+#include "bench.h"
+
+#include "crucible/cache.h"
+
+#include <random>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_lru_cache()
+{
+	const size_t cache_size = 4096;
+	uint64_t misses = 0;
+	LRUCache<uint64_t, uint64_t> cache([&](uint64_t k) -> uint64_t {
+		++misses;
+		return k * 2;
+	}, cache_size);
+
+	// Same key every time:  lookup and no relinking
+	bench_run("lru_hit_same", [&]() {
+		auto rv = cache(1);
+		bench_keep(rv);
+	});
+
+	// Keys cycle through a working set that fits:  lookup and move to front
+	uint64_t k = 0;
+	bench_run("lru_hit_cycle", [&]() {
+		auto rv = cache(k++ % cache_size);
+		bench_keep(rv);
+	});
+
+	// Keys never repeat:  insert and evict
+	bench_run("lru_miss_evict", [&]() {
+		auto rv = cache(k++);
+		bench_keep(rv);
+	});
+
+	// Random keys from twice the cache size:  about half hits
+	mt19937_64 rng(1);
+	vector<uint64_t> keys(64 * 1024);
+	for (auto &i : keys) {
+		i = rng() % (cache_size * 2);
+	}
+	size_t n = 0;
+	bench_run("lru_random_half", [&]() {
+		auto rv = cache(keys[n++ % keys.size()]);
+		bench_keep(rv);
+	});
+
+	bench_keep(misses);
+}
+
+int
+main(int, char**)
+{
+	bench_lru_cache();
+
+	exit(EXIT_SUCCESS);
+}
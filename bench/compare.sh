@@ -0,0 +1,45 @@
+#!/bin/bash
+# Compare benchmark results from two builds, e.g. two commits:
+#
+#	make bench && mkdir -p /tmp/before && cp bench/*.txt /tmp/before/
+#	(change something) make bench && bench/compare.sh /tmp/before bench
+#
+# Prints each value before and after, and the after/before ratio.  For
+# ns/op, latencies and byte counts a ratio below 1 is an improvement; for
+# throughput (e.g. scan_mib_per_sec) and space_saved, above 1 is.
+# Also works on two loopback.sh summary.txt files.
+
+set -e
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 BEFORE AFTER  (directories of *.txt results, or files)" >&2
+	exit 1
+fi
+
+results(){
+	if [ -d "$1" ]; then
+		cat "$1"/*.txt
+	else
+		cat "$1"
+	fi
+}
+
+awk -F '\t' '
+	FNR == 1 { file++ }
+	NF < 2 || $1 == "" { next }
+	file == 1 { before[$1] = $2; order[++n] = $1; next }
+	{ after[$1] = $2; if (!($1 in before)) order[++n] = $1 }
+	END {
+		printf "%-32s %12s %12s %8s\n", "benchmark", "before", "after", "ratio"
+		for (i = 1; i <= n; i++) {
+			k = order[i]
+			if ((k in before) && (k in after) && before[k] > 0) {
+				printf "%-32s %12.2f %12.2f %8.3f\n", k, before[k], after[k], after[k] / before[k]
+			} else if (k in before) {
+				printf "%-32s %12.2f %12s\n", k, before[k], "-"
+			} else {
+				printf "%-32s %12s %12.2f\n", k, "-", after[k]
+			}
+		}
+	}
+' <(results "$1") <(results "$2")
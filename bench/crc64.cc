@@ -0,0 +1,36 @@
+#include "bench.h"
+
+#include "crucible/crc64.h"
+
+#include <random>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_crc64()
+{
+	vector<uint8_t> buf(128 * 1024);
+	mt19937_64 rng(1);
+	for (auto &i : buf) {
+		i = rng();
+	}
+
+	// Block hash input is 4K, the other sizes show per-call overhead and streaming rate
+	for (size_t len : { 8, 64, 512, 4096, 128 * 1024 }) {
+		bench_run("crc64_" + to_string(len), [&]() {
+			auto rv = Digest::CRC::crc64(buf.data(), len);
+			bench_keep(rv);
+		});
+	}
+}
+
+int
+main(int, char**)
+{
+	bench_crc64();
+
+	exit(EXIT_SUCCESS);
+}
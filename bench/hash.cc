@@ -0,0 +1,70 @@
+#include "bench.h"
+
+#include "bees.h"
+
+#include <random>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_hash_table(BeesHashTable::Policy policy)
+{
+	// 64 extents, big enough to miss the CPU caches
+	BeesHashTable bht(nullptr, "", 64 * BLOCK_SIZE_HASHTAB_EXTENT);
+	bht.set_policy(policy);
+
+	// Keep the old names for the default policy
+	const string prefix = policy == BeesHashTable::RANDOM ? "hash_" : string("hash_") + BeesHashTable::policy_name(policy) + "_";
+
+	mt19937_64 rng(1);
+	vector<BeesHashTable::HashType> hashes(1024 * 1024);
+	for (auto &i : hashes) {
+		i = rng();
+	}
+
+	size_t n = 0;
+	bench_run(prefix + "push_random", [&]() {
+		auto i = n++ % hashes.size();
+		auto rv = bht.push_random_hash_addr(hashes[i], (i + 1) * BLOCK_SIZE_SUMS);
+		bench_keep(rv);
+	});
+
+	bench_run(prefix + "find_hit", [&]() {
+		auto rv = bht.find_cell(hashes[n++ % hashes.size()]);
+		bench_keep(rv);
+	});
+
+	bench_run(prefix + "find_miss", [&]() {
+		auto rv = bht.find_cell(rng());
+		bench_keep(rv);
+	});
+
+	bench_run(prefix + "push_front", [&]() {
+		auto i = n++ % hashes.size();
+		auto rv = bht.push_front_hash_addr(hashes[i], (i + 1) * BLOCK_SIZE_SUMS);
+		bench_keep(rv);
+	});
+
+	bench_run(prefix + "erase", [&]() {
+		auto i = n++ % hashes.size();
+		bht.erase_hash_addr(hashes[i], (i + 1) * BLOCK_SIZE_SUMS);
+	});
+
+	bht.stop();
+}
+
+int
+main(int, char**)
+{
+	BeesNote::set_name("bench");
+	// Keep BEESTOOLONG and friends quiet
+	bees_log_level = LOG_WARNING;
+	for (int i = 0; i < BeesHashTable::POLICY_MAX; ++i) {
+		bench_hash_table(static_cast<BeesHashTable::Policy>(i));
+	}
+
+	exit(EXIT_SUCCESS);
+}
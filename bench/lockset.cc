@@ -0,0 +1,71 @@
+#include "bench.h"
+
+#include "crucible/lockset.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_lockset_threads(const string &name, size_t thread_count, uint64_t key_count)
+{
+	LockSet<uint64_t> lockset;
+	const uint64_t ops = 100000;
+	vector<thread> threads;
+	Timer timer;
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.push_back(thread([&, t]() {
+			for (uint64_t i = 0; i < ops; ++i) {
+				auto lock = lockset.make_lock((i + t) % key_count);
+				bench_keep(lock);
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	bench_report(name, timer.age(), ops * thread_count);
+}
+
+static
+void
+bench_lockset()
+{
+	LockSet<uint64_t> lockset;
+	uint64_t n = 0;
+
+	// Single thread, nothing else in the set
+	bench_run("lockset_lock_unlock", [&]() {
+		lockset.lock(n);
+		lockset.unlock(n);
+		++n;
+	});
+
+	bench_run("lockset_make_lock", [&]() {
+		auto lock = lockset.make_lock(n++);
+		bench_keep(lock);
+	});
+
+	bench_run("lockset_try_lock", [&]() {
+		if (lockset.try_lock(n)) {
+			lockset.unlock(n);
+		}
+		++n;
+	});
+
+	// Several threads on distinct keys (like extent bytenrs) and on few keys
+	bench_lockset_threads("lockset_4_threads_distinct", 4, 1024 * 1024);
+	bench_lockset_threads("lockset_4_threads_contended", 4, 2);
+}
+
+int
+main(int, char**)
+{
+	bench_lockset();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,293 @@
+#!/bin/bash
+# End-to-end bees benchmark on a loopback btrfs image.
+#
+# Creates a btrfs filesystem in an image file, fills it with a synthetic
+# workload, runs bees until the first crawl finishes and the queued scans
+# drain (or a time limit), then reports scan throughput, dedup results,
+# ioctl counts and latency.
+# Needs root, mkfs.btrfs, btrfs, losetup and curl.
+#
+#	sudo bench/loopback.sh -d 50 -n 2 -c 25 -o /tmp/run1
+#
+# Results are written to the output directory:  summary.txt (one
+# "name<TAB>value" line per result; compare runs with bench/compare.sh),
+# metrics.txt (final OpenMetrics scrape), status.txt, events.txt
+# (beesevents report) and bees.log.
+
+set -e
+
+## Helpful functions
+INFO(){ echo "INFO:" "$@" >&2; }
+ERRO(){ echo "ERROR:" "$@" >&2; exit 1; }
+
+usage(){
+	cat >&2 <<-EOF
+	Usage: $0 [options] [-- bees options]
+	    -b PATH      bees binary (default: bin/bees next to this script)
+	    -i PATH      image file (default: OUTDIR/btrfs.img)
+	    -s SIZE      image size (default 8G)
+	    -H SIZE      hash table size (default 256M)
+	    -f COUNT     number of files (default 1000)
+	    -z MIN:MAX   file size range in KiB, log-uniform (default 4:16384)
+	    -k KIB       chunk size for duplicate data (default 128)
+	    -d PCT       percentage of chunks that duplicate earlier chunks (default 50)
+	    -c PCT       percentage of files written with compression=zstd (default 0)
+	    -n COUNT     number of snapshots taken while writing files (default 0)
+	    -t SECONDS   stop bees after this long even if the crawl is not done (default 3600)
+	    -r SEED      random seed for the workload (default 1)
+	    -o DIR       output directory (default ./loopback.PID)
+	    -K           keep the image file afterwards
+	EOF
+	exit 1
+}
+
+bees_bin="$(dirname "$0")/../bin/bees"
+image=
+image_size=8G
+hash_size=256M
+file_count=1000
+size_range=4:16384
+chunk_kib=128
+dup_pct=50
+compress_pct=0
+snapshots=0
+time_limit=3600
+seed=1
+out_dir=./loopback.$$
+keep_image=false
+
+while getopts "b:i:s:H:f:z:k:d:c:n:t:r:o:Kh" opt; do
+	case "$opt" in
+		b) bees_bin="$OPTARG";;
+		i) image="$OPTARG";;
+		s) image_size="$OPTARG";;
+		H) hash_size="$OPTARG";;
+		f) file_count="$OPTARG";;
+		z) size_range="$OPTARG";;
+		k) chunk_kib="$OPTARG";;
+		d) dup_pct="$OPTARG";;
+		c) compress_pct="$OPTARG";;
+		n) snapshots="$OPTARG";;
+		t) time_limit="$OPTARG";;
+		r) seed="$OPTARG";;
+		o) out_dir="$OPTARG";;
+		K) keep_image=true;;
+		*) usage;;
+	esac
+done
+shift $((OPTIND - 1))
+bees_opts=("$@")
+
+[ "$(id -u)" = 0 ] || ERRO "must be run as root"
+for cmd in mkfs.btrfs btrfs losetup curl awk; do
+	command -v "$cmd" > /dev/null || ERRO "missing '$cmd'"
+done
+[ -x "$bees_bin" ] || ERRO "no bees binary at '$bees_bin'"
+bees_bin="$(realpath "$bees_bin")"
+beesevents_bin="$(dirname "$bees_bin")/beesevents"
+
+mkdir -p "$out_dir"
+out_dir="$(realpath "$out_dir")"
+[ -n "$image" ] || image="$out_dir/btrfs.img"
+mnt="$out_dir/mnt"
+chunk=$((chunk_kib * 1024))
+
+loop_dev=
+bees_pid=
+cleanup(){
+	if [ -n "$bees_pid" ]; then
+		kill -TERM "$bees_pid" 2> /dev/null || true
+		wait "$bees_pid" 2> /dev/null || true
+	fi
+	if mountpoint -q "$mnt"; then
+		umount "$mnt"
+	fi
+	if [ -n "$loop_dev" ]; then
+		losetup -d "$loop_dev"
+	fi
+	if ! $keep_image; then
+		rm -f "$image"
+	fi
+}
+trap cleanup EXIT
+
+## Filesystem
+INFO "Creating $image_size filesystem in $image"
+rm -f "$image"
+truncate -s "$image_size" "$image"
+loop_dev="$(losetup --find --show "$image")"
+mkfs.btrfs -q -f "$loop_dev"
+mkdir -p "$mnt"
+mount -o noatime "$loop_dev" "$mnt"
+btrfs subvolume create "$mnt/data" > /dev/null
+mkdir "$mnt/data/plain" "$mnt/data/zstd"
+btrfs property set "$mnt/data/zstd" compression zstd
+
+## Workload plan
+# Each line is one of:
+#	file PATH SIZE
+#	new PATH CHUNK COUNT COMPRESSIBLE
+#	dup PATH CHUNK SRC_PATH SRC_CHUNK
+#	snapshot N
+IFS=: read -r size_min size_max <<< "$size_range"
+plan(){
+	awk -v seed="$seed" -v files="$file_count" -v min="$size_min" -v max="$size_max" \
+		-v chunk_kib="$chunk_kib" -v dup_pct="$dup_pct" -v compress_pct="$compress_pct" -v snapshots="$snapshots" '
+	BEGIN {
+		srand(seed)
+		pool = 0
+		per_round = int(files / (snapshots + 1)) + 1
+		for (f = 0; f < files; ++f) {
+			if (f > 0 && f % per_round == 0) {
+				print "snapshot", f / per_round
+			}
+			z = (rand() * 100 < compress_pct)
+			path = (z ? "zstd" : "plain") "/f" f
+			kib = int(min * exp(rand() * log(max / min)))
+			print "file", path, kib * 1024
+			chunks = int((kib + chunk_kib - 1) / chunk_kib)
+			run = 0
+			for (c = 0; c < chunks; ++c) {
+				if (pool > 0 && rand() * 100 < dup_pct) {
+					if (run) {
+						print "new", path, c - run, run, z
+						run = 0
+					}
+					s = int(rand() * pool)
+					print "dup", path, c, pool_path[s], pool_chunk[s]
+				} else {
+					++run
+					# Only whole chunks can be copied
+					if ((c + 1) * chunk_kib <= kib) {
+						pool_path[pool] = path
+						pool_chunk[pool] = c
+						++pool
+					}
+				}
+			}
+			if (run) {
+				print "new", path, chunks - run, run, z
+			}
+		}
+	}'
+}
+
+INFO "Writing $file_count files, $dup_pct% duplicate chunks, $compress_pct% compressed, $snapshots snapshots"
+plan | while read -r op a b c d e; do
+	case "$op" in
+		file)
+			path="$a"
+			size="$b"
+			;;
+		new)
+			if [ "$d" = 1 ]; then
+				# Roughly 4:1 compressible
+				head -c $((c * chunk / 4)) /dev/urandom | base64 -w 0 | head -c $((c * chunk))
+			else
+				head -c $((c * chunk)) /dev/urandom
+			fi | dd of="$mnt/data/$a" bs="$chunk" seek="$b" conv=notrunc iflag=fullblock status=none
+			truncate -s "<$size" "$mnt/data/$a"
+			;;
+		dup)
+			dd if="$mnt/data/$c" of="$mnt/data/$a" bs="$chunk" skip="$d" seek="$b" count=1 conv=notrunc status=none
+			truncate -s "<$size" "$mnt/data/$a"
+			;;
+		snapshot)
+			btrfs subvolume snapshot "$mnt/data" "$mnt/snap.$a" > /dev/null
+			;;
+	esac
+done
+
+sync
+btrfs filesystem sync "$mnt"
+used_before=$(df --output=used -B1 "$mnt" | tail -1)
+INFO "Workload uses $used_before bytes"
+
+## Run bees
+btrfs subvolume create "$mnt/.beeshome" > /dev/null
+truncate -s "$hash_size" "$mnt/.beeshome/beeshash.dat"
+export BEESHOME="$mnt/.beeshome"
+export BEESSTATUS="$out_dir/status.txt"
+export BEESMETRICS="$out_dir/metrics.sock"
+
+scrape(){
+	curl -s --unix-socket "$BEESMETRICS" http://localhost/metrics
+}
+
+metric(){
+	awk -v name="$1" '$1 == name { print $2 }' "$2"
+}
+
+INFO "Running $bees_bin for at most $time_limit seconds"
+"$bees_bin" --event-trace "${bees_opts[@]}" "$mnt" > "$out_dir/bees.log" 2>&1 &
+bees_pid=$!
+
+# Sum of all scan_* event counters, to tell when the scans stop
+scan_activity(){
+	awk '$1 ~ /^bees_events_total\{event="scan_/ { sum += $2 } END { print sum + 0 }' "$1"
+}
+
+start=$(date +%s)
+last_scan=-1
+while kill -0 "$bees_pid" 2> /dev/null; do
+	sleep 5
+	scrape > "$out_dir/metrics.txt.new" 2> /dev/null || continue
+	mv -f "$out_dir/metrics.txt.new" "$out_dir/metrics.txt"
+	# crawl_done fires when the crawlers run out of new extents, while
+	# extent scan tasks may still be queued.  Wait until the task queue
+	# is empty and no scan counter moved during the last interval.
+	crawl_done=$(metric 'bees_events_total{event="crawl_done"}' "$out_dir/metrics.txt")
+	queue_length=$(metric 'bees_task_queue_length' "$out_dir/metrics.txt")
+	scan=$(scan_activity "$out_dir/metrics.txt")
+	if [ "${crawl_done:-0}" -gt 0 ] && [ "${queue_length:-1}" -eq 0 ] && [ "$scan" = "$last_scan" ]; then
+		INFO "Crawl finished and scans are idle"
+		break
+	fi
+	last_scan=$scan
+	if [ $(($(date +%s) - start)) -ge "$time_limit" ]; then
+		INFO "Time limit reached"
+		break
+	fi
+done
+kill -0 "$bees_pid" 2> /dev/null || ERRO "bees exited early, see $out_dir/bees.log"
+
+kill -TERM "$bees_pid"
+wait "$bees_pid" || true
+bees_pid=
+
+sync
+btrfs filesystem sync "$mnt"
+# Don't count the hash table and event trace as data
+beeshome_used=$(du -s -B1 "$BEESHOME" | cut -f1)
+used_after=$(($(df --output=used -B1 "$mnt" | tail -1) - beeshome_used))
+
+if [ -x "$beesevents_bin" ] && [ -f "$BEESHOME/beesevents.dat" ]; then
+	"$beesevents_bin" "$BEESHOME/beesevents.dat" > "$out_dir/events.txt" || true
+fi
+
+## Report
+awk -v used_before="$used_before" -v used_after="$used_after" '
+	function value(name) { return (name in m) ? m[name] : 0 }
+	/^#/ { next }
+	{ m[$1] = $2 }
+	$1 ~ /^bees_subvol_read_bytes_total/ { read_bytes += $2 }
+	END {
+		uptime = value("bees_uptime_seconds")
+		printf "uptime_seconds\t%.1f\n", uptime
+		printf "read_bytes\t%d\n", read_bytes
+		printf "scan_mib_per_sec\t%.2f\n", uptime > 0 ? read_bytes / uptime / 1048576 : 0
+		printf "dedup_bytes\t%d\n", value("bees_events_total{event=\"dedup_bytes\"}")
+		printf "dedup_copy_bytes\t%d\n", value("bees_events_total{event=\"dedup_copy\"}")
+		printf "space_used_before\t%d\n", used_before
+		printf "space_used_after\t%d\n", used_after
+		printf "space_saved\t%d\n", used_before - used_after
+		n = split("LOGICAL_INO FILE_EXTENT_SAME TREE_SEARCH_V2 INO_PATHS open pread pwrite", ifaces, " ")
+		for (i = 1; i <= n; ++i) {
+			l = "interface=\"" ifaces[i] "\""
+			printf "%s_count\t%d\n", ifaces[i], value("bees_kernel_latency_seconds_count{" l "}")
+			printf "%s_p50_ms\t%.3f\n", ifaces[i], value("bees_kernel_latency_seconds{" l ",quantile=\"0.5\"}") * 1000
+			printf "%s_p99_ms\t%.3f\n", ifaces[i], value("bees_kernel_latency_seconds{" l ",quantile=\"0.99\"}") * 1000
+			printf "%s_p999_ms\t%.3f\n", ifaces[i], value("bees_kernel_latency_seconds{" l ",quantile=\"0.999\"}") * 1000
+		}
+	}
+' "$out_dir/metrics.txt" | tee "$out_dir/summary.txt"
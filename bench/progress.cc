@@ -0,0 +1,53 @@
+#include "bench.h"
+
+#include "crucible/progress.h"
+
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_progress()
+{
+	ProgressTracker<uint64_t> pt(0);
+	uint64_t n = 0;
+
+	// Nothing else in flight
+	bench_run("progress_hold_release", [&]() {
+		auto hold = pt.hold(++n);
+		bench_keep(hold);
+	});
+
+	// A crawl batch worth of holds in flight, released in order
+	deque<ProgressTracker<uint64_t>::ProgressHolder> fifo;
+	bench_run("progress_window_fifo", [&]() {
+		fifo.push_back(pt.hold(++n));
+		if (fifo.size() > 128) {
+			fifo.pop_front();
+		}
+	});
+	fifo.clear();
+
+	// Same, but released in random order like tasks finishing on several threads
+	vector<ProgressTracker<uint64_t>::ProgressHolder> window(128);
+	mt19937_64 rng(1);
+	bench_run("progress_window_random", [&]() {
+		window[rng() % window.size()] = pt.hold(++n);
+	});
+	window.clear();
+
+	auto rv = pt.begin();
+	bench_keep(rv);
+}
+
+int
+main(int, char**)
+{
+	bench_progress();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,93 @@
+#include "bench.h"
+
+#include "crucible/fs.h"
+
+#include <cstring>
+#include <vector>
+
+#include <endian.h>
+
+using namespace crucible;
+using namespace std;
+
+// Build what TREE_SEARCH_V2 returns for a crawl over count EXTENT_DATA items
+static
+vector<char>
+make_search_result(size_t count)
+{
+	vector<char> buf(sizeof(btrfs_ioctl_search_args_v2));
+	for (size_t i = 0; i < count; ++i) {
+		btrfs_ioctl_search_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.transid = 1000 + i;
+		hdr.objectid = 257 + i / 16;
+		hdr.offset = (i % 16) * 128 * 1024;
+		hdr.type = BTRFS_EXTENT_DATA_KEY;
+		hdr.len = sizeof(btrfs_file_extent_item);
+
+		btrfs_file_extent_item fei;
+		memset(&fei, 0, sizeof(fei));
+		fei.generation = htole64(1000 + i);
+		fei.ram_bytes = htole64(128 * 1024);
+		fei.type = BTRFS_FILE_EXTENT_REG;
+		fei.disk_bytenr = htole64((i + 1) * 128 * 1024 * 1024);
+		fei.disk_num_bytes = htole64(128 * 1024);
+		fei.num_bytes = htole64(128 * 1024);
+
+		auto hdr_p = reinterpret_cast<const char *>(&hdr);
+		buf.insert(buf.end(), hdr_p, hdr_p + sizeof(hdr));
+		auto fei_p = reinterpret_cast<const char *>(&fei);
+		buf.insert(buf.end(), fei_p, fei_p + sizeof(fei));
+	}
+
+	auto args = reinterpret_cast<btrfs_ioctl_search_args_v2 *>(buf.data());
+	memset(&args->key, 0, sizeof(args->key));
+	args->key.tree_id = 5;
+	args->key.max_objectid = numeric_limits<uint64_t>::max();
+	args->key.max_offset = numeric_limits<uint64_t>::max();
+	args->key.max_transid = numeric_limits<uint64_t>::max();
+	args->key.min_type = BTRFS_EXTENT_DATA_KEY;
+	args->key.max_type = BTRFS_EXTENT_DATA_KEY;
+	args->key.nr_items = count;
+	args->buf_size = buf.size() - sizeof(btrfs_ioctl_search_args_v2);
+	return buf;
+}
+
+static
+void
+bench_search_parse()
+{
+	// BEES_MAX_CRAWL_SIZE is 1024
+	for (size_t count : { 1, 64, 1024 }) {
+		auto buf = make_search_result(count);
+		BtrfsIoctlSearchKey sk;
+
+		bench_run("search_parse_" + to_string(count), [&]() {
+			sk.set_result(buf);
+			bench_keep(sk.m_result);
+		});
+
+		// Parse and read the fields the crawler looks at
+		bench_run("search_parse_fields_" + to_string(count), [&]() {
+			sk.set_result(buf);
+			uint64_t sum = 0;
+			for (auto i : sk.m_result) {
+				sum += call_btrfs_get(btrfs_stack_file_extent_generation, i.m_data);
+				sum += call_btrfs_get(btrfs_stack_file_extent_type, i.m_data);
+				sum += call_btrfs_get(btrfs_stack_file_extent_disk_bytenr, i.m_data);
+				sum += call_btrfs_get(btrfs_stack_file_extent_ram_bytes, i.m_data);
+				sum += call_btrfs_get(btrfs_stack_file_extent_num_bytes, i.m_data);
+				sum += call_btrfs_get(btrfs_stack_file_extent_offset, i.m_data);
+			}
+			bench_keep(sum);
+		});
+	}
+}
+
+int
+main(int, char**)
+{
+	bench_search_parse();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,133 @@
+#include "bench.h"
+
+#include "bees.h"
+
+#include "crucible/extentwalker.h"
+#include "crucible/simfs.h"
+
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+using namespace std;
+
+// The same code paths as on a real filesystem, minus the kernel.
+// Results measure the userspace cost of each call.
+
+static const off_t bs = BtrfsSimulator::c_block_size;
+
+static
+void
+bench_walk(BtrfsSimulator &sim)
+{
+	for (size_t count : { 16, 1024 }) {
+		Fd fd = sim.add_file(257);
+		for (size_t i = 0; i < count; ++i) {
+			sim.write(fd, i * 32 * bs, vector<uint64_t>(32, i + 1));
+		}
+		bench_run("simfs_walk_" + to_string(count), [&]() {
+			BtrfsExtentWalker ew(fd, 0);
+			size_t n = 0;
+			while (ew.next()) {
+				++n;
+			}
+			bench_keep(n);
+		});
+	}
+}
+
+static
+void
+bench_resolve(BtrfsSimulator &sim)
+{
+	for (size_t refs : { 1, 16, 256 }) {
+		Fd fd = sim.add_file(257);
+		const auto bytenr = sim.write(fd, 0, vector<uint64_t>(32, 1));
+		for (size_t i = 1; i < refs; ++i) {
+			sim.add_ref(fd, i * 32 * bs, bytenr, 0, 32 * bs);
+		}
+		BtrfsIoctlLogicalInoArgs lia(bytenr + bs);
+		bench_run("simfs_logical_ino_" + to_string(refs), [&]() {
+			lia.do_ioctl(fd);
+			bench_keep(lia.m_iors);
+		});
+	}
+}
+
+static
+void
+bench_dedupe(BtrfsSimulator &sim)
+{
+	Fd src = sim.add_file(257);
+	Fd dst = sim.add_file(258);
+	vector<uint64_t> contents(32);
+	for (size_t i = 0; i < contents.size(); ++i) {
+		contents[i] = i + 1;
+	}
+	sim.write(src, 0, contents);
+	sim.write(dst, 0, contents);
+	bench_run("simfs_extent_same_128k", [&]() {
+		auto rv = btrfs_extent_same(src, 0, 32 * bs, dst, 0);
+		bench_keep(rv);
+	});
+}
+
+static
+void
+bench_scan(BtrfsSimulator &sim)
+{
+	Fd fd = sim.add_file(257);
+	sim.write(fd, 0, vector<uint64_t>(32, 7));
+	off_t offset = 0;
+	bench_run("simfs_block_read_hash", [&]() {
+		BeesBlockData bbd(fd, offset, BLOCK_SIZE_SUMS);
+		auto rv = bbd.hash();
+		bench_keep(rv);
+		offset = (offset + BLOCK_SIZE_SUMS) % (32 * bs);
+	});
+}
+
+// With injected latency, concurrent calls should overlap like they
+// would in the kernel instead of queueing behind each other.
+static
+void
+bench_latency(BtrfsSimulator &sim)
+{
+	Fd fd = sim.add_file(257);
+	const auto bytenr = sim.write(fd, 0, vector<uint64_t>(32, 1));
+	sim.latency(BtrfsSimulator::LOGICAL_INO, 0.001);
+	for (size_t thread_count : { 1, 8 }) {
+		const size_t per_thread = 100;
+		Timer timer;
+		vector<thread> threads;
+		for (size_t t = 0; t < thread_count; ++t) {
+			threads.push_back(thread([&]() {
+				BtrfsIoctlLogicalInoArgs lia(bytenr);
+				for (size_t i = 0; i < per_thread; ++i) {
+					lia.do_ioctl(fd);
+				}
+			}));
+		}
+		for (auto &t : threads) {
+			t.join();
+		}
+		bench_report("simfs_logical_ino_1ms_threads_" + to_string(thread_count), timer.age(), thread_count * per_thread);
+	}
+	sim.latency(BtrfsSimulator::LOGICAL_INO, 0);
+}
+
+int
+main(int, char**)
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	bench_walk(*sim);
+	bench_resolve(*sim);
+	bench_dedupe(*sim);
+	bench_scan(*sim);
+	bench_latency(*sim);
+
+	btrfs_backend(nullptr);
+	exit(EXIT_SUCCESS);
+}
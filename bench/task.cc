@@ -0,0 +1,79 @@
+#include "bench.h"
+
+#include "crucible/task.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+using namespace crucible;
+using namespace std;
+
+// Submit count tasks that do nothing, wait until all have run
+static
+void
+bench_task_throughput(size_t thread_count)
+{
+	TaskMaster::set_thread_count(thread_count);
+
+	const size_t count = 100000;
+	atomic<size_t> done(0);
+	mutex mtx;
+	condition_variable cv;
+
+	Timer timer;
+	for (size_t i = 0; i < count; ++i) {
+		Task("bench", [&]() {
+			if (++done == count) {
+				unique_lock<mutex> lock(mtx);
+				cv.notify_one();
+			}
+		}).run();
+	}
+	auto submit_time = timer.age();
+	unique_lock<mutex> lock(mtx);
+	while (done < count) {
+		cv.wait(lock);
+	}
+	auto total_time = timer.age();
+	lock.unlock();
+
+	bench_report("task_submit_" + to_string(thread_count) + "_threads", submit_time, count);
+	bench_report("task_dispatch_" + to_string(thread_count) + "_threads", total_time, count);
+}
+
+// One task at a time, i.e. wakeup latency
+static
+void
+bench_task_round_trip()
+{
+	TaskMaster::set_thread_count(1);
+	mutex mtx;
+	condition_variable cv;
+	bool done = false;
+	Task t("bench", [&]() {
+		unique_lock<mutex> lock(mtx);
+		done = true;
+		cv.notify_one();
+	});
+	bench_run("task_round_trip", [&]() {
+		unique_lock<mutex> lock(mtx);
+		done = false;
+		t.run();
+		while (!done) {
+			cv.wait(lock);
+		}
+	});
+}
+
+int
+main(int, char**)
+{
+	bench_task_round_trip();
+	for (size_t threads : { 1, 4, 8 }) {
+		bench_task_throughput(threads);
+	}
+	TaskMaster::set_thread_count(0);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,89 @@
+#include "bench.h"
+
+#include "bees.h"
+
+#include <functional>
+
+using namespace crucible;
+using namespace std;
+
+static
+void
+bench_trace_frames()
+{
+	uint64_t n = 0;
+	string s = "string";
+	off_t offset = 4096;
+
+	// What each frame used to cost:  type erasure of a capturing lambda
+	bench_run("std_function_frame", [&]() {
+		function<void(ostream &)> f([&](ostream &os) { os << "frame " << n << s << offset; });
+		bench_keep(f);
+		++n;
+	});
+
+	bench_run("beestrace_frame", [&]() {
+		BEESTRACE("frame " << n << s << offset);
+		++n;
+	});
+
+	bench_run("beesnote_frame", [&]() {
+		BEESNOTE("frame " << n << s << offset);
+		++n;
+	});
+
+	bench_run("beestoolong_frame", [&]() {
+		BEESTOOLONG("frame " << n << s << offset);
+		++n;
+	});
+
+	bench_run("nested_frames", [&]() {
+		BEESNOTE("outer " << n);
+		BEESTRACE("outer " << n);
+		BEESTOOLONG("outer " << n);
+		{
+			BEESNOTE("inner " << n);
+			BEESTRACE("inner " << n);
+			++n;
+		}
+	});
+
+	bench_keep(n);
+}
+
+static
+void
+bench_counters()
+{
+	bench_run("beescount", [&]() {
+		BEESCOUNT(bench_count);
+	});
+
+	uint64_t n = 0;
+	bench_run("beescountadd", [&]() {
+		BEESCOUNTADD(bench_count_add, ++n);
+	});
+
+	// Each counter has its own per-thread slot
+	bench_run("beescount_several", [&]() {
+		BEESCOUNT(bench_count_a);
+		BEESCOUNT(bench_count_b);
+		BEESCOUNT(bench_count_c);
+		BEESCOUNT(bench_count_d);
+	});
+
+	bench_run("beesstats_snapshot", [&]() {
+		auto rv = BeesStats::snapshot();
+		bench_keep(rv);
+	});
+}
+
+int
+main(int, char**)
+{
+	BeesNote::set_name("bench");
+	bench_trace_frames();
+	bench_counters();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,48 @@
+#ifndef CRUCIBLE_BACKEND_H
+#define CRUCIBLE_BACKEND_H
+
+#include "crucible/btrfs.h"
+
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/types.h>
+
+namespace crucible {
+	using namespace std;
+
+	// The btrfs ioctl wrappers in fs.h and extent data reads go through a
+	// backend.  The default backend calls the kernel.  Other backends can
+	// simulate a filesystem (see simfs.h), so the code above them can be
+	// tested and benchmarked without root or a real btrfs.
+	//
+	// Methods have the same return values and errno as ioctl(2) and pread(2).
+	class BtrfsBackend {
+	public:
+		virtual ~BtrfsBackend();
+		virtual int tree_search_v2(int fd, btrfs_ioctl_search_args_v2 *args);
+		// request is BTRFS_IOC_LOGICAL_INO or BTRFS_IOC_LOGICAL_INO_V2
+		virtual int logical_ino(int fd, unsigned long request, btrfs_ioctl_logical_ino_args *args);
+		virtual int ino_paths(int fd, btrfs_ioctl_ino_path_args *args);
+		virtual int ino_lookup(int fd, btrfs_ioctl_ino_lookup_args *args);
+		virtual int file_extent_same(int fd, btrfs_ioctl_same_args *args);
+		virtual ssize_t pread(int fd, void *buf, size_t size, off_t offset);
+		// Same as open_by_handle_at(2)
+		virtual int open_by_handle(int mount_fd, file_handle *handle, int flags);
+	};
+
+	// Replace the backend.  An empty pointer restores the kernel backend.
+	// Calls already running keep using the backend they started with.
+	void btrfs_backend(shared_ptr<BtrfsBackend> backend);
+	// The current backend.  Hold the returned pointer for the whole call.
+	shared_ptr<BtrfsBackend> btrfs_backend();
+
+	// pread_or_die through the backend, for reading file data
+	void btrfs_pread_or_die(int fd, void *buf, size_t size, off_t offset);
+	template <class T> void btrfs_pread_or_die(int fd, T& buf, off_t offset)
+	{
+		return btrfs_pread_or_die(fd, buf.data(), buf.size(), offset);
+	}
+}
+
+#endif // CRUCIBLE_BACKEND_H
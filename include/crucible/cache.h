@@ -10,6 +10,8 @@
 #include <tuple>
 #include <vector>
 
+#include <time.h>
+
 namespace crucible {
 	using namespace std;
 
@@ -24,6 +26,7 @@ namespace crucible {
 			Value *bp = nullptr;
 			Key key;
 			Return ret;
+			uint64_t used_ns = 0;
 			Value(Key k, Return r) : key(k), ret(r) { }
 			// Crash early!
 			~Value() { fp = bp = nullptr; };
@@ -38,6 +41,7 @@ namespace crucible {
 
 		void check_overflow();
 		void move_to_front(Value *vp);
+		static uint64_t now_ns();
 		void erase_one(Value *vp);
 	public:
 		LRUCache(Func f = Func(), size_t max_size = 100);
@@ -48,7 +52,13 @@ namespace crucible {
 		Return operator()(Arguments... args);
 		Return refresh(Arguments... args);
 		void expire(Arguments... args);
+		// Copy a cached value into ret without calling func or changing the LRU order
+		bool peek(Return &ret, Arguments... args);
 		void prune(function<bool(const Return &)> predicate);
+		// Remove entries whose key matches predicate, returns number removed
+		size_t prune_key(function<bool(const Key &)> predicate);
+		// Remove entries not used for at least seconds, returns number removed
+		size_t expire_idle(double seconds);
 		void insert(const Return &r, Arguments... args);
 		void clear();
 	};
@@ -99,10 +109,21 @@ namespace crucible {
 		}
 	}
 
+	// Idle times don't need precision, and the coarse clock is much cheaper
+	template <class Return, class... Arguments>
+	uint64_t
+	LRUCache<Return, Arguments...>::now_ns()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
 	template <class Return, class... Arguments>
 	void
 	LRUCache<Return, Arguments...>::move_to_front(Value *vp)
 	{
+		vp->used_ns = now_ns();
 		if (!m_last) {
 			// Create new LRU list
 			m_last = vp->fp = vp->bp = vp;
@@ -169,16 +190,56 @@ namespace crucible {
 	void
 	LRUCache<Return, Arguments...>::prune(function<bool(const Return &)> pred)
 	{
+		// Destroy removed values after we've released the lock
+		vector<Return> removed;
 		unique_lock<mutex> lock(m_mutex);
 		for (auto it = m_map.begin(); it != m_map.end(); ) {
-			auto next_it = ++it;
-			if (pred(it.second.ret)) {
-				erase_one(&it.second);
+			auto next_it = it;
+			++next_it;
+			if (pred(it->second.ret)) {
+				removed.push_back(it->second.ret);
+				erase_one(&it->second);
 			}
 			it = next_it;
 		}
 	}
 
+	template <class Return, class... Arguments>
+	size_t
+	LRUCache<Return, Arguments...>::prune_key(function<bool(const Key &)> pred)
+	{
+		// Destroy removed values after we've released the lock
+		vector<Return> removed;
+		unique_lock<mutex> lock(m_mutex);
+		for (auto it = m_map.begin(); it != m_map.end(); ) {
+			auto next_it = it;
+			++next_it;
+			if (pred(it->first)) {
+				removed.push_back(it->second.ret);
+				erase_one(&it->second);
+			}
+			it = next_it;
+		}
+		return removed.size();
+	}
+
+	template <class Return, class... Arguments>
+	size_t
+	LRUCache<Return, Arguments...>::expire_idle(double seconds)
+	{
+		const uint64_t idle_ns = seconds * 1000000000;
+		// Destroy removed values after we've released the lock
+		vector<Return> removed;
+		unique_lock<mutex> lock(m_mutex);
+		const uint64_t now = now_ns();
+		// The least recently used entry is at the back of the list
+		while (m_last && now - m_last->bp->used_ns >= idle_ns) {
+			removed.push_back(m_last->bp->ret);
+			erase_one(m_last->bp);
+		}
+		return removed.size();
+	}
+
 	template<class Return, class... Arguments>
 	Return
 	LRUCache<Return, Arguments...>::operator()(Arguments... args)
@@ -247,6 +308,20 @@ namespace crucible {
 		}
 	}
 
+	template<class Return, class... Arguments>
+	bool
+	LRUCache<Return, Arguments...>::peek(Return &ret, Arguments... args)
+	{
+		Key k(args...);
+		unique_lock<mutex> lock(m_mutex);
+		auto found = m_map.find(k);
+		if (found == m_map.end()) {
+			return false;
+		}
+		ret = found->second.ret;
+		return true;
+	}
+
 	template<class Return, class... Arguments>
 	Return
 	LRUCache<Return, Arguments...>::refresh(Arguments... args)
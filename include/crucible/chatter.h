@@ -1,6 +1,7 @@
 #ifndef CRUCIBLE_CHATTER_H
 #define CRUCIBLE_CHATTER_H
 
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <set>
@@ -29,6 +30,14 @@
       the output by the Chatter destructor.  You can also use std::endl
       explicitly, although it will not have the effect of flushing the
       buffer.
+
+      After enable_async(), the destructor queues the formatted text
+      in a per-thread lock-free queue instead of writing it, and a
+      single writer thread drains the queues to the output streams.
+      When queued text exceeds the byte limit or a queue is full, the
+      message is dropped and counted in dropped_count().  The byte limit
+      uses the total from the writer's last drain plus the thread's own
+      queue, so it can be exceeded briefly.
    */
 
 namespace crucible {
@@ -50,6 +59,11 @@ namespace crucible {
 		~Chatter();
 
 		static void enable_timestamp(bool prefix_timestamp);
+
+		static void enable_async(size_t max_bytes = 16 * 1024 * 1024);
+		// Writes all queued messages and stops the writer thread
+		static void disable_async();
+		static uint64_t dropped_count();
 	};
 
 	template <class Argument>
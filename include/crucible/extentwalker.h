@@ -3,6 +3,9 @@
 
 #include "crucible/fd.h"
 
+#include <memory>
+#include <mutex>
+
 namespace crucible {
 	using namespace std;
 
@@ -83,9 +86,60 @@ namespace crucible {
 	friend ostream & operator<<(ostream &os, const ExtentWalker &ew);
 	};
 
+	// Extent items of one file, shared by the BtrfsExtentWalkers that
+	// walk it.  Items are kept in one contiguous run.  While walkers move
+	// forward through the run, each tree search fetches twice as many
+	// items as the last, so big files are mapped in a few searches.
+	class BtrfsExtentMap {
+	public:
+		using Vec = ExtentWalker::Vec;
+
+		BtrfsExtentMap(Fd root_fd, uint64_t tree_id, uint64_t ino);
+
+		// Discard the extents if gen differs from the last call.
+		// Returns true if the extents were kept.
+		bool generation(uint64_t gen);
+
+		// Up to count extents beginning at pos or later, like
+		// ExtentWalker::get_extent_map.  st is the caller's fstat of
+		// the file.  Extents are discarded if its size or times changed.
+		Vec get_extent_map(off_t pos, size_t count, const Stat &st);
+
+		// Discard the extents, e.g. after the file was modified
+		void clear();
+
+		// Number of tree searches done by this map
+		uint64_t searches() const;
+
+	private:
+		mutable mutex	m_mutex;
+		Fd		m_root_fd;
+		uint64_t	m_tree_id;
+		uint64_t	m_ino;
+		uint64_t	m_generation = 0;
+		Stat		m_stat;
+
+		// All extent items with key offsets from m_begin to m_next,
+		// or to EOF if m_complete
+		Vec		m_extents;
+		off_t		m_begin = 0;
+		off_t		m_next = 0;
+		bool		m_complete = false;
+		size_t		m_fetch_size;
+		uint64_t	m_searches = 0;
+
+		static const size_t sc_fetch_min = 16;
+		static const size_t sc_fetch_max = 4096;
+		static const size_t sc_extents_max = 8192;
+
+		void clear_locked();
+		Vec fetch_locked(off_t pos, size_t count, off_t &next, bool &complete);
+	};
+
 	class BtrfsExtentWalker : public ExtentWalker {
 		uint64_t m_tree_id;
 		Fd m_root_fd;
+		shared_ptr<BtrfsExtentMap> m_map;
 
 	protected:
 		Vec get_extent_map(off_t pos) override;
@@ -94,6 +148,8 @@ namespace crucible {
 		BtrfsExtentWalker(Fd fd);
 		BtrfsExtentWalker(Fd fd, off_t initial_pos);
 		BtrfsExtentWalker(Fd fd, off_t initial_pos, Fd root_fd);
+		// Get extents from map instead of searching the tree
+		BtrfsExtentWalker(Fd fd, off_t initial_pos, shared_ptr<BtrfsExtentMap> map);
 		void set_root_fd(Fd fd);
 	};
 
@@ -1,10 +1,12 @@
 #ifndef CRUCIBLE_FD_H
 #define CRUCIBLE_FD_H
 
+#include "crucible/histogram.h"
 #include "crucible/resource.h"
 
 #include <cstring>
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -61,6 +63,11 @@ namespace crucible {
 	void set_relative_path(string path);
 	string relative_path();
 
+	// Latency of the open, pread and pwrite syscalls made through the functions below
+	extern LatencyHistogram latency_open;
+	extern LatencyHistogram latency_pread;
+	extern LatencyHistogram latency_pwrite;
+
 	// Functions named "foo_or_die" throw exceptions on failure.
 
 	// Attempt to open the file with the given mode
@@ -101,6 +108,8 @@ namespace crucible {
 	}
 
 	void pread_or_die(int fd, void *buf, size_t size, off_t offset);
+	// Same, with read_fn called in place of pread(2)
+	void pread_or_die(int fd, void *buf, size_t size, off_t offset, const function<ssize_t(int, void *, size_t, off_t)> &read_fn);
 	template <class T> void pread_or_die(int fd, T& buf, off_t offset)
 	{
 		return pread_or_die(fd, static_cast<void *>(&buf), sizeof(buf), offset);
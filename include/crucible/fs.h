@@ -2,6 +2,7 @@
 #define CRUCIBLE_FS_H
 
 #include "crucible/error.h"
+#include "crucible/histogram.h"
 
 // Terribly Linux-specific FS-wrangling functions
 
@@ -22,6 +23,12 @@
 namespace crucible {
 	using namespace std;
 
+	// Latency of the btrfs ioctls issued by the wrappers below
+	extern LatencyHistogram latency_extent_same;
+	extern LatencyHistogram latency_logical_ino;
+	extern LatencyHistogram latency_ino_paths;
+	extern LatencyHistogram latency_tree_search;
+
 	// wrapper around fallocate(...FALLOC_FL_PUNCH_HOLE...)
 	void punch_hole(int fd, off_t offset, off_t len);
 
@@ -166,6 +173,9 @@ namespace crucible {
 	// Helper functions
 	void btrfs_clone_range(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset);
 	bool btrfs_extent_same(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset);
+	// Same, and sets deduped to the length of the leading part that was deduped
+	// before the kernel found different data
+	bool btrfs_extent_same(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset, off_t &deduped);
 
 	struct BtrfsIoctlSearchHeader : public btrfs_ioctl_search_header {
 		BtrfsIoctlSearchHeader();
@@ -182,6 +192,9 @@ namespace crucible {
 		virtual bool do_ioctl_nothrow(int fd);
 		virtual void do_ioctl(int fd);
 
+		// Decode a btrfs_ioctl_search_args_v2 buffer filled in by the kernel
+		void set_result(const vector<char> &ioctl_arg);
+
 		// Copy objectid/type/offset so we move forward
 		void next_min(const BtrfsIoctlSearchHeader& ref);
 
@@ -199,6 +212,24 @@ namespace crucible {
 	uint64_t btrfs_get_root_id(int fd);
 	uint64_t btrfs_get_root_transid(int fd);
 
+	// Generation of inode ino in subvol root, or 0 if there is no such inode
+	uint64_t btrfs_get_inode_generation(int fd, uint64_t root, uint64_t ino);
+
+	// btrfs file handle without the parent directory, from
+	// fs/btrfs/export.h and linux/exportfs.h, which are not in uapi
+	struct btrfs_fid_non_connectable {
+		uint64_t objectid;
+		uint64_t root_objectid;
+		uint32_t gen;
+	} __attribute__((packed));
+	const int FILEID_BTRFS_WITHOUT_PARENT = 0x4d;
+
+	// Open inode ino in subvol root by btrfs file handle, like openat(2).
+	// mount_fd is any fd on the filesystem.  Fails with ESTALE if the
+	// inode does not exist or has a different generation.  Needs
+	// CAP_DAC_READ_SEARCH.
+	int btrfs_open_by_handle(int mount_fd, uint64_t root, uint64_t ino, uint32_t generation, int flags);
+
 	template<class T>
 	const T*
 	get_struct_ptr(vector<char> &v, size_t offset = 0)
@@ -0,0 +1,63 @@
+#ifndef CRUCIBLE_HISTOGRAM_H
+#define CRUCIBLE_HISTOGRAM_H
+
+#include "crucible/time.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace crucible {
+	using namespace std;
+
+	// Lock-free log-linear latency histogram in nanoseconds.
+	// Each power of two is divided into 2^c_sub_bits linear buckets,
+	// so any recorded value is within about 6% of its bucket's bounds.
+	class LatencyHistogram {
+	public:
+		static const unsigned c_sub_bits = 4;
+		static const size_t c_sub_count = 1 << c_sub_bits;
+		static const size_t c_bucket_count = (64 - c_sub_bits + 1) * c_sub_count;
+
+		LatencyHistogram();
+
+		void add(uint64_t ns);
+		void add_seconds(double seconds);
+
+		uint64_t count() const;
+		uint64_t sum() const;
+		uint64_t max() const;
+		double mean() const;
+
+		// Upper bound of the bucket containing the given fraction of samples
+		uint64_t percentile(double fraction) const;
+
+		static size_t bucket_of(uint64_t ns);
+		static uint64_t bucket_low(size_t bucket);
+		static uint64_t bucket_high(size_t bucket);
+
+	private:
+		atomic<uint64_t>	m_buckets[c_bucket_count];
+		atomic<uint64_t>	m_count;
+		atomic<uint64_t>	m_sum;
+		atomic<uint64_t>	m_max;
+
+		LatencyHistogram(const LatencyHistogram &) = delete;
+		LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+	};
+
+	// Writes count, p50, p99, p999 and max in milliseconds
+	ostream &operator<<(ostream &os, const LatencyHistogram &lh);
+
+	// Adds the lifetime of this object to a histogram
+	class LatencyTimer {
+		LatencyHistogram	&m_histogram;
+		Timer			m_timer;
+	public:
+		LatencyTimer(LatencyHistogram &histogram);
+		~LatencyTimer();
+	};
+
+}
+
+#endif // CRUCIBLE_HISTOGRAM_H
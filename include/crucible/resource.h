@@ -4,11 +4,12 @@
 #include "crucible/error.h"
 
 #include <cassert>
-#include <map>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <iostream>
 #include <stdexcept>
+#include <unordered_map>
 
 namespace crucible {
 	using namespace std;
@@ -46,17 +47,26 @@ namespace crucible {
 	private:
 		using traits_type = ResourceTraits<Key, Resource>;
 		using weak_ptr_type = weak_ptr<Resource>;
-		using map_type = map<key_type, weak_ptr_type>;
+		using map_type = unordered_map<key_type, weak_ptr_type>;
+
+		// The registry is split into independently locked shards
+		// so that unrelated keys do not contend for one mutex.
+		// Each shard is padded to a cache line to avoid false sharing.
+		static const size_t c_shard_count = 64;
+		struct alignas(64) Shard {
+			mutex		m_mutex;
+			map_type	m_map;
+		};
 
 		// The only instance variable
 		resource_ptr_type m_ptr;
 
 		// A bunch of static variables and functions
-		static mutex s_map_mutex;
-		static map_type s_map;
+		static Shard s_shards[c_shard_count];
+		static Shard &shard_for(const key_type &key);
 		static resource_ptr_type insert(const key_type &key);
 		static resource_ptr_type insert(const resource_ptr_type &res);
-		static void clean_locked();
+		static void release(resource_ptr_type &ptr);
 		static ResourceTraits<Key, Resource> s_traits;
 
 	public:
@@ -87,8 +97,10 @@ namespace crucible {
 		ResourceHandle() = default;
 		ResourceHandle(const ResourceHandle &that) = default;
 		ResourceHandle(ResourceHandle &&that) = default;
-		ResourceHandle& operator=(const ResourceHandle &that) = default;
-		ResourceHandle& operator=(ResourceHandle &&that) = default;
+
+		// Assignment drops the old Resource the same way the destructor does
+		ResourceHandle& operator=(const ResourceHandle &that);
+		ResourceHandle& operator=(ResourceHandle &&that);
 
 		// Nontrivial destructor
 		~ResourceHandle();
@@ -160,17 +172,10 @@ namespace crucible {
 	}
 
 	template <class Key, class Resource>
-	void
-	ResourceHandle<Key, Resource>::clean_locked()
+	typename ResourceHandle<Key, Resource>::Shard &
+	ResourceHandle<Key, Resource>::shard_for(const key_type &key)
 	{
-		// Must be called with lock held
-		for (auto i = s_map.begin(); i != s_map.end(); ) {
-			auto this_i = i;
-			++i;
-			if (this_i->second.expired()) {
-				s_map.erase(this_i);
-			}
-		}
+		return s_shards[hash<key_type>()(key) % c_shard_count];
 	}
 
 	template <class Key, class Resource>
@@ -181,22 +186,21 @@ namespace crucible {
 		if (s_traits.is_null_key(key)) {
 			return resource_ptr_type();
 		}
-		unique_lock<mutex> lock(s_map_mutex);
-		auto found = s_map.find(key);
-		if (found != s_map.end()) {
-			resource_ptr_type rv = found->second.lock();
-			if (rv) {
-				// Use existing Resource
-				return rv;
-			} else {
-				// It's OK for the map to temporarily contain an expired weak_ptr to some dead Resource
-				clean_locked();
-			}
+		Shard &shard = shard_for(key);
+		unique_lock<mutex> lock(shard.m_mutex);
+		// It's OK for the map to temporarily contain an expired weak_ptr to some dead Resource.
+		// We simply overwrite it here, so stale entries never outnumber distinct keys.
+		auto &slot = shard.m_map[key];
+		resource_ptr_type rv = slot.lock();
+		// A Resource that was closed early no longer owns this key
+		if (rv && s_traits.get_key(*rv) == key) {
+			// Use existing Resource
+			return rv;
 		}
 		// not found or expired, throw any existing ref away and make a new one
 		resource_ptr_type rpt = s_traits.make_resource(key);
 		// store weak_ptr in map
-		s_map[key] = rpt;
+		slot = rpt;
 		// return shared_ptr
 		return rpt;
 	};
@@ -213,29 +217,59 @@ namespace crucible {
 		if (s_traits.is_null_key(key)) {
 			return resource_ptr_type();
 		}
-		unique_lock<mutex> lock(s_map_mutex);
+		Shard &shard = shard_for(key);
+		unique_lock<mutex> lock(shard.m_mutex);
 		// find Resource for non-null key
-		auto found = s_map.find(key);
-		if (found != s_map.end()) {
-			resource_ptr_type rv = found->second.lock();
-			// It's OK for the map to temporarily contain an expired weak_ptr to some dead Resource...
-			if (rv) {
-				// ...but not a duplicate Resource.
-				if (rv.owner_before(res) || res.owner_before(rv)) {
-					throw duplicate_resource(key);
-				}
-				// Use the existing Resource (discard the caller's).
-				return rv;
-			} else {
-				// Clean out expired weak_ptrs
-				clean_locked();
+		auto &slot = shard.m_map[key];
+		resource_ptr_type rv = slot.lock();
+		// It's OK for the map to temporarily contain an expired weak_ptr to some dead Resource...
+		if (rv && s_traits.get_key(*rv) == key) {
+			// ...but not a duplicate Resource.
+			if (rv.owner_before(res) || res.owner_before(rv)) {
+				throw duplicate_resource(key);
 			}
+			// Use the existing Resource (discard the caller's).
+			return rv;
 		}
 		// not found or expired, make a new one or replace old one
-		s_map[key] = res;
+		slot = res;
 		return res;
 	};
 
+	template <class Key, class Resource>
+	void
+	ResourceHandle<Key, Resource>::release(resource_ptr_type &ptr)
+	{
+		// No pointer, nothing to do
+		if (!ptr) {
+			return;
+		}
+		// Save key so we can clean the map
+		auto key = s_traits.get_key(*ptr);
+		// Save a weak_ptr so we can tell if we need to clean the map
+		weak_ptr_type wp = ptr;
+		// Drop shared_ptr
+		ptr.reset();
+		// If there are still other references to the shared_ptr, we can stop now
+		if (!wp.expired()) {
+			return;
+		}
+		// Resource was closed early, its key is gone.  insert() will
+		// overwrite the stale entry when the key value is reused.
+		if (s_traits.is_null_key(key)) {
+			return;
+		}
+		// Remove weak_ptr from map if it has expired
+		// (and not been replaced in the meantime)
+		Shard &shard = shard_for(key);
+		unique_lock<mutex> lock_map(shard.m_mutex);
+		auto found = shard.m_map.find(key);
+		// Map entry may have been replaced, so check for expiry again
+		if (found != shard.m_map.end() && found->second.expired()) {
+			shard.m_map.erase(found);
+		}
+	}
+
 	template <class Key, class Resource>
 	ResourceHandle<Key, Resource>::ResourceHandle(const key_type &key)
 	{
@@ -246,7 +280,9 @@ namespace crucible {
 	ResourceHandle<Key, Resource>&
 	ResourceHandle<Key, Resource>::operator=(const key_type &key)
 	{
-		m_ptr = insert(key);
+		resource_ptr_type new_ptr = insert(key);
+		release(m_ptr);
+		m_ptr = new_ptr;
 		return *this;
 	}
 
@@ -260,35 +296,37 @@ namespace crucible {
 	ResourceHandle<Key, Resource>&
 	ResourceHandle<Key, Resource>::operator=(const resource_ptr_type &res)
 	{
-		m_ptr = insert(res);
+		resource_ptr_type new_ptr = insert(res);
+		release(m_ptr);
+		m_ptr = new_ptr;
+		return *this;
+	}
+
+	template <class Key, class Resource>
+	ResourceHandle<Key, Resource>&
+	ResourceHandle<Key, Resource>::operator=(const ResourceHandle &that)
+	{
+		resource_ptr_type new_ptr = that.m_ptr;
+		release(m_ptr);
+		m_ptr = new_ptr;
+		return *this;
+	}
+
+	template <class Key, class Resource>
+	ResourceHandle<Key, Resource>&
+	ResourceHandle<Key, Resource>::operator=(ResourceHandle &&that)
+	{
+		resource_ptr_type new_ptr;
+		new_ptr.swap(that.m_ptr);
+		release(m_ptr);
+		m_ptr = new_ptr;
 		return *this;
 	}
 
 	template <class Key, class Resource>
 	ResourceHandle<Key, Resource>::~ResourceHandle()
 	{
-		// No pointer, nothing to do
-		if (!m_ptr) {
-			return;
-		}
-		// Save key so we can clean the map
-		auto key = s_traits.get_key(*m_ptr);
-		// Save a weak_ptr so we can tell if we need to clean the map
-		weak_ptr_type wp = m_ptr;
-		// Drop shared_ptr
-		m_ptr.reset();
-		// If there are still other references to the shared_ptr, we can stop now
-		if (!wp.expired()) {
-			return;
-		}
-		// Remove weak_ptr from map if it has expired
-		// (and not been replaced in the meantime)
-		unique_lock<mutex> lock_map(s_map_mutex);
-		auto found = s_map.find(key);
-		// Map entry may have been replaced, so check for expiry again
-		if (found != s_map.end() && found->second.expired()) {
-			s_map.erase(key);
-		}
+		release(m_ptr);
 	}
 
 	template <class Key, class Resource>
@@ -353,10 +391,7 @@ namespace crucible {
 	ResourceTraits<Key, Resource> ResourceHandle<Key, Resource>::s_traits;
 
 	template <class Key, class Resource>
-	mutex ResourceHandle<Key, Resource>::s_map_mutex;
-
-	template <class Key, class Resource>
-	typename ResourceHandle<Key, Resource>::map_type ResourceHandle<Key, Resource>::s_map;
+	typename ResourceHandle<Key, Resource>::Shard ResourceHandle<Key, Resource>::s_shards[ResourceHandle<Key, Resource>::c_shard_count];
 
 }
 
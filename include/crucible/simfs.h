@@ -0,0 +1,131 @@
+#ifndef CRUCIBLE_SIMFS_H
+#define CRUCIBLE_SIMFS_H
+
+#include "crucible/backend.h"
+#include "crucible/fd.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <vector>
+
+namespace crucible {
+	using namespace std;
+
+	// In-memory btrfs backend for unprivileged tests and benchmarks.
+	//
+	// Files are memfds, so they have real fds, inode numbers and sizes,
+	// but their extents, data and backrefs are simulated.  Each block of
+	// an extent has a content id:  blocks with the same id contain the
+	// same data, and id 0 is all zeros.  Calls with fds that are not
+	// simulated files are passed to the kernel.
+	//
+	// Implements the parts of TREE_SEARCH_V2 (INODE_ITEM, EXTENT_DATA and
+	// ROOT_ITEM), LOGICAL_INO, INO_PATHS, INO_LOOKUP, FILE_EXTENT_SAME,
+	// pread and open_by_handle_at that bees uses, with an optional fixed
+	// latency for each.
+	class BtrfsSimulator : public BtrfsBackend {
+	public:
+		enum Op {
+			TREE_SEARCH,
+			LOGICAL_INO,
+			INO_PATHS,
+			INO_LOOKUP,
+			EXTENT_SAME,
+			PREAD,
+			OPEN_BY_HANDLE,
+			OP_MAX,
+		};
+		static const char *op_name(Op op);
+
+		static const uint64_t c_block_size = 4096;
+
+		BtrfsSimulator();
+
+		// Create an empty file in subvol root
+		Fd add_file(uint64_t root);
+
+		// Create an extent with one block for each content id.  Returns its bytenr.
+		uint64_t add_extent(const vector<uint64_t> &contents, bool compressed = false);
+
+		// Map length bytes of the extent at bytenr, starting extent_offset
+		// bytes into the extent, to offset in the file.  Replaces any
+		// existing mapping in that range.
+		void add_ref(int fd, off_t offset, uint64_t bytenr, off_t extent_offset, off_t length);
+
+		// add_extent and add_ref for the whole extent
+		uint64_t write(int fd, off_t offset, const vector<uint64_t> &contents, bool compressed = false);
+
+		// Start a new transaction.  Returns the new transid.
+		uint64_t commit();
+		uint64_t transid() const;
+
+		// Sleep this long in each call of op
+		void latency(Op op, double seconds);
+		uint64_t count(Op op) const;
+
+		// Number of file refs to the extent at bytenr, 0 if it was freed
+		size_t extent_refs(uint64_t bytenr) const;
+
+		// Data of one block with the given content id
+		static void block_data(uint64_t content, uint8_t *buf);
+
+		int tree_search_v2(int fd, btrfs_ioctl_search_args_v2 *args) override;
+		int logical_ino(int fd, unsigned long request, btrfs_ioctl_logical_ino_args *args) override;
+		int ino_paths(int fd, btrfs_ioctl_ino_path_args *args) override;
+		int ino_lookup(int fd, btrfs_ioctl_ino_lookup_args *args) override;
+		int file_extent_same(int fd, btrfs_ioctl_same_args *args) override;
+		ssize_t pread(int fd, void *buf, size_t size, off_t offset) override;
+		int open_by_handle(int mount_fd, file_handle *handle, int flags) override;
+
+	private:
+		struct Ref {
+			uint64_t m_bytenr;
+			uint64_t m_extent_offset;
+			uint64_t m_length;
+			uint64_t m_generation;
+		};
+
+		struct File {
+			uint64_t m_root;
+			uint64_t m_ino;
+			uint64_t m_generation;
+			uint64_t m_size = 0;
+			Fd m_fd;
+			map<uint64_t, Ref> m_refs;
+		};
+
+		// (root, ino, file offset)
+		using Backref = tuple<uint64_t, uint64_t, uint64_t>;
+
+		struct Extent {
+			vector<uint64_t> m_contents;
+			uint64_t m_disk_bytes;
+			bool m_compressed;
+			set<Backref> m_backrefs;
+		};
+
+		mutable mutex m_mutex;
+		dev_t m_dev = 0;
+		map<uint64_t, File> m_files;
+		map<uint64_t, Extent> m_extents;
+		map<uint64_t, uint64_t> m_root_generation;
+		uint64_t m_next_bytenr;
+		uint64_t m_transid = 1;
+		atomic<uint64_t> m_latency_ns[OP_MAX];
+		atomic<uint64_t> m_count[OP_MAX];
+
+		void enter(Op op);
+		File *find_file(int fd);
+		uint64_t content_at(const File &f, uint64_t offset) const;
+		void insert_ref(File &f, uint64_t offset, const Ref &ref);
+		void erase_ref(File &f, map<uint64_t, Ref>::iterator it);
+		void split_at(File &f, uint64_t offset);
+		void punch(File &f, uint64_t begin, uint64_t end);
+		void set_size(File &f, uint64_t size);
+	};
+}
+
+#endif // CRUCIBLE_SIMFS_H
@@ -0,0 +1,87 @@
+#include "crucible/backend.h"
+
+#include "crucible/fd.h"
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace crucible {
+	using namespace std;
+
+	BtrfsBackend::~BtrfsBackend()
+	{
+	}
+
+	int
+	BtrfsBackend::tree_search_v2(int fd, btrfs_ioctl_search_args_v2 *args)
+	{
+		return ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args);
+	}
+
+	int
+	BtrfsBackend::logical_ino(int fd, unsigned long request, btrfs_ioctl_logical_ino_args *args)
+	{
+		return ioctl(fd, request, args);
+	}
+
+	int
+	BtrfsBackend::ino_paths(int fd, btrfs_ioctl_ino_path_args *args)
+	{
+		return ioctl(fd, BTRFS_IOC_INO_PATHS, args);
+	}
+
+	int
+	BtrfsBackend::ino_lookup(int fd, btrfs_ioctl_ino_lookup_args *args)
+	{
+		return ioctl(fd, BTRFS_IOC_INO_LOOKUP, args);
+	}
+
+	int
+	BtrfsBackend::file_extent_same(int fd, btrfs_ioctl_same_args *args)
+	{
+		return ioctl(fd, BTRFS_IOC_FILE_EXTENT_SAME, args);
+	}
+
+	ssize_t
+	BtrfsBackend::pread(int fd, void *buf, size_t size, off_t offset)
+	{
+		return ::pread(fd, buf, size, offset);
+	}
+
+	int
+	BtrfsBackend::open_by_handle(int mount_fd, file_handle *handle, int flags)
+	{
+		return open_by_handle_at(mount_fd, handle, flags);
+	}
+
+	static
+	shared_ptr<BtrfsBackend> &
+	btrfs_backend_ptr()
+	{
+		static shared_ptr<BtrfsBackend> s_backend = make_shared<BtrfsBackend>();
+		return s_backend;
+	}
+
+	void
+	btrfs_backend(shared_ptr<BtrfsBackend> backend)
+	{
+		if (!backend) {
+			backend = make_shared<BtrfsBackend>();
+		}
+		atomic_store(&btrfs_backend_ptr(), backend);
+	}
+
+	shared_ptr<BtrfsBackend>
+	btrfs_backend()
+	{
+		return atomic_load(&btrfs_backend_ptr());
+	}
+
+	void
+	btrfs_pread_or_die(int fd, void *buf, size_t size, off_t offset)
+	{
+		return pread_or_die(fd, buf, size, offset, [](int fd, void *buf, size_t size, off_t offset) {
+			return btrfs_backend()->pread(fd, buf, size, offset);
+		});
+	}
+}
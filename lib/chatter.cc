@@ -3,12 +3,16 @@
 #include "crucible/path.h"
 #include "crucible/process.h"
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <ctime>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 
 #include <pthread.h>
 
@@ -44,6 +48,248 @@ namespace crucible {
 		}
 	}
 
+	// Asynchronous output ----------------------------------------
+
+	struct ChatterMessage {
+		ostream	*m_os = nullptr;
+		string	m_text;
+	};
+
+	// Single producer (the owning thread), single consumer (the writer thread).
+	// Queues are never freed.  When a thread exits, its queue is released
+	// for reuse by another thread.  Messages are stored by value, and all
+	// counters are per queue, so queueing a message doesn't allocate or
+	// write to memory shared with other producers.
+	struct ChatterQueue {
+		static const size_t c_size = 1024;
+		ChatterMessage		m_ring[c_size];
+		// Written by the producer
+		atomic<size_t>		m_head;
+		atomic<size_t>		m_pushed_bytes;
+		atomic<uint64_t>	m_dropped;
+		atomic<bool>		m_pushing;
+		// Written by the consumer
+		atomic<size_t>		m_tail;
+		atomic<size_t>		m_popped_bytes;
+		atomic<bool>		m_in_use;
+		ChatterQueue		*m_next = nullptr;
+		ChatterQueue() :
+			m_head(0), m_pushed_bytes(0), m_dropped(0), m_pushing(false),
+			m_tail(0), m_popped_bytes(0), m_in_use(true) { }
+	};
+
+	static atomic<ChatterQueue*> chatter_queues(nullptr);
+	static atomic<bool> chatter_async(false);
+	// Bytes queued in all queues, updated by the writer after each drain
+	static atomic<size_t> chatter_queued_bytes(0);
+	static atomic<size_t> chatter_max_bytes(0);
+	static atomic<bool> chatter_writer_waiting(false);
+	static mutex chatter_writer_mutex;
+	static condition_variable chatter_writer_condvar;
+	static bool chatter_writer_stop = false;
+	static shared_ptr<thread> chatter_writer;
+
+	static thread_local ChatterQueue *tl_chatter_queue = nullptr;
+	static thread_local bool tl_chatter_exited = false;
+
+	struct ChatterQueueOwner {
+		~ChatterQueueOwner();
+	};
+
+	static thread_local ChatterQueueOwner chatter_queue_owner;
+
+	ChatterQueueOwner::~ChatterQueueOwner()
+	{
+		tl_chatter_exited = true;
+		if (tl_chatter_queue) {
+			tl_chatter_queue->m_in_use.store(false, memory_order_release);
+			tl_chatter_queue = nullptr;
+		}
+	}
+
+	static
+	ChatterQueue *
+	chatter_get_queue()
+	{
+		if (tl_chatter_queue) {
+			return tl_chatter_queue;
+		}
+		// Thread-local destructors have run, don't resurrect them
+		if (tl_chatter_exited) {
+			return nullptr;
+		}
+		// Register the destructor that releases the queue
+		(void)&chatter_queue_owner;
+		for (auto q = chatter_queues.load(memory_order_acquire); q; q = q->m_next) {
+			bool expected = false;
+			if (q->m_in_use.compare_exchange_strong(expected, true, memory_order_acquire)) {
+				tl_chatter_queue = q;
+				return q;
+			}
+		}
+		auto q = new ChatterQueue;
+		q->m_next = chatter_queues.load(memory_order_relaxed);
+		while (!chatter_queues.compare_exchange_weak(q->m_next, q, memory_order_release, memory_order_relaxed)) {
+		}
+		tl_chatter_queue = q;
+		return q;
+	}
+
+	// Returns false if the caller should write the text itself
+	static
+	bool
+	chatter_push(ostream &os, string &text)
+	{
+		if (!chatter_async.load(memory_order_relaxed)) {
+			return false;
+		}
+		auto q = chatter_get_queue();
+		if (!q) {
+			return false;
+		}
+		// disable_async waits for m_pushing to be cleared before its
+		// final drain.  Both sides use sequentially consistent
+		// operations, so either we see async disabled here or
+		// disable_async sees m_pushing set.
+		q->m_pushing.store(true);
+		if (!chatter_async.load()) {
+			q->m_pushing.store(false, memory_order_release);
+			return false;
+		}
+		const auto size = text.size();
+		const auto pending = q->m_pushed_bytes.load(memory_order_relaxed) - q->m_popped_bytes.load(memory_order_relaxed);
+		const auto head = q->m_head.load(memory_order_relaxed);
+		// The total from the last drain plus our own queue is close
+		// enough, and needs no shared counter writes
+		if (chatter_queued_bytes.load(memory_order_relaxed) + pending + size > chatter_max_bytes.load(memory_order_relaxed)
+			|| head - q->m_tail.load(memory_order_acquire) >= ChatterQueue::c_size) {
+			q->m_dropped.store(q->m_dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			q->m_pushing.store(false, memory_order_release);
+			return true;
+		}
+		auto &msg = q->m_ring[head % ChatterQueue::c_size];
+		msg.m_os = &os;
+		msg.m_text.swap(text);
+		q->m_pushed_bytes.store(q->m_pushed_bytes.load(memory_order_relaxed) + size, memory_order_relaxed);
+		q->m_head.store(head + 1, memory_order_release);
+		q->m_pushing.store(false, memory_order_release);
+		if (chatter_writer_waiting.load(memory_order_relaxed)) {
+			chatter_writer_condvar.notify_one();
+		}
+		return true;
+	}
+
+	// Only one thread may drain at a time
+	static
+	size_t
+	chatter_drain()
+	{
+		size_t count = 0;
+		size_t queued_bytes = 0;
+		set<ostream *> streams;
+		for (auto q = chatter_queues.load(memory_order_acquire); q; q = q->m_next) {
+			auto tail = q->m_tail.load(memory_order_relaxed);
+			const auto head = q->m_head.load(memory_order_acquire);
+			auto popped_bytes = q->m_popped_bytes.load(memory_order_relaxed);
+			for (; tail < head; ++tail) {
+				auto &msg = q->m_ring[tail % ChatterQueue::c_size];
+				*msg.m_os << msg.m_text;
+				streams.insert(msg.m_os);
+				popped_bytes += msg.m_text.size();
+				msg.m_text.clear();
+				++count;
+			}
+			q->m_popped_bytes.store(popped_bytes, memory_order_relaxed);
+			q->m_tail.store(tail, memory_order_release);
+			queued_bytes += q->m_pushed_bytes.load(memory_order_relaxed) - popped_bytes;
+		}
+		chatter_queued_bytes.store(queued_bytes, memory_order_relaxed);
+		for (auto os : streams) {
+			*os << flush;
+		}
+		return count;
+	}
+
+	static
+	void
+	chatter_writer_loop()
+	{
+		uint64_t reported_dropped = Chatter::dropped_count();
+		while (true) {
+			const auto count = chatter_drain();
+			const auto dropped = Chatter::dropped_count();
+			if (dropped != reported_dropped) {
+				cerr << "chatter: " << dropped - reported_dropped << " log messages dropped, " << dropped << " total" << endl;
+				reported_dropped = dropped;
+			}
+			if (count) {
+				continue;
+			}
+			unique_lock<mutex> lock(chatter_writer_mutex);
+			if (chatter_writer_stop) {
+				break;
+			}
+			// Producers don't take the lock, so a wakeup can be missed.
+			// The timeout bounds the delay.
+			chatter_writer_waiting.store(true);
+			chatter_writer_condvar.wait_for(lock, chrono::milliseconds(100));
+			chatter_writer_waiting.store(false);
+		}
+		chatter_drain();
+	}
+
+	void
+	Chatter::enable_async(size_t max_bytes)
+	{
+		unique_lock<mutex> lock(chatter_writer_mutex);
+		chatter_max_bytes.store(max_bytes);
+		if (chatter_writer) {
+			return;
+		}
+		static bool registered_atexit = false;
+		if (!registered_atexit) {
+			DIE_IF_NON_ZERO(atexit(Chatter::disable_async));
+			registered_atexit = true;
+		}
+		chatter_writer_stop = false;
+		chatter_writer = make_shared<thread>(chatter_writer_loop);
+		chatter_async.store(true, memory_order_release);
+	}
+
+	void
+	Chatter::disable_async()
+	{
+		unique_lock<mutex> lock(chatter_writer_mutex);
+		chatter_async.store(false);
+		auto writer = chatter_writer;
+		chatter_writer.reset();
+		if (!writer) {
+			return;
+		}
+		chatter_writer_stop = true;
+		chatter_writer_condvar.notify_all();
+		lock.unlock();
+		writer->join();
+		// Wait for threads that saw chatter_async before it was cleared
+		// to finish queueing their messages, then write them
+		for (auto q = chatter_queues.load(memory_order_acquire); q; q = q->m_next) {
+			while (q->m_pushing.load()) {
+				this_thread::yield();
+			}
+		}
+		chatter_drain();
+	}
+
+	uint64_t
+	Chatter::dropped_count()
+	{
+		uint64_t rv = 0;
+		for (auto q = chatter_queues.load(memory_order_acquire); q; q = q->m_next) {
+			rv += q->m_dropped.load(memory_order_relaxed);
+		}
+		return rv;
+	}
+
 	Chatter::Chatter(int loglevel, string name, ostream &os)
 		: m_loglevel(loglevel), m_name(name), m_os(os)
 	{
@@ -84,19 +330,24 @@ namespace crucible {
 		string out = m_oss.str();
 		string header = header_stream.str();
 
+		string text;
 		string::size_type start = 0;
 		while (start < out.size()) {
 			size_t end_line = out.find_first_of("\n", start);
 			if (end_line != string::npos) {
 				assert(out[end_line] == '\n');
 				size_t end = end_line;
-				m_os << (header + out.substr(start, end - start) + "\n") << flush;
+				text += header + out.substr(start, end - start) + "\n";
 				start = end_line + 1;
 			} else {
-				m_os << (header + out.substr(start) + "\n") << flush;
+				text += header + out.substr(start) + "\n";
 				start = out.size();
 			}
 		}
+
+		if (!text.empty() && !chatter_push(m_os, text)) {
+			m_os << text << flush;
+		}
 	}
 
 	Chatter::Chatter(Chatter &&c)
@@ -6,10 +6,15 @@
 #include "crucible/limits.h"
 #include "crucible/string.h"
 
+#include <algorithm>
+
 namespace crucible {
 	using namespace std;
 
 	const off_t ExtentWalker::sc_step_size;
+	const size_t BtrfsExtentMap::sc_fetch_min;
+	const size_t BtrfsExtentMap::sc_fetch_max;
+	const size_t BtrfsExtentMap::sc_extents_max;
 
 	// fm_start, fm_length, fm_flags, m_extents
 	// fe_logical, fe_physical, fe_length, fe_flags
@@ -467,35 +472,45 @@ namespace crucible {
 		seek(initial_pos);
 	}
 
-	BtrfsExtentWalker::Vec
-	BtrfsExtentWalker::get_extent_map(off_t pos)
+	BtrfsExtentWalker::BtrfsExtentWalker(Fd fd, off_t initial_pos, shared_ptr<BtrfsExtentMap> map) :
+		ExtentWalker(fd),
+		m_tree_id(0),
+		m_map(map)
 	{
-		BtrfsIoctlSearchKey sk(sc_extent_fetch_max * (sizeof(btrfs_file_extent_item) + sizeof(btrfs_ioctl_search_header)));
-		if (!m_root_fd) {
-			m_root_fd = m_fd;
-		}
-		if (!m_tree_id) {
-			m_tree_id = btrfs_get_root_id(m_fd);
-		}
-		sk.tree_id = m_tree_id;
-		sk.min_objectid = m_stat.st_ino;
+		THROW_CHECK0(invalid_argument, map);
+		seek(initial_pos);
+	}
+
+	// Up to count EXTENT_DATA items of inode ino in tree tree_id with key
+	// offset pos or later.  next is set to the key offset after the last
+	// item, and complete is set if the inode has no more items.
+	static
+	ExtentWalker::Vec
+	btrfs_extent_items(int root_fd, uint64_t tree_id, uint64_t ino, off_t file_size, off_t pos, size_t count, off_t &next, bool &complete)
+	{
+		// Leave room for an inline extent so a full buffer can't
+		// be mistaken for the end of the file
+		BtrfsIoctlSearchKey sk(count * (sizeof(btrfs_file_extent_item) + sizeof(btrfs_ioctl_search_header)) + 4096);
+		sk.tree_id = tree_id;
+		sk.min_objectid = ino;
 		sk.max_objectid = numeric_limits<uint64_t>::max();
 		sk.min_offset = ranged_cast<uint64_t>(pos);
 		sk.max_offset = numeric_limits<uint64_t>::max();
 		sk.min_transid = 0;
 		sk.max_transid = numeric_limits<uint64_t>::max();
 		sk.min_type = sk.max_type = BTRFS_EXTENT_DATA_KEY;
-		sk.nr_items = sc_extent_fetch_max;
+		sk.nr_items = count;
 
-		CHATTER_UNWIND("sk " << sk << " root_fd " << name_fd(m_root_fd));
-		sk.do_ioctl(m_root_fd);
+		CHATTER_UNWIND("sk " << sk << " root_fd " << name_fd(root_fd));
+		sk.do_ioctl(root_fd);
 
-		Vec rv;
+		ExtentWalker::Vec rv;
+		next = pos;
 
 		bool past_eof = false;
 		for (auto i : sk.m_result) {
 			// If we're seeing extents from the next file then we're past EOF on this file
-			if (i.objectid > m_stat.st_ino) {
+			if (i.objectid > ino) {
 				past_eof = true;
 				break;
 			}
@@ -506,10 +521,11 @@ namespace crucible {
 			}
 
 			// Hmmmkay we shouldn't be seeing these
-			if (i.objectid < m_stat.st_ino) {
-				THROW_ERROR(out_of_range, "objectid " << i.objectid << " < m_stat.st_ino " << m_stat.st_ino);
+			if (i.objectid < ino) {
+				THROW_ERROR(out_of_range, "objectid " << i.objectid << " < ino " << ino);
 				continue;
 			}
+			next = i.offset + 1;
 
 			Extent e;
 			e.m_begin = i.offset;
@@ -523,7 +539,7 @@ namespace crucible {
 			off_t len = -1;
 			switch (type) {
 				default:
-					cerr << "Unhandled file extent type " << type << " in root " << m_tree_id << " ino " << m_stat.st_ino << endl;
+					cerr << "Unhandled file extent type " << type << " in root " << tree_id << " ino " << ino << endl;
 					break;
 				case BTRFS_FILE_EXTENT_INLINE:
 					len = ranged_cast<off_t>(call_btrfs_get(btrfs_stack_file_extent_ram_bytes, i.m_data));
@@ -593,7 +609,7 @@ namespace crucible {
 			}
 			if (len > 0) {
 				e.m_end = e.m_begin + len;
-				if (e.m_end >= m_stat.st_size) {
+				if (e.m_end >= file_size) {
 					e.m_flags |= FIEMAP_EXTENT_LAST;
 				}
 				// FIXME:  no FIEMAP_EXTENT_SHARED
@@ -607,9 +623,147 @@ namespace crucible {
 			rv.rbegin()->m_flags |= FIEMAP_EXTENT_LAST;
 		}
 
+		complete = past_eof || sk.m_result.size() < count;
 		return rv;
 	}
 
+	BtrfsExtentWalker::Vec
+	BtrfsExtentWalker::get_extent_map(off_t pos)
+	{
+		if (m_map) {
+			return m_map->get_extent_map(pos, sc_extent_fetch_max, m_stat);
+		}
+		if (!m_root_fd) {
+			m_root_fd = m_fd;
+		}
+		if (!m_tree_id) {
+			m_tree_id = btrfs_get_root_id(m_fd);
+		}
+		off_t next;
+		bool complete;
+		return btrfs_extent_items(m_root_fd, m_tree_id, m_stat.st_ino, m_stat.st_size, pos, sc_extent_fetch_max, next, complete);
+	}
+
+	BtrfsExtentMap::BtrfsExtentMap(Fd root_fd, uint64_t tree_id, uint64_t ino) :
+		m_root_fd(root_fd),
+		m_tree_id(tree_id),
+		m_ino(ino),
+		m_fetch_size(sc_fetch_min)
+	{
+	}
+
+	void
+	BtrfsExtentMap::clear_locked()
+	{
+		m_extents.clear();
+		m_begin = 0;
+		m_next = 0;
+		m_complete = false;
+		m_fetch_size = sc_fetch_min;
+	}
+
+	void
+	BtrfsExtentMap::clear()
+	{
+		unique_lock<mutex> lock(m_mutex);
+		clear_locked();
+	}
+
+	bool
+	BtrfsExtentMap::generation(uint64_t gen)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		if (gen == m_generation) {
+			return true;
+		}
+		clear_locked();
+		m_generation = gen;
+		return false;
+	}
+
+	uint64_t
+	BtrfsExtentMap::searches() const
+	{
+		unique_lock<mutex> lock(m_mutex);
+		return m_searches;
+	}
+
+	BtrfsExtentMap::Vec
+	BtrfsExtentMap::fetch_locked(off_t pos, size_t count, off_t &next, bool &complete)
+	{
+		++m_searches;
+		auto rv = btrfs_extent_items(m_root_fd, m_tree_id, m_ino, m_stat.st_size, pos, count, next, complete);
+		// The last extent in the file is the last we get
+		if (complete && !rv.empty()) {
+			rv.rbegin()->m_flags |= FIEMAP_EXTENT_LAST;
+		}
+		return rv;
+	}
+
+	BtrfsExtentMap::Vec
+	BtrfsExtentMap::get_extent_map(off_t pos, size_t count, const Stat &st)
+	{
+		THROW_CHECK2(invalid_argument, st.st_ino, m_ino, st.st_ino == m_ino);
+		unique_lock<mutex> lock(m_mutex);
+
+		// Writes change size or times.  Dedupe doesn't, so callers
+		// must clear() after they dedupe into the file.
+		if (st.st_size != m_stat.st_size ||
+			st.st_mtim.tv_sec != m_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != m_stat.st_mtim.tv_nsec ||
+			st.st_ctim.tv_sec != m_stat.st_ctim.tv_sec || st.st_ctim.tv_nsec != m_stat.st_ctim.tv_nsec) {
+			clear_locked();
+			m_stat = st;
+		}
+
+		const auto extent_before = [](const Extent &e, off_t p) {
+			return e.m_begin < p;
+		};
+
+		// Start a new run if pos is not in or just after the current one
+		if (pos < m_begin || (pos > m_next && !m_complete)) {
+			off_t next;
+			bool complete;
+			auto batch = fetch_locked(pos, sc_fetch_min, next, complete);
+			if (pos < m_begin && (complete || next > m_begin)) {
+				// The batch reaches the current run, so keep the rest of it
+				auto rest = lower_bound(m_extents.begin(), m_extents.end(), next, extent_before);
+				batch.insert(batch.end(), rest, m_extents.end());
+				m_complete = m_complete || complete;
+				m_next = max(m_next, next);
+			} else {
+				m_next = next;
+				m_complete = complete;
+				m_fetch_size = sc_fetch_min;
+			}
+			m_extents = batch;
+			m_begin = pos;
+		}
+
+		// Don't let one big file use all the memory
+		auto first = lower_bound(m_extents.begin(), m_extents.end(), pos, extent_before);
+		if (m_extents.size() > sc_extents_max && size_t(first - m_extents.begin()) > sc_fetch_min) {
+			m_extents.erase(m_extents.begin(), first - sc_fetch_min);
+			m_begin = m_extents.begin()->m_begin;
+		}
+
+		// Fetch more until there are count extents after pos, doubling
+		// the fetch size each time
+		while (!m_complete) {
+			first = lower_bound(m_extents.begin(), m_extents.end(), pos, extent_before);
+			if (size_t(m_extents.end() - first) >= count) {
+				break;
+			}
+			m_fetch_size = min(m_fetch_size * 2, sc_fetch_max);
+			off_t next;
+			auto batch = fetch_locked(m_next, m_fetch_size, next, m_complete);
+			m_extents.insert(m_extents.end(), batch.begin(), batch.end());
+			m_next = max(m_next, next);
+		}
+
+		first = lower_bound(m_extents.begin(), m_extents.end(), pos, extent_before);
+		return Vec(first, first + min(count, size_t(m_extents.end() - first)));
+	}
+
 	ExtentWalker::Vec
 	ExtentWalker::get_extent_map(off_t pos)
 	{
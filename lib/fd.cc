@@ -138,10 +138,18 @@ namespace crucible {
 		}
 	};
 
+	LatencyHistogram latency_open;
+	LatencyHistogram latency_pread;
+	LatencyHistogram latency_pwrite;
+
 	int
 	open_or_die(const string &file, int flags, mode_t mode)
 	{
-		int fd(::open(file.c_str(), flags, mode));
+		int fd;
+		{
+			LatencyTimer lt(latency_open);
+			fd = ::open(file.c_str(), flags, mode);
+		}
 		if (fd < 0) {
 			THROW_ERRNO("open: name '" << file << "' mode " << oct << setfill('0') << setw(3) << mode << " flags " << o_flags_ntoa(flags));
 		}
@@ -151,7 +159,11 @@ namespace crucible {
 	int
 	openat_or_die(int dir_fd, const string &file, int flags, mode_t mode)
 	{
-		int fd(::openat(dir_fd, file.c_str(), flags, mode));
+		int fd;
+		{
+			LatencyTimer lt(latency_open);
+			fd = ::openat(dir_fd, file.c_str(), flags, mode);
+		}
 		if (fd < 0) {
 			THROW_ERRNO("openat: dir_fd " << dir_fd << " " << name_fd(dir_fd) << " name '" << file << "' mode " << oct << setfill('0') << setw(3) << mode << " flags " << o_flags_ntoa(flags));
 		}
@@ -326,7 +338,11 @@ namespace crucible {
                 if (fd < 0) {
                         THROW_ERROR(invalid_argument, "pwrite: trying to write on a closed file descriptor");
                 }
-		int rv = ::pwrite(fd, buf, size, offset);
+		int rv;
+		{
+			LatencyTimer lt(latency_pwrite);
+			rv = ::pwrite(fd, buf, size, offset);
+		}
 		if (rv != static_cast<int>(size)) {
 			THROW_ERROR(runtime_error, "pwrite: only " << rv << " of " << size << " bytes written at offset " << offset);
 		}
@@ -390,7 +406,7 @@ namespace crucible {
 	}
 
 	void
-	pread_or_die(int fd, void *buf, size_t size, off_t offset)
+	pread_or_die(int fd, void *buf, size_t size, off_t offset, const function<ssize_t(int, void *, size_t, off_t)> &read_fn)
 	{
 		if (size > (static_cast<size_t>(~0) >> 1)) {
 			THROW_ERROR(invalid_argument, "cannot read " << size << ", more than signed size allows");
@@ -399,7 +415,11 @@ namespace crucible {
 			throw runtime_error("read: trying to read on a closed file descriptor");
 		} else {
 			while (size) {
-				int rv = pread(fd, buf, size, offset);
+				ssize_t rv;
+				{
+					LatencyTimer lt(latency_pread);
+					rv = read_fn(fd, buf, size, offset);
+				}
 				if (rv < 0) {
 					if (errno == EINTR) {
 						CHATTER(__func__ << "resuming after EINTR");
@@ -407,7 +427,7 @@ namespace crucible {
 					}
 					THROW_ERRNO("pread: " << size << " bytes");
 				}
-				if (rv != static_cast<int>(size)) {
+				if (rv != static_cast<ssize_t>(size)) {
 					THROW_ERROR(runtime_error, "pread: " << size << " bytes at offset " << offset << " returned " << rv);
 				}
 				break;
@@ -415,6 +435,12 @@ namespace crucible {
 		}
 	}
 
+	void
+	pread_or_die(int fd, void *buf, size_t size, off_t offset)
+	{
+		return pread_or_die(fd, buf, size, offset, ::pread);
+	}
+
 	template<>
 	void
 	pread_or_die<string>(int fd, string &text, off_t offset)
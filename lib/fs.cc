@@ -1,5 +1,6 @@
 #include "crucible/fs.h"
 
+#include "crucible/backend.h"
 #include "crucible/error.h"
 #include "crucible/fd.h"
 #include "crucible/limits.h"
@@ -19,6 +20,11 @@
 
 namespace crucible {
 
+	LatencyHistogram latency_extent_same;
+	LatencyHistogram latency_logical_ino;
+	LatencyHistogram latency_ino_paths;
+	LatencyHistogram latency_tree_search;
+
 	void
 	punch_hole(int fd, off_t offset, off_t len)
 	{
@@ -193,7 +199,11 @@ namespace crucible {
 			ioctl_ptr->info[count] = static_cast<const btrfs_ioctl_same_extent_info &>(m_info[count]);
 			++count;
 		}
-		int rv = ioctl(m_fd, BTRFS_IOC_FILE_EXTENT_SAME, ioctl_ptr);
+		int rv;
+		{
+			LatencyTimer lt(latency_extent_same);
+			rv = btrfs_backend()->file_extent_same(m_fd, ioctl_ptr);
+		}
 		if (rv) {
 			THROW_ERRNO("After FILE_EXTENT_SAME (fd = " << m_fd << " '" << name_fd(m_fd) << "') : " << ioctl_ptr);
 		}
@@ -206,8 +216,16 @@ namespace crucible {
 
 	bool
 	btrfs_extent_same(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset)
+	{
+		off_t deduped;
+		return btrfs_extent_same(src_fd, src_offset, src_length, dst_fd, dst_offset, deduped);
+	}
+
+	bool
+	btrfs_extent_same(int src_fd, off_t src_offset, off_t src_length, int dst_fd, off_t dst_offset, off_t &deduped)
 	{
 		THROW_CHECK1(invalid_argument, src_length, src_length > 0);
+		deduped = 0;
 		while (src_length > 0) {
 			off_t length = min(off_t(BTRFS_MAX_DEDUPE_LEN), src_length);
 			BtrfsExtentSame bes(src_fd, src_offset, length);
@@ -218,6 +236,7 @@ namespace crucible {
 				src_offset += length;
 				dst_offset += length;
 				src_length -= length;
+				deduped += length;
 				continue;
 			}
 			if (status == BTRFS_SAME_DATA_DIFFERS) {
@@ -382,18 +401,23 @@ namespace crucible {
 
 		static unsigned long bili_version = 0;
 
+		const auto timed_ioctl = [&](unsigned long request) {
+			LatencyTimer lt(latency_logical_ino);
+			return btrfs_backend()->logical_ino(fd, request, p);
+		};
+
 		if (get_flags() == 0) {
 			// Could use either V1 or V2
 			if (bili_version) {
 				// We tested both versions and came to a decision
-				if (ioctl(fd, bili_version, p)) {
+				if (timed_ioctl(bili_version)) {
 					return false;
 				}
 			}  else {
 				// Try V2
-				if (ioctl(fd, BTRFS_IOC_LOGICAL_INO_V2, p)) {
+				if (timed_ioctl(BTRFS_IOC_LOGICAL_INO_V2)) {
 					// V2 failed, try again with V1
-					if (ioctl(fd, BTRFS_IOC_LOGICAL_INO, p)) {
+					if (timed_ioctl(BTRFS_IOC_LOGICAL_INO)) {
 						// both V1 and V2 failed, doesn't tell us which one to choose
 						return false;
 					}
@@ -406,7 +430,7 @@ namespace crucible {
 			}
 		} else {
 			// Flags/size require a V2 feature, no fallback to V1 possible
-			if (ioctl(fd, BTRFS_IOC_LOGICAL_INO_V2, p)) {
+			if (timed_ioctl(BTRFS_IOC_LOGICAL_INO_V2)) {
 				return false;
 			}
 			// V2 succeeded so we don't need to probe any more
@@ -458,7 +482,12 @@ namespace crucible {
 
 		m_paths.clear();
 
-		if (ioctl(fd, BTRFS_IOC_INO_PATHS, p) < 0) {
+		int rv;
+		{
+			LatencyTimer lt(latency_ino_paths);
+			rv = btrfs_backend()->ino_paths(fd, p);
+		}
+		if (rv < 0) {
 			return false;
 		}
 
@@ -514,7 +543,7 @@ namespace crucible {
 	BtrfsIoctlInoLookupArgs::do_ioctl_nothrow(int fd)
 	{
 		btrfs_ioctl_ino_lookup_args *ioctl_ptr = static_cast<btrfs_ioctl_ino_lookup_args *>(this);
-		return ioctl(fd, BTRFS_IOC_INO_LOOKUP, ioctl_ptr) == 0;
+		return btrfs_backend()->ino_lookup(fd, ioctl_ptr) == 0;
 	}
 
 	void
@@ -826,11 +855,27 @@ namespace crucible {
 		m_result.clear();
 
 		// Don't bother supporting V1.  Kernels that old have other problems.
-		int rv = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, ioctl_ptr);
+		int rv;
+		{
+			LatencyTimer lt(latency_tree_search);
+			rv = btrfs_backend()->tree_search_v2(fd, ioctl_ptr);
+		}
 		if (rv != 0) {
 			return false;
 		}
 
+		set_result(ioctl_arg);
+		return true;
+	}
+
+	void
+	BtrfsIoctlSearchKey::set_result(const vector<char> &ioctl_arg)
+	{
+		THROW_CHECK1(invalid_argument, ioctl_arg.size(), ioctl_arg.size() >= sizeof(btrfs_ioctl_search_args_v2));
+		const btrfs_ioctl_search_args_v2 *ioctl_ptr = reinterpret_cast<const btrfs_ioctl_search_args_v2 *>(ioctl_arg.data());
+
+		m_result.clear();
+
 		static_cast<btrfs_ioctl_search_key&>(*this) = ioctl_ptr->key;
 
 		size_t offset = pointer_distance(ioctl_ptr->buf, ioctl_ptr);
@@ -839,8 +884,6 @@ namespace crucible {
 			offset = item.set_data(ioctl_arg, offset);
 			m_result.insert(item);
 		}
-
-		return true;
 	}
 
 	void
@@ -1079,6 +1122,41 @@ namespace crucible {
 		return rv;
 	}
 
+	uint64_t
+	btrfs_get_inode_generation(int fd, uint64_t root, uint64_t ino)
+	{
+		BtrfsIoctlSearchKey sk;
+		sk.tree_id = root;
+		sk.min_objectid = sk.max_objectid = ino;
+		sk.min_type = sk.max_type = BTRFS_INODE_ITEM_KEY;
+		sk.nr_items = 1;
+		if (!sk.do_ioctl_nothrow(fd)) {
+			return 0;
+		}
+		for (auto i : sk.m_result) {
+			if (i.objectid == ino && i.type == BTRFS_INODE_ITEM_KEY) {
+				return call_btrfs_get(btrfs_stack_inode_generation, i.m_data);
+			}
+		}
+		return 0;
+	}
+
+	int
+	btrfs_open_by_handle(int mount_fd, uint64_t root, uint64_t ino, uint32_t generation, int flags)
+	{
+		btrfs_fid_non_connectable fid;
+		fid.objectid = ino;
+		fid.root_objectid = root;
+		fid.gen = generation;
+		// file_handle ends with a variable length array
+		vector<uint8_t> buf(sizeof(file_handle) + sizeof(fid));
+		auto fh = reinterpret_cast<file_handle *>(buf.data());
+		fh->handle_bytes = sizeof(fid);
+		fh->handle_type = FILEID_BTRFS_WITHOUT_PARENT;
+		memcpy(fh->f_handle, &fid, sizeof(fid));
+		return btrfs_backend()->open_by_handle(mount_fd, fh, flags);
+	}
+
 	Statvfs::Statvfs()
 	{
 		memset_zero<statvfs>(this);
@@ -0,0 +1,141 @@
+#include "crucible/histogram.h"
+
+#include "crucible/error.h"
+
+#include <cmath>
+
+namespace crucible {
+	using namespace std;
+
+	LatencyHistogram::LatencyHistogram() :
+		m_count(0),
+		m_sum(0),
+		m_max(0)
+	{
+		for (auto &b : m_buckets) {
+			b.store(0, memory_order_relaxed);
+		}
+	}
+
+	size_t
+	LatencyHistogram::bucket_of(uint64_t ns)
+	{
+		if (ns < c_sub_count) {
+			return ns;
+		}
+		unsigned msb = 63 - __builtin_clzll(ns);
+		unsigned shift = msb - c_sub_bits;
+		return (shift + 1) * c_sub_count + ((ns >> shift) & (c_sub_count - 1));
+	}
+
+	uint64_t
+	LatencyHistogram::bucket_low(size_t bucket)
+	{
+		THROW_CHECK1(out_of_range, bucket, bucket < c_bucket_count);
+		if (bucket < c_sub_count) {
+			return bucket;
+		}
+		unsigned shift = bucket / c_sub_count - 1;
+		return (c_sub_count + bucket % c_sub_count) << shift;
+	}
+
+	uint64_t
+	LatencyHistogram::bucket_high(size_t bucket)
+	{
+		THROW_CHECK1(out_of_range, bucket, bucket < c_bucket_count);
+		if (bucket < c_sub_count) {
+			return bucket;
+		}
+		unsigned shift = bucket / c_sub_count - 1;
+		return bucket_low(bucket) + ((uint64_t(1) << shift) - 1);
+	}
+
+	void
+	LatencyHistogram::add(uint64_t ns)
+	{
+		m_buckets[bucket_of(ns)].fetch_add(1, memory_order_relaxed);
+		m_count.fetch_add(1, memory_order_relaxed);
+		m_sum.fetch_add(ns, memory_order_relaxed);
+		uint64_t old_max = m_max.load(memory_order_relaxed);
+		while (ns > old_max && !m_max.compare_exchange_weak(old_max, ns, memory_order_relaxed)) {
+		}
+	}
+
+	void
+	LatencyHistogram::add_seconds(double seconds)
+	{
+		add(seconds > 0 ? llround(seconds * 1e9) : 0);
+	}
+
+	uint64_t
+	LatencyHistogram::count() const
+	{
+		return m_count.load(memory_order_relaxed);
+	}
+
+	uint64_t
+	LatencyHistogram::sum() const
+	{
+		return m_sum.load(memory_order_relaxed);
+	}
+
+	uint64_t
+	LatencyHistogram::max() const
+	{
+		return m_max.load(memory_order_relaxed);
+	}
+
+	double
+	LatencyHistogram::mean() const
+	{
+		auto n = count();
+		return n ? double(m_sum.load(memory_order_relaxed)) / n : 0;
+	}
+
+	uint64_t
+	LatencyHistogram::percentile(double fraction) const
+	{
+		// Writers may be adding samples while we read, so count the buckets
+		// we actually see instead of trusting m_count
+		uint64_t total = 0;
+		for (const auto &b : m_buckets) {
+			total += b.load(memory_order_relaxed);
+		}
+		if (!total) {
+			return 0;
+		}
+		uint64_t target = ceil(fraction * total);
+		if (target < 1) {
+			target = 1;
+		}
+		uint64_t seen = 0;
+		for (size_t i = 0; i < c_bucket_count; ++i) {
+			seen += m_buckets[i].load(memory_order_relaxed);
+			if (seen >= target) {
+				return min(bucket_high(i), max());
+			}
+		}
+		return max();
+	}
+
+	ostream &
+	operator<<(ostream &os, const LatencyHistogram &lh)
+	{
+		return os << "count=" << lh.count()
+			<< " p50=" << lh.percentile(0.5) / 1e6 << "ms"
+			<< " p99=" << lh.percentile(0.99) / 1e6 << "ms"
+			<< " p999=" << lh.percentile(0.999) / 1e6 << "ms"
+			<< " max=" << lh.max() / 1e6 << "ms";
+	}
+
+	LatencyTimer::LatencyTimer(LatencyHistogram &histogram) :
+		m_histogram(histogram)
+	{
+	}
+
+	LatencyTimer::~LatencyTimer()
+	{
+		m_histogram.add_seconds(m_timer.age());
+	}
+
+}
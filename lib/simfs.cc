@@ -0,0 +1,665 @@
+#include "crucible/simfs.h"
+
+#include "crucible/error.h"
+#include "crucible/fs.h"
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace crucible {
+	using namespace std;
+
+	static const uint64_t c_first_bytenr = 1024 * 1024 * 1024;
+
+	// btrfs_compression_type is not in uapi
+	static const uint8_t c_compress_none = 0;
+	static const uint8_t c_compress_zstd = 3;
+
+	// TREE_SEARCH compares keys as (objectid, type, offset) tuples
+	using SearchKey = tuple<uint64_t, uint64_t, uint64_t>;
+
+	const char *
+	BtrfsSimulator::op_name(Op op)
+	{
+		switch (op) {
+			case TREE_SEARCH: return "TREE_SEARCH_V2";
+			case LOGICAL_INO: return "LOGICAL_INO";
+			case INO_PATHS: return "INO_PATHS";
+			case INO_LOOKUP: return "INO_LOOKUP";
+			case EXTENT_SAME: return "FILE_EXTENT_SAME";
+			case PREAD: return "pread";
+			case OPEN_BY_HANDLE: return "open_by_handle_at";
+			default: return "unknown";
+		}
+	}
+
+	BtrfsSimulator::BtrfsSimulator() :
+		m_next_bytenr(c_first_bytenr)
+	{
+		for (size_t i = 0; i < OP_MAX; ++i) {
+			m_latency_ns[i] = 0;
+			m_count[i] = 0;
+		}
+	}
+
+	void
+	BtrfsSimulator::block_data(uint64_t content, uint8_t *buf)
+	{
+		if (!content) {
+			memset(buf, 0, c_block_size);
+			return;
+		}
+		for (uint64_t i = 0; i < c_block_size / sizeof(uint64_t); ++i) {
+			const uint64_t word = (content * 0x9e3779b97f4a7c15ULL) ^ ((i + 1) * 0xbf58476d1ce4e5b9ULL);
+			memcpy(buf + i * sizeof(word), &word, sizeof(word));
+		}
+	}
+
+	void
+	BtrfsSimulator::latency(Op op, double seconds)
+	{
+		THROW_CHECK1(out_of_range, op, op < OP_MAX);
+		THROW_CHECK1(out_of_range, seconds, seconds >= 0);
+		m_latency_ns[op] = seconds * 1000000000;
+	}
+
+	uint64_t
+	BtrfsSimulator::count(Op op) const
+	{
+		THROW_CHECK1(out_of_range, op, op < OP_MAX);
+		return m_count[op];
+	}
+
+	void
+	BtrfsSimulator::enter(Op op)
+	{
+		++m_count[op];
+		const uint64_t ns = m_latency_ns[op];
+		if (ns) {
+			this_thread::sleep_for(chrono::nanoseconds(ns));
+		}
+	}
+
+	uint64_t
+	BtrfsSimulator::commit()
+	{
+		unique_lock<mutex> lock(m_mutex);
+		return ++m_transid;
+	}
+
+	uint64_t
+	BtrfsSimulator::transid() const
+	{
+		unique_lock<mutex> lock(m_mutex);
+		return m_transid;
+	}
+
+	Fd
+	BtrfsSimulator::add_file(uint64_t root)
+	{
+		THROW_CHECK1(invalid_argument, root, root == BTRFS_FS_TREE_OBJECTID || root >= BTRFS_FIRST_FREE_OBJECTID);
+		Fd fd(memfd_create("simfs", MFD_CLOEXEC));
+		if (!fd) {
+			THROW_ERRNO("memfd_create");
+		}
+		struct stat st;
+		DIE_IF_MINUS_ONE(fstat(fd, &st));
+
+		unique_lock<mutex> lock(m_mutex);
+		if (m_files.empty()) {
+			m_dev = st.st_dev;
+		}
+		THROW_CHECK2(runtime_error, m_dev, st.st_dev, m_dev == st.st_dev);
+		File &f = m_files[st.st_ino];
+		f.m_root = root;
+		f.m_ino = st.st_ino;
+		f.m_generation = m_transid;
+		f.m_fd = fd;
+		m_root_generation[root] = max(m_root_generation[root], m_transid);
+		return fd;
+	}
+
+	BtrfsSimulator::File *
+	BtrfsSimulator::find_file(int fd)
+	{
+		struct stat st;
+		if (fstat(fd, &st)) {
+			return nullptr;
+		}
+		unique_lock<mutex> lock(m_mutex);
+		if (m_files.empty() || st.st_dev != m_dev) {
+			return nullptr;
+		}
+		auto found = m_files.find(st.st_ino);
+		if (found == m_files.end()) {
+			return nullptr;
+		}
+		// Files are never removed, so the pointer stays valid
+		return &found->second;
+	}
+
+	uint64_t
+	BtrfsSimulator::add_extent(const vector<uint64_t> &contents, bool compressed)
+	{
+		THROW_CHECK0(invalid_argument, !contents.empty());
+		unique_lock<mutex> lock(m_mutex);
+		const uint64_t bytenr = m_next_bytenr;
+		Extent &e = m_extents[bytenr];
+		e.m_contents = contents;
+		e.m_compressed = compressed;
+		e.m_disk_bytes = contents.size() * c_block_size;
+		if (compressed) {
+			// Pretend everything compresses 2:1
+			e.m_disk_bytes = max(c_block_size, (contents.size() + 1) / 2 * c_block_size);
+		}
+		m_next_bytenr += e.m_disk_bytes;
+		return bytenr;
+	}
+
+	void
+	BtrfsSimulator::set_size(File &f, uint64_t size)
+	{
+		if (size > f.m_size) {
+			ftruncate_or_die(f.m_fd, size);
+			f.m_size = size;
+		}
+	}
+
+	void
+	BtrfsSimulator::insert_ref(File &f, uint64_t offset, const Ref &ref)
+	{
+		f.m_refs[offset] = ref;
+		m_extents.at(ref.m_bytenr).m_backrefs.insert(Backref(f.m_root, f.m_ino, offset));
+		set_size(f, offset + ref.m_length);
+		m_root_generation[f.m_root] = max(m_root_generation[f.m_root], ref.m_generation);
+	}
+
+	void
+	BtrfsSimulator::erase_ref(File &f, map<uint64_t, Ref>::iterator it)
+	{
+		auto &e = m_extents.at(it->second.m_bytenr);
+		e.m_backrefs.erase(Backref(f.m_root, f.m_ino, it->first));
+		// Extents are freed when their last ref is removed
+		if (e.m_backrefs.empty()) {
+			m_extents.erase(it->second.m_bytenr);
+		}
+		f.m_refs.erase(it);
+	}
+
+	void
+	BtrfsSimulator::split_at(File &f, uint64_t offset)
+	{
+		auto it = f.m_refs.upper_bound(offset);
+		if (it == f.m_refs.begin()) {
+			return;
+		}
+		--it;
+		Ref &left = it->second;
+		const uint64_t left_length = offset - it->first;
+		if (!left_length || left_length >= left.m_length) {
+			return;
+		}
+		Ref right = left;
+		right.m_extent_offset += left_length;
+		right.m_length -= left_length;
+		left.m_length = left_length;
+		f.m_refs[offset] = right;
+		m_extents.at(right.m_bytenr).m_backrefs.insert(Backref(f.m_root, f.m_ino, offset));
+	}
+
+	void
+	BtrfsSimulator::punch(File &f, uint64_t begin, uint64_t end)
+	{
+		split_at(f, begin);
+		split_at(f, end);
+		auto it = f.m_refs.lower_bound(begin);
+		while (it != f.m_refs.end() && it->first < end) {
+			erase_ref(f, it++);
+		}
+	}
+
+	uint64_t
+	BtrfsSimulator::content_at(const File &f, uint64_t offset) const
+	{
+		auto it = f.m_refs.upper_bound(offset);
+		if (it == f.m_refs.begin()) {
+			return 0;
+		}
+		--it;
+		if (offset >= it->first + it->second.m_length) {
+			return 0;
+		}
+		const auto &e = m_extents.at(it->second.m_bytenr);
+		return e.m_contents.at((it->second.m_extent_offset + offset - it->first) / c_block_size);
+	}
+
+	void
+	BtrfsSimulator::add_ref(int fd, off_t offset, uint64_t bytenr, off_t extent_offset, off_t length)
+	{
+		THROW_CHECK1(invalid_argument, offset, offset >= 0 && offset % c_block_size == 0);
+		THROW_CHECK1(invalid_argument, extent_offset, extent_offset >= 0 && extent_offset % c_block_size == 0);
+		THROW_CHECK1(invalid_argument, length, length > 0);
+		File *f = find_file(fd);
+		THROW_CHECK1(invalid_argument, fd, f);
+
+		unique_lock<mutex> lock(m_mutex);
+		auto found = m_extents.find(bytenr);
+		THROW_CHECK1(invalid_argument, to_hex(bytenr), found != m_extents.end());
+		THROW_CHECK3(out_of_range, extent_offset, length, found->second.m_contents.size(),
+			uint64_t(extent_offset + length) <= found->second.m_contents.size() * c_block_size);
+		// The extent must not be freed while we are replacing a ref to it
+		found->second.m_backrefs.insert(Backref(0, 0, 0));
+		punch(*f, offset, offset + length);
+		found->second.m_backrefs.erase(Backref(0, 0, 0));
+		insert_ref(*f, offset, Ref { bytenr, uint64_t(extent_offset), uint64_t(length), m_transid });
+	}
+
+	uint64_t
+	BtrfsSimulator::write(int fd, off_t offset, const vector<uint64_t> &contents, bool compressed)
+	{
+		const uint64_t bytenr = add_extent(contents, compressed);
+		add_ref(fd, offset, bytenr, 0, contents.size() * c_block_size);
+		return bytenr;
+	}
+
+	size_t
+	BtrfsSimulator::extent_refs(uint64_t bytenr) const
+	{
+		unique_lock<mutex> lock(m_mutex);
+		auto found = m_extents.find(bytenr);
+		return found == m_extents.end() ? 0 : found->second.m_backrefs.size();
+	}
+
+	int
+	BtrfsSimulator::tree_search_v2(int fd, btrfs_ioctl_search_args_v2 *args)
+	{
+		File *fd_file = find_file(fd);
+		if (!fd_file) {
+			return BtrfsBackend::tree_search_v2(fd, args);
+		}
+		enter(TREE_SEARCH);
+
+		unique_lock<mutex> lock(m_mutex);
+		auto &key = args->key;
+		const uint64_t tree_id = key.tree_id ? key.tree_id : fd_file->m_root;
+		if (tree_id != BTRFS_ROOT_TREE_OBJECTID && !m_root_generation.count(tree_id)) {
+			errno = ENOENT;
+			return -1;
+		}
+		const SearchKey min_key(key.min_objectid, key.min_type, key.min_offset);
+		const SearchKey max_key(key.max_objectid, key.max_type, key.max_offset);
+
+		uint8_t *buf = reinterpret_cast<uint8_t *>(args->buf);
+		size_t buf_used = 0;
+		uint32_t found = 0;
+		bool full = false;
+
+		// Returns false when no more items can be returned
+		const auto emit = [&](const SearchKey &item_key, uint64_t generation, const void *data, size_t len) -> bool {
+			if (found >= key.nr_items) {
+				return false;
+			}
+			if (generation < key.min_transid || generation > key.max_transid) {
+				return true;
+			}
+			btrfs_ioctl_search_header sh;
+			memset(&sh, 0, sizeof(sh));
+			sh.transid = generation;
+			sh.objectid = get<0>(item_key);
+			sh.type = get<1>(item_key);
+			sh.offset = get<2>(item_key);
+			sh.len = len;
+			if (buf_used + sizeof(sh) + len > args->buf_size) {
+				full = true;
+				if (!found) {
+					// The kernel tells us how big the buffer needs to be
+					args->buf_size = sizeof(sh) + len;
+				}
+				return false;
+			}
+			memcpy(buf + buf_used, &sh, sizeof(sh));
+			memcpy(buf + buf_used + sizeof(sh), data, len);
+			buf_used += sizeof(sh) + len;
+			++found;
+			return true;
+		};
+
+		if (tree_id == BTRFS_ROOT_TREE_OBJECTID) {
+			for (auto i = m_root_generation.lower_bound(key.min_objectid); i != m_root_generation.end(); ++i) {
+				const SearchKey item_key(i->first, BTRFS_ROOT_ITEM_KEY, 0);
+				if (item_key < min_key) {
+					continue;
+				}
+				if (item_key > max_key) {
+					break;
+				}
+				btrfs_root_item ri;
+				memset(&ri, 0, sizeof(ri));
+				ri.generation = htole64(i->second);
+				ri.root_dirid = htole64(BTRFS_FIRST_FREE_OBJECTID);
+				if (!emit(item_key, i->second, &ri, sizeof(ri))) {
+					break;
+				}
+			}
+		} else {
+			bool more = true;
+			for (auto i = m_files.lower_bound(key.min_objectid); more && i != m_files.end(); ++i) {
+				const File &f = i->second;
+				if (f.m_root != tree_id) {
+					continue;
+				}
+				const SearchKey inode_key(f.m_ino, BTRFS_INODE_ITEM_KEY, 0);
+				if (inode_key > max_key) {
+					break;
+				}
+				if (!(inode_key < min_key)) {
+					btrfs_inode_item ii;
+					memset(&ii, 0, sizeof(ii));
+					ii.generation = htole64(f.m_generation);
+					ii.transid = htole64(f.m_generation);
+					ii.size = htole64(f.m_size);
+					ii.nlink = htole32(1);
+					ii.mode = htole32(S_IFREG | 0644);
+					if (!emit(inode_key, f.m_generation, &ii, sizeof(ii))) {
+						break;
+					}
+				}
+				auto j = f.m_refs.begin();
+				if (f.m_ino == key.min_objectid && key.min_type == BTRFS_EXTENT_DATA_KEY) {
+					j = f.m_refs.lower_bound(key.min_offset);
+				}
+				for (; j != f.m_refs.end(); ++j) {
+					const SearchKey item_key(f.m_ino, BTRFS_EXTENT_DATA_KEY, j->first);
+					if (item_key < min_key) {
+						continue;
+					}
+					if (item_key > max_key) {
+						more = false;
+						break;
+					}
+					const Ref &r = j->second;
+					const Extent &e = m_extents.at(r.m_bytenr);
+					btrfs_file_extent_item fei;
+					memset(&fei, 0, sizeof(fei));
+					fei.generation = htole64(r.m_generation);
+					fei.ram_bytes = htole64(e.m_contents.size() * c_block_size);
+					fei.compression = e.m_compressed ? c_compress_zstd : c_compress_none;
+					fei.type = BTRFS_FILE_EXTENT_REG;
+					fei.disk_bytenr = htole64(r.m_bytenr);
+					fei.disk_num_bytes = htole64(e.m_disk_bytes);
+					fei.offset = htole64(r.m_extent_offset);
+					fei.num_bytes = htole64(r.m_length);
+					if (!emit(item_key, r.m_generation, &fei, sizeof(fei))) {
+						more = false;
+						break;
+					}
+				}
+			}
+		}
+
+		if (full && !found) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		key.nr_items = found;
+		return 0;
+	}
+
+	int
+	BtrfsSimulator::logical_ino(int fd, unsigned long request, btrfs_ioctl_logical_ino_args *args)
+	{
+		if (!find_file(fd)) {
+			return BtrfsBackend::logical_ino(fd, request, args);
+		}
+		enter(LOGICAL_INO);
+
+		unique_lock<mutex> lock(m_mutex);
+		const bool v2 = request == BTRFS_IOC_LOGICAL_INO_V2;
+		const bool ignore_offset = v2 && (args->reserved[3] & BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET);
+		// V1 can't return more than 64K
+		const size_t size = v2 ? args->size : min(uint64_t(64 * 1024), uint64_t(args->size));
+
+		auto found = m_extents.upper_bound(args->logical);
+		if (found == m_extents.begin()) {
+			errno = ENOENT;
+			return -1;
+		}
+		--found;
+		const uint64_t bytenr = found->first;
+		const Extent &e = found->second;
+		if (args->logical >= bytenr + e.m_disk_bytes) {
+			errno = ENOENT;
+			return -1;
+		}
+		const uint64_t extent_item_pos = args->logical - bytenr;
+
+		btrfs_data_container *bdc = reinterpret_cast<btrfs_data_container *>(args->inodes);
+		const size_t capacity = (size - offsetof(btrfs_data_container, val)) / sizeof(uint64_t);
+		bdc->elem_cnt = 0;
+		bdc->elem_missed = 0;
+		bdc->bytes_missing = 0;
+		for (const auto &br : e.m_backrefs) {
+			const File &f = m_files.at(get<1>(br));
+			const Ref &r = f.m_refs.at(get<2>(br));
+			uint64_t offset = get<2>(br);
+			// The kernel only checks the offset of uncompressed extents
+			if (!ignore_offset && !e.m_compressed) {
+				if (extent_item_pos < r.m_extent_offset || extent_item_pos >= r.m_extent_offset + r.m_length) {
+					continue;
+				}
+				offset += extent_item_pos - r.m_extent_offset;
+			}
+			if (bdc->elem_cnt + 3 > capacity) {
+				bdc->elem_missed += 3;
+				bdc->bytes_missing += 3 * sizeof(uint64_t);
+				continue;
+			}
+			bdc->val[bdc->elem_cnt++] = get<1>(br);
+			bdc->val[bdc->elem_cnt++] = offset;
+			bdc->val[bdc->elem_cnt++] = get<0>(br);
+		}
+		bdc->bytes_left = (capacity - bdc->elem_cnt) * sizeof(uint64_t);
+		return 0;
+	}
+
+	int
+	BtrfsSimulator::ino_paths(int fd, btrfs_ioctl_ino_path_args *args)
+	{
+		File *fd_file = find_file(fd);
+		if (!fd_file) {
+			return BtrfsBackend::ino_paths(fd, args);
+		}
+		enter(INO_PATHS);
+
+		unique_lock<mutex> lock(m_mutex);
+		auto found = m_files.find(args->inum);
+		if (found == m_files.end() || found->second.m_root != fd_file->m_root) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		// Simulated files have no directory entries, so make up a name
+		const string path = "ino" + to_string(args->inum);
+		btrfs_data_container *bdc = reinterpret_cast<btrfs_data_container *>(args->fspath);
+		const size_t min_size = offsetof(btrfs_data_container, val);
+		const size_t needed = sizeof(uint64_t) + path.size() + 1;
+		bdc->elem_cnt = 0;
+		bdc->elem_missed = 0;
+		bdc->bytes_missing = 0;
+		if (min_size + needed > args->size) {
+			bdc->elem_missed = 1;
+			bdc->bytes_missing = min_size + needed - args->size;
+			bdc->bytes_left = 0;
+			return 0;
+		}
+		// Offsets of the strings are relative to val
+		bdc->val[0] = sizeof(uint64_t);
+		memcpy(&bdc->val[1], path.c_str(), path.size() + 1);
+		bdc->elem_cnt = 1;
+		bdc->bytes_left = args->size - min_size - needed;
+		return 0;
+	}
+
+	int
+	BtrfsSimulator::ino_lookup(int fd, btrfs_ioctl_ino_lookup_args *args)
+	{
+		File *fd_file = find_file(fd);
+		if (!fd_file) {
+			return BtrfsBackend::ino_lookup(fd, args);
+		}
+		enter(INO_LOOKUP);
+
+		if (!args->treeid) {
+			args->treeid = fd_file->m_root;
+		}
+		// Every simulated file is in the top directory of its subvol
+		memset(args->name, 0, sizeof(args->name));
+		return 0;
+	}
+
+	int
+	BtrfsSimulator::file_extent_same(int fd, btrfs_ioctl_same_args *args)
+	{
+		File *src = find_file(fd);
+		if (!src) {
+			return BtrfsBackend::file_extent_same(fd, args);
+		}
+		vector<File *> dsts;
+		for (size_t i = 0; i < args->dest_count; ++i) {
+			dsts.push_back(find_file(args->info[i].fd));
+		}
+		enter(EXTENT_SAME);
+
+		unique_lock<mutex> lock(m_mutex);
+		const uint64_t src_begin = args->logical_offset;
+		const uint64_t length = args->length;
+		if (src_begin % c_block_size || src_begin + length > src->m_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		// Unaligned lengths are allowed up to EOF
+		if (length % c_block_size && src_begin + length != src->m_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		const uint64_t aligned_length = (length + c_block_size - 1) & ~(c_block_size - 1);
+
+		for (size_t i = 0; i < args->dest_count; ++i) {
+			auto &info = args->info[i];
+			File *dst = dsts.at(i);
+			info.bytes_deduped = 0;
+			if (!dst) {
+				info.status = -EBADF;
+				continue;
+			}
+			const uint64_t dst_begin = info.logical_offset;
+			if (dst_begin % c_block_size || dst_begin + length > dst->m_size) {
+				info.status = -EINVAL;
+				continue;
+			}
+
+			bool same = true;
+			for (uint64_t pos = 0; same && pos < aligned_length; pos += c_block_size) {
+				same = content_at(*src, src_begin + pos) == content_at(*dst, dst_begin + pos);
+			}
+			if (!same) {
+				info.status = BTRFS_SAME_DATA_DIFFERS;
+				continue;
+			}
+
+			// Copy the parts of the source refs in range before punching,
+			// in case src and dst are the same file
+			const uint64_t src_end = src_begin + aligned_length;
+			vector<pair<uint64_t, Ref>> refs;
+			auto j = src->m_refs.upper_bound(src_begin);
+			if (j != src->m_refs.begin()) {
+				--j;
+			}
+			for (; j != src->m_refs.end() && j->first < src_end; ++j) {
+				const uint64_t ref_begin = max(j->first, src_begin);
+				const uint64_t ref_end = min(j->first + j->second.m_length, src_end);
+				if (ref_begin >= ref_end) {
+					continue;
+				}
+				Ref r = j->second;
+				r.m_extent_offset += ref_begin - j->first;
+				r.m_length = ref_end - ref_begin;
+				r.m_generation = m_transid;
+				refs.push_back(make_pair(ref_begin - src_begin + dst_begin, r));
+			}
+			for (const auto &r : refs) {
+				m_extents.at(r.second.m_bytenr).m_backrefs.insert(Backref(0, 0, 0));
+			}
+			punch(*dst, dst_begin, dst_begin + aligned_length);
+			for (const auto &r : refs) {
+				m_extents.at(r.second.m_bytenr).m_backrefs.erase(Backref(0, 0, 0));
+				insert_ref(*dst, r.first, r.second);
+			}
+			info.bytes_deduped = length;
+			info.status = 0;
+		}
+		return 0;
+	}
+
+	ssize_t
+	BtrfsSimulator::pread(int fd, void *buf, size_t size, off_t offset)
+	{
+		File *f = find_file(fd);
+		if (!f) {
+			return BtrfsBackend::pread(fd, buf, size, offset);
+		}
+		enter(PREAD);
+
+		unique_lock<mutex> lock(m_mutex);
+		if (offset < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		const uint64_t begin = offset;
+		if (begin >= f->m_size) {
+			return 0;
+		}
+		const uint64_t end = min(f->m_size, begin + size);
+		uint8_t *out = static_cast<uint8_t *>(buf);
+		uint8_t block[c_block_size];
+		for (uint64_t pos = begin; pos < end; ) {
+			const uint64_t block_begin = pos & ~(c_block_size - 1);
+			const uint64_t copy_end = min(end, block_begin + c_block_size);
+			block_data(content_at(*f, block_begin), block);
+			memcpy(out + (pos - begin), block + (pos - block_begin), copy_end - pos);
+			pos = copy_end;
+		}
+		return end - begin;
+	}
+
+	int
+	BtrfsSimulator::open_by_handle(int mount_fd, file_handle *handle, int flags)
+	{
+		if (!find_file(mount_fd)) {
+			return BtrfsBackend::open_by_handle(mount_fd, handle, flags);
+		}
+		enter(OPEN_BY_HANDLE);
+
+		btrfs_fid_non_connectable fid;
+		if (handle->handle_type != FILEID_BTRFS_WITHOUT_PARENT || handle->handle_bytes < sizeof(fid)) {
+			errno = ESTALE;
+			return -1;
+		}
+		memcpy(&fid, handle->f_handle, sizeof(fid));
+
+		unique_lock<mutex> lock(m_mutex);
+		auto found = m_files.find(fid.objectid);
+		if (found == m_files.end() || found->second.m_root != fid.root_objectid || uint32_t(found->second.m_generation) != fid.gen) {
+			errno = ESTALE;
+			return -1;
+		}
+		return fcntl(found->second.m_fd, F_DUPFD_CLOEXEC, 0);
+	}
+}
@@ -1,12 +1,14 @@
 #include "bees.h"
 
 #include "crucible/cleanup.h"
+#include "crucible/crc64.h"
 #include "crucible/limits.h"
 #include "crucible/string.h"
 #include "crucible/task.h"
 
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 // round
@@ -17,6 +19,12 @@
 // struct sigset
 #include <signal.h>
 
+// metrics socket
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 using namespace crucible;
 using namespace std;
 
@@ -32,6 +40,9 @@ getenv_or_die(const char *name)
 	return rv;
 }
 
+// Set by the file cache function when the file it failed to open is gone
+static thread_local bool tl_open_gone = false;
+
 BeesFdCache::BeesFdCache()
 {
 	m_root_cache.func([&](shared_ptr<BeesContext> ctx, uint64_t root) -> Fd {
@@ -43,7 +54,7 @@ BeesFdCache::BeesFdCache()
 	m_root_cache.max_size(BEES_ROOT_FD_CACHE_SIZE);
 	m_file_cache.func([&](shared_ptr<BeesContext> ctx, uint64_t root, uint64_t ino) -> Fd {
 		Timer open_timer;
-		auto rv = ctx->roots()->open_root_ino_nocache(root, ino);
+		auto rv = ctx->roots()->open_root_ino_nocache(root, ino, tl_open_gone);
 		BEESCOUNTADD(open_ino_ms, open_timer.age() * 1000);
 		return rv;
 	});
@@ -61,6 +72,34 @@ BeesFdCache::clear()
 	BEESCOUNT(open_clear);
 }
 
+void
+BeesFdCache::clear_root(uint64_t root)
+{
+	BEESNOTE("Clearing FDs in root " << root << " to enable subvol delete");
+	BEESCOUNTADD(root_clear_deleted, m_root_cache.prune_key([&](const tuple<shared_ptr<BeesContext>, uint64_t> &key) {
+		return get<1>(key) == root;
+	}));
+	BEESCOUNTADD(open_clear_deleted, m_file_cache.prune_key([&](const tuple<shared_ptr<BeesContext>, uint64_t, uint64_t> &key) {
+		return get<1>(key) == root;
+	}));
+}
+
+void
+BeesFdCache::clear_failed_roots()
+{
+	m_root_cache.prune([](const Fd &fd) {
+		return !fd;
+	});
+}
+
+void
+BeesFdCache::expire_idle(double seconds)
+{
+	BEESNOTE("Closing FDs idle for " << seconds << " seconds");
+	BEESCOUNTADD(root_expire_idle, m_root_cache.expire_idle(seconds));
+	BEESCOUNTADD(open_expire_idle, m_file_cache.expire_idle(seconds));
+}
+
 Fd
 BeesFdCache::open_root(shared_ptr<BeesContext> ctx, uint64_t root)
 {
@@ -70,7 +109,57 @@ BeesFdCache::open_root(shared_ptr<BeesContext> ctx, uint64_t root)
 Fd
 BeesFdCache::open_root_ino(shared_ptr<BeesContext> ctx, uint64_t root, uint64_t ino)
 {
-	return m_file_cache(ctx, root, ino);
+	// Files that are gone stay that way until their subvol is modified
+	const RootIno key(root, ino);
+	unique_lock<mutex> lock(m_negative_mutex);
+	auto found = m_negative_cache.find(key);
+	if (found != m_negative_cache.end()) {
+		const auto generation = found->second.m_generation;
+		lock.unlock();
+		if (ctx->roots()->root_generation(root) == generation) {
+			BEESCOUNT(open_negative_hit);
+			return Fd();
+		}
+		lock.lock();
+		found = m_negative_cache.find(key);
+		if (found != m_negative_cache.end() && found->second.m_generation == generation) {
+			m_negative_order.erase(found->second.m_order);
+			m_negative_cache.erase(found);
+			BEESCOUNT(open_negative_stale);
+		}
+	}
+	lock.unlock();
+
+	tl_open_gone = false;
+	auto rv = m_file_cache(ctx, root, ino);
+	if (rv) {
+		return rv;
+	}
+
+	// Don't use FD cache slots for failures
+	m_file_cache.expire(ctx, root, ino);
+
+	// Try again next time if the failure might not be permanent
+	if (!tl_open_gone) {
+		return rv;
+	}
+
+	const auto generation = ctx->roots()->root_generation(root);
+	lock.lock();
+	found = m_negative_cache.find(key);
+	if (found == m_negative_cache.end()) {
+		m_negative_order.push_back(key);
+		m_negative_cache[key] = NegativeSlot { generation, prev(m_negative_order.end()) };
+		BEESCOUNT(open_negative_insert);
+	} else {
+		found->second.m_generation = generation;
+		m_negative_order.splice(m_negative_order.end(), m_negative_order, found->second.m_order);
+	}
+	while (m_negative_order.size() > BEES_OPEN_NEGATIVE_CACHE_SIZE) {
+		m_negative_cache.erase(m_negative_order.front());
+		m_negative_order.pop_front();
+	}
+	return rv;
 }
 
 void
@@ -80,11 +169,53 @@ BeesFdCache::insert_root_ino(shared_ptr<BeesContext> ctx, Fd fd)
 	return m_file_cache.insert(fd, ctx, fid.root(), fid.ino());
 }
 
+bool
+BeesExtentIndex::find(uint64_t fingerprint, Entry &entry)
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto found = m_map.find(fingerprint);
+	if (found == m_map.end()) {
+		return false;
+	}
+	entry = found->second.m_entry;
+	return true;
+}
+
+void
+BeesExtentIndex::insert(uint64_t fingerprint, const Entry &entry)
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto found = m_map.find(fingerprint);
+	if (found == m_map.end()) {
+		m_order.push_back(fingerprint);
+		m_map[fingerprint] = Slot { entry, prev(m_order.end()) };
+	} else {
+		found->second.m_entry = entry;
+		m_order.splice(m_order.end(), m_order, found->second.m_order);
+	}
+	while (m_order.size() > BEES_EXTENT_INDEX_SIZE) {
+		m_map.erase(m_order.front());
+		m_order.pop_front();
+	}
+}
+
+void
+BeesExtentIndex::erase(uint64_t fingerprint)
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto found = m_map.find(fingerprint);
+	if (found == m_map.end()) {
+		return;
+	}
+	m_order.erase(found->second.m_order);
+	m_map.erase(found);
+}
+
 void
 BeesContext::dump_status()
 {
 	auto status_charp = getenv("BEESSTATUS");
-	if (!status_charp) return;
+	if (!status_charp || !*status_charp) return;
 	string status_file(status_charp);
 	BEESLOGINFO("Writing status to file '" << status_file << "' every " << BEES_STATUS_INTERVAL << " sec");
 	Timer total_timer;
@@ -92,12 +223,24 @@ BeesContext::dump_status()
 		BEESNOTE("writing status to file '" << status_file << "'");
 		ofstream ofs(status_file + ".tmp");
 
-		auto thisStats = BeesStats::s_global;
+		auto thisStats = BeesStats::snapshot();
 		ofs << "TOTAL:\n";
 		ofs << "\t" << thisStats << "\n";
 		auto avg_rates = thisStats / total_timer.age();
 		ofs << "RATES:\n";
 		ofs << "\t" << avg_rates << "\n";
+		ofs << "LATENCY:\n";
+		bees_latency_report(ofs);
+
+		shared_ptr<BeesRoots> roots;
+		{
+			unique_lock<mutex> lock(m_stop_mutex);
+			roots = m_roots;
+		}
+		if (roots) {
+			ofs << "SUBVOLS:\n";
+			roots->root_cost_to_stream(ofs);
+		}
 
 		ofs << "THREADS (work queue " << TaskMaster::get_queue_count() << " tasks, " << TaskMaster::get_thread_count() << " workers):\n";
 		for (auto t : BeesNote::get_status()) {
@@ -126,10 +269,237 @@ BeesContext::dump_status()
 	}
 }
 
+// Escape a label value for OpenMetrics text format
+static
+string
+metrics_label(const string &s)
+{
+	string rv;
+	for (auto c : s) {
+		switch (c) {
+			case '\\': rv += "\\\\"; break;
+			case '"': rv += "\\\""; break;
+			case '\n': rv += "\\n"; break;
+			default: rv += c;
+		}
+	}
+	return rv;
+}
+
+void
+BeesContext::write_metrics(ostream &os)
+{
+	auto thisStats = BeesStats::snapshot().get_map();
+	auto uptime = m_total_timer.age();
+
+	os << "# TYPE bees_uptime_seconds gauge\n";
+	os << "# HELP bees_uptime_seconds Time since bees started.\n";
+	os << "bees_uptime_seconds " << uptime << "\n";
+
+	os << "# TYPE bees_events counter\n";
+	os << "# HELP bees_events Event counters.  See docs/event-counters.md.\n";
+	for (const auto &i : thisStats) {
+		os << "bees_events_total{event=\"" << i.first << "\"} " << i.second << "\n";
+	}
+
+	os << "# TYPE bees_event_rate gauge\n";
+	os << "# HELP bees_event_rate Average events per second since bees started.\n";
+	for (const auto &i : thisStats) {
+		os << "bees_event_rate{event=\"" << i.first << "\"} " << i.second / uptime << "\n";
+	}
+
+	os << "# TYPE bees_kernel_latency_seconds summary\n";
+	os << "# HELP bees_kernel_latency_seconds Latency of kernel interface calls.\n";
+	os << "# UNIT bees_kernel_latency_seconds seconds\n";
+	for (const auto &i : bees_latency_interfaces()) {
+		for (auto q : { 0.5, 0.99, 0.999 }) {
+			os << "bees_kernel_latency_seconds{interface=\"" << i.name << "\",quantile=\"" << q << "\"} " << i.histogram.percentile(q) / 1e9 << "\n";
+		}
+		os << "bees_kernel_latency_seconds_count{interface=\"" << i.name << "\"} " << i.histogram.count() << "\n";
+		os << "bees_kernel_latency_seconds_sum{interface=\"" << i.name << "\"} " << i.histogram.sum() / 1e9 << "\n";
+	}
+
+	os << "# TYPE bees_task_queue_length gauge\n";
+	os << "# HELP bees_task_queue_length Tasks waiting for a worker.\n";
+	os << "bees_task_queue_length " << TaskMaster::get_queue_count() << "\n";
+	os << "# TYPE bees_worker_threads gauge\n";
+	os << "# HELP bees_worker_threads Worker threads in the task pool.\n";
+	os << "bees_worker_threads " << TaskMaster::get_thread_count() << "\n";
+
+	os << "# TYPE bees_log_messages_dropped counter\n";
+	os << "# HELP bees_log_messages_dropped Log messages dropped because the log writer fell behind.\n";
+	os << "bees_log_messages_dropped_total " << Chatter::dropped_count() << "\n";
+
+	os << "# TYPE bees_thread info\n";
+	os << "# HELP bees_thread Current status of each bees thread.\n";
+	for (const auto &t : BeesNote::get_status()) {
+		os << "bees_thread_info{tid=\"" << t.first << "\",status=\"" << metrics_label(t.second) << "\"} 1\n";
+	}
+
+	shared_ptr<BeesHashTable> hash_table;
+	shared_ptr<BeesRoots> roots;
+	{
+		unique_lock<mutex> lock(m_stop_mutex);
+		hash_table = m_hash_table;
+		roots = m_roots;
+	}
+	if (roots) {
+		auto cost_total = roots->root_cost_total();
+		static const struct {
+			const char *name;
+			const char *help;
+			uint64_t BeesRootCost::*field;
+		} cost_fields[] = {
+			{ "bees_subvol_scan_extents", "Extents scanned in each subvol.", &BeesRootCost::m_extents },
+			{ "bees_subvol_read_bytes", "Data read while scanning each subvol.", &BeesRootCost::m_read_bytes },
+			{ "bees_subvol_dedup_bytes", "Data removed by dedup in each subvol.", &BeesRootCost::m_dedup_bytes },
+			{ "bees_subvol_rewrite_extents", "Extents rewritten in each subvol.", &BeesRootCost::m_rewrite_extents },
+			{ "bees_subvol_rewrite_bytes", "Data copied by extent rewrites in each subvol.", &BeesRootCost::m_rewrite_bytes },
+			{ "bees_subvol_toxic", "Toxic extents hit while scanning each subvol.", &BeesRootCost::m_toxic },
+		};
+		for (const auto &f : cost_fields) {
+			os << "# TYPE " << f.name << " counter\n";
+			os << "# HELP " << f.name << " " << f.help << "\n";
+			for (const auto &i : cost_total) {
+				os << f.name << "_total{root=\"" << i.first << "\"} " << i.second.*f.field << "\n";
+			}
+		}
+		os << "# TYPE bees_subvol_scan_seconds counter\n";
+		os << "# HELP bees_subvol_scan_seconds Time spent scanning each subvol.\n";
+		os << "# UNIT bees_subvol_scan_seconds seconds\n";
+		for (const auto &i : cost_total) {
+			os << "bees_subvol_scan_seconds_total{root=\"" << i.first << "\"} " << i.second.m_scan_seconds << "\n";
+		}
+	}
+	if (hash_table) {
+		os << "# TYPE bees_hash_table_cells gauge\n";
+		os << "# HELP bees_hash_table_cells Hash table capacity in cells.\n";
+		os << "bees_hash_table_cells " << hash_table->total_cells() << "\n";
+		os << "# TYPE bees_hash_table_occupied_cells gauge\n";
+		os << "# HELP bees_hash_table_occupied_cells Occupied cells seen by the most recent hash table scan.\n";
+		os << "bees_hash_table_occupied_cells " << hash_table->occupied_cells() << "\n";
+	}
+
+	os << "# EOF\n";
+}
+
+void
+BeesContext::serve_metrics_client(int client_fd)
+{
+	// Read whatever request the client sends.  A client that sends
+	// nothing gets the bare metrics text; an HTTP GET gets a response
+	// header too.  Don't wait long for slow clients, there is only
+	// one metrics thread.
+	string request;
+	while (request.find("\r\n\r\n") == string::npos && request.size() < 4096) {
+		pollfd pfd = { client_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0) {
+			break;
+		}
+		char buf[1024];
+		auto rv = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (rv <= 0) {
+			break;
+		}
+		request.append(buf, rv);
+	}
+
+	ostringstream body;
+	write_metrics(body);
+
+	string reply;
+	if (request.compare(0, 4, "GET ") == 0) {
+		ostringstream header;
+		header << "HTTP/1.0 200 OK\r\n"
+			<< "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			<< "Content-Length: " << body.str().size() << "\r\n"
+			<< "Connection: close\r\n"
+			<< "\r\n";
+		reply = header.str();
+	}
+	reply += body.str();
+
+	timeval send_timeout;
+	send_timeout.tv_sec = 1;
+	send_timeout.tv_usec = 0;
+	setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+	size_t done = 0;
+	while (done < reply.size()) {
+		auto rv = send(client_fd, reply.data() + done, reply.size() - done, MSG_NOSIGNAL);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			BEESLOGDEBUG("metrics client send: " << strerror(errno));
+			BEESCOUNT(metrics_client_fail);
+			return;
+		}
+		done += rv;
+	}
+	BEESCOUNT(metrics_client);
+}
+
+void
+BeesContext::serve_metrics()
+{
+	auto metrics_charp = getenv("BEESMETRICS");
+	if (!metrics_charp || !*metrics_charp) return;
+	string metrics_path(metrics_charp);
+	BEESLOGINFO("Serving OpenMetrics on socket '" << metrics_path << "'");
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	THROW_CHECK1(invalid_argument, metrics_path, metrics_path.size() < sizeof(addr.sun_path));
+	metrics_path.copy(addr.sun_path, metrics_path.size());
+
+	Fd listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (!listen_fd) {
+		THROW_ERRNO("socket(AF_UNIX) for '" << metrics_path << "'");
+	}
+
+	// Remove the socket left behind by a previous run, but nothing else
+	struct stat st;
+	if (!lstat(metrics_path.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+		unlink(metrics_path.c_str());
+	}
+	DIE_IF_MINUS_ONE(::bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)));
+	DIE_IF_MINUS_ONE(::listen(listen_fd, 16));
+
+	while (true) {
+		{
+			unique_lock<mutex> lock(m_stop_mutex);
+			if (m_stop_status) {
+				break;
+			}
+		}
+
+		BEESNOTE("waiting for metrics client on '" << metrics_path << "'");
+		pollfd pfd = { listen_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, BEES_STATUS_INTERVAL * 1000) <= 0) {
+			continue;
+		}
+
+		Fd client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (!client_fd) {
+			BEESLOGDEBUG("accept on '" << metrics_path << "': " << strerror(errno));
+			continue;
+		}
+
+		BEESNOTE("writing metrics to client on '" << metrics_path << "'");
+		catch_all([&]() {
+			serve_metrics_client(client_fd);
+		});
+	}
+
+	unlink(metrics_path.c_str());
+}
+
 void
 BeesContext::show_progress()
 {
-	auto lastStats = BeesStats::s_global;
+	auto lastStats = BeesStats::snapshot();
 	Timer stats_timer;
 	Timer all_timer;
 	while (!stop_requested()) {
@@ -142,7 +512,7 @@ BeesContext::show_progress()
 		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_PROGRESS_INTERVAL));
 
 		// Snapshot stats and timer state
-		auto thisStats = BeesStats::s_global;
+		auto thisStats = BeesStats::snapshot();
 		auto stats_age = stats_timer.age();
 		auto all_age = all_timer.age();
 		stats_timer.lap();
@@ -167,6 +537,11 @@ BeesContext::show_progress()
 		auto deltaRates = deltaStats / stats_age;
 		BEESLOGINFO("\t" << deltaRates);
 
+		BEESNOTE("logging kernel interface latency");
+		ostringstream latency_oss;
+		bees_latency_report(latency_oss);
+		BEESLOGINFO("LATENCY:\n" << latency_oss.str());
+
 		BEESNOTE("logging current thread status");
 		BEESLOGINFO("THREADS:");
 
@@ -199,7 +574,8 @@ BeesContext::home_fd()
 BeesContext::BeesContext(shared_ptr<BeesContext> parent) :
 	m_parent_ctx(parent),
 	m_progress_thread("progress_report"),
-	m_status_thread("status_report")
+	m_status_thread("status_report"),
+	m_metrics_thread("metrics_server")
 {
 	if (m_parent_ctx) {
 		m_fd_cache = m_parent_ctx->fd_cache();
@@ -210,6 +586,9 @@ BeesContext::BeesContext(shared_ptr<BeesContext> parent) :
 	m_status_thread.exec([=]() {
 		dump_status();
 	});
+	m_metrics_thread.exec([=]() {
+		serve_metrics();
+	});
 }
 
 bool
@@ -221,15 +600,30 @@ BeesContext::is_root_ro(uint64_t root)
 bool
 BeesContext::dedup(const BeesRangePair &brp)
 {
+	off_t deduped;
+	return dedup(brp, deduped) == DEDUP_OK;
+}
+
+/// Dedupe brp.  deduped is set to the length of the leading part of brp
+/// that is now shared, which is less than brp's size if the kernel found
+/// different data after deduping some FILE_EXTENT_SAME chunks.
+BeesContext::DedupResult
+BeesContext::dedup(const BeesRangePair &brp, off_t &deduped)
+{
+	deduped = 0;
+
 	// TOOLONG and NOTE can retroactively fill in the filename details, but LOG can't
 	BEESNOTE("dedup " << brp);
 
 	brp.second.fd(shared_from_this());
 
+	BeesEvent bev(BeesEvent::DEDUP, brp.second, brp.second.begin(), brp.second.size());
+
 	if (is_root_ro(brp.second.fid().root())) {
 		// BEESLOGDEBUG("WORKAROUND: dst root is read-only in " << name_fd(brp.second.fd()));
 		BEESCOUNT(dedup_workaround_btrfs_send);
-		return false;
+		bev.outcome(BeesEvent::READONLY);
+		return DEDUP_REFUSED;
 	}
 
 	brp.first.fd(shared_from_this());
@@ -252,9 +646,21 @@ BeesContext::dedup(const BeesRangePair &brp)
 
 	BEESCOUNT(dedup_try);
 	Timer dedup_timer;
-	bool rv = btrfs_extent_same(brp.first.fd(), brp.first.begin(), brp.first.size(), brp.second.fd(), brp.second.begin());
+	bool rv;
+	try {
+		rv = btrfs_extent_same(brp.first.fd(), brp.first.begin(), brp.first.size(), brp.second.fd(), brp.second.begin(), deduped);
+	} catch (...) {
+		// Earlier chunks may have been deduped
+		invalidate_extent_map(brp.second);
+		throw;
+	}
 	BEESCOUNTADD(dedup_ms, dedup_timer.age() * 1000);
 
+	bev.outcome(rv ? BeesEvent::OK : BeesEvent::FAIL);
+
+	// Even a failed dedupe may have changed the dst extents
+	invalidate_extent_map(brp.second);
+
 	if (rv) {
 		BEESCOUNT(dedup_hit);
 		BEESCOUNTADD(dedup_bytes, brp.first.size());
@@ -265,10 +671,19 @@ BeesContext::dedup(const BeesRangePair &brp)
 		}
 	} else {
 		BEESCOUNT(dedup_miss);
-		BEESLOGWARN("NO Dedup! " << brp);
+		if (deduped) {
+			BEESCOUNT(dedup_partial);
+			BEESCOUNTADD(dedup_bytes, deduped);
+		}
+		if (m_trust_kernel_compare) {
+			// The hash table was out of date, or grow guessed too far
+			BEESLOGDEBUG("Data differs: " << brp);
+		} else {
+			BEESLOGWARN("NO Dedup! " << brp);
+		}
 	}
 
-	return rv;
+	return rv ? DEDUP_OK : DEDUP_DATA_DIFFERS;
 }
 
 BeesRangePair
@@ -280,7 +695,7 @@ BeesContext::dup_extent(const BeesFileRange &src)
 }
 
 void
-BeesContext::rewrite_file_range(const BeesFileRange &bfr)
+BeesContext::rewrite_file_range(const BeesFileRange &bfr, const map<off_t, pair<BeesHash, BeesAddress>> &hashes)
 {
 	auto m_ctx = shared_from_this();
 	BEESNOTE("Rewriting bfr " << bfr);
@@ -301,18 +716,36 @@ BeesContext::rewrite_file_range(const BeesFileRange &bfr)
 	// because the blocks we rewrote are likely duplicates of blocks from this
 	// generation that we are about to scan.  Pretty ugly but effective as an
 	// interim solution while we wait for tree-2 extent scanning.
+	// The data has not changed, so reuse the hashes computed during the scan
+	// for full blocks.  Only the addresses are new.  If the file was modified
+	// between the scan and the copy, a reused hash is wrong.  Normally the
+	// next match against it fails the userspace compare, but when matches
+	// are trusted it would be deduped without reading, so read the blocks.
+	const bool reuse_hashes = !trust_kernel_compare();
 	auto hash_table = m_ctx->hash_table();
-	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), root_fd());
+	const off_t file_size = bfr.file_size();
+	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), extent_map(bfr));
 	for (off_t next_p = bfr.begin(); next_p < bfr.end(); ) {
 		off_t p = next_p;
 		next_p += BLOCK_SIZE_SUMS;
 		ew.seek(p);
 		Extent e = ew.current();
 		BEESTRACE("next_p " << to_hex(next_p) << " p " << to_hex(p) << " e " << e);
-		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
 		BeesAddress addr(e, p);
+		if (addr.is_magic()) {
+			continue;
+		}
+		// The CRC64 of a zero block is zero, so any other known hash is a nonzero block
+		const auto found = reuse_hashes ? hashes.find(p) : hashes.end();
+		if (found != hashes.end() && found->second.first != 0 && next_p <= file_size) {
+			hash_table->push_random_hash_addr(found->second.first, addr);
+			BEESCOUNT(scan_reinsert);
+			continue;
+		}
+		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
 		bbd.addr(addr);
-		if (!addr.is_magic() && !bbd.is_data_zero()) {
+		BEESCOUNT(scan_reinsert_read);
+		if (!bbd.is_data_zero()) {
 			hash_table->push_random_hash_addr(bbd.hash(), bbd.addr());
 			BEESCOUNT(scan_reinsert);
 		}
@@ -320,13 +753,14 @@ BeesContext::rewrite_file_range(const BeesFileRange &bfr)
 }
 
 BeesFileRange
-BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
+BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e, BeesRootCost &cost)
 {
 	BEESNOTE("Scanning " << pretty(e.size()) << " "
 		<< to_hex(e.begin()) << ".." << to_hex(e.end())
 		<< " " << name_fd(bfr.fd()) );
 	BEESTRACE("scan extent " << e);
 	BEESCOUNT(scan_extent);
+	BeesEvent bev(BeesEvent::SCAN, bfr, e.begin(), e.size());
 
 	// We keep moving this method around
 	auto m_ctx = shared_from_this();
@@ -347,6 +781,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 	if (e.flags() & Extent::HOLE) {
 		// Nothing here, dispose of this early
 		BEESCOUNT(scan_hole);
+		bev.outcome(BeesEvent::HOLE);
 		return bfr;
 	}
 
@@ -362,14 +797,36 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		if (m_ctx->dedup(brp)) {
 			BEESCOUNT(dedup_prealloc_hit);
 			BEESCOUNTADD(dedup_prealloc_bytes, e.size());
+			cost.m_dedup_bytes += extent_size;
+			bev.outcome(BeesEvent::PREALLOC);
 			return bfr;
 		} else {
 			BEESCOUNT(dedup_prealloc_miss);
 		}
 	}
 
+	// Large unique extents are not worth reading in full
+	if (m_sample_interval > 1 && !(e.flags() & FIEMAP_EXTENT_ENCODED) && e.size() >= BEES_SAMPLE_EXTENT_MIN && !scan_sample(bfr, e, cost)) {
+		bev.outcome(BeesEvent::NO_MATCH);
+		return bfr;
+	}
+
 	// OK we need to read extent now
 	readahead(bfr.fd(), bfr.begin(), bfr.size());
+	cost.m_read_bytes += e.size();
+
+	// If we have seen an identical extent, dedupe the whole extent at once
+	uint64_t fingerprint = 0;
+	const off_t extent_size = min(e.end(), bfr.file_size()) - e.begin();
+	if (m_extent_index && extent_size > 0 && !BeesAddress(e, e.begin()).is_magic()) {
+		vector<BeesHash> fingerprint_hashes;
+		fingerprint = extent_fingerprint(bfr, e, extent_size, fingerprint_hashes);
+		if (fingerprint && dedup_whole_extent(bfr, e, fingerprint, fingerprint_hashes, extent_size)) {
+			cost.m_dedup_bytes += extent_size;
+			bev.outcome(BeesEvent::DEDUPED);
+			return bfr;
+		}
+	}
 
 	map<off_t, pair<BeesHash, BeesAddress>> insert_map;
 	set<off_t> noinsert_set;
@@ -491,6 +948,9 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 				// Extents may become non-toxic so give them a chance to expire.
 				// hash_table->push_front_hash_addr(hash, found_addr);
 				BEESCOUNT(scan_toxic_hash);
+				++cost.m_toxic;
+				bev.outcome(BeesEvent::TOXIC);
+				BeesHashTrace::record(BeesHashTraceRecord::LOOKUP, hash, addr, BeesHashTraceRecord::TOXIC);
 				return bfr;
 			}
 
@@ -522,6 +982,9 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 			});
 
 			if (abandon_extent) {
+				++cost.m_toxic;
+				bev.outcome(BeesEvent::TOXIC);
+				BeesHashTrace::record(BeesHashTraceRecord::LOOKUP, hash, addr, BeesHashTraceRecord::TOXIC);
 				return bfr;
 			}
 		}
@@ -542,6 +1005,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 			BEESNOTE("resolving " << resolved_addrs.size() << " matches for hash " << hash);
 
 			BeesFileRange replaced_bfr;
+			uint32_t dup_blocks = 0;
 
 			BeesAddress last_replaced_addr;
 			for (auto it = resolved_addrs.begin(); it != resolved_addrs.end(); ++it) {
@@ -583,6 +1047,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 						THROW_CHECK0(runtime_error, replaced_bfr);
 						for (off_t ip = replaced_bfr.begin(); ip < replaced_bfr.end(); ip += BLOCK_SIZE_SUMS) {
 							BEESCOUNT(scan_dup_block);
+							++dup_blocks;
 							noinsert_set.insert(ip);
 							if (ip >= e.begin() && ip < e.end()) {
 								off_t bar_p = (ip - e.begin()) / BLOCK_SIZE_SUMS;
@@ -606,8 +1071,10 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 				hash_table->push_front_hash_addr(hash, last_replaced_addr);
 				BEESCOUNT(scan_push_front);
 			}
+			BeesHashTrace::record(BeesHashTraceRecord::LOOKUP, hash, addr, last_replaced_addr ? BeesHashTraceRecord::DEDUPED : BeesHashTraceRecord::HIT, dup_blocks);
 		} else {
 			BEESCOUNT(matched_0);
+			BeesHashTrace::record(BeesHashTraceRecord::LOOKUP, hash, addr, found.empty() ? BeesHashTraceRecord::MISS : BeesHashTraceRecord::HIT);
 		}
 	}
 
@@ -643,7 +1110,7 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		// Don't bother if saving less than 1%
 		auto maximum_hidden_count = blocks_to_find.size() / 100;
 		for (auto i : bfr_set) {
-			BtrfsExtentWalker ref_ew(bfr.fd(), bfr.begin(), m_ctx->root_fd());
+			BtrfsExtentWalker ref_ew(bfr.fd(), bfr.begin(), m_ctx->extent_map(bfr));
 			Extent ref_e = ref_ew.current();
 			// BEESLOG("\tref_e " << ref_e);
 			THROW_CHECK2(out_of_range, ref_e, e, ref_e.offset() + ref_e.logical_len() <= e.physical_len());
@@ -688,7 +1155,9 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 			// BEESLOG("noinsert_set.count(" << to_hex(p) << ") " << noinsert_set.count(p));
 			if (noinsert_set.count(p)) {
 				if (p - last_p > 0) {
-					rewrite_file_range(BeesFileRange(bfr.fd(), last_p, p));
+					rewrite_file_range(BeesFileRange(bfr.fd(), last_p, p), insert_map);
+					++cost.m_rewrite_extents;
+					cost.m_rewrite_bytes += p - last_p;
 					blocks_rewritten = true;
 				}
 				last_p = next_p;
@@ -699,7 +1168,9 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		}
 		BEESTRACE("last");
 		if (next_p - last_p > 0) {
-			rewrite_file_range(BeesFileRange(bfr.fd(), last_p, next_p));
+			rewrite_file_range(BeesFileRange(bfr.fd(), last_p, next_p), insert_map);
+			++cost.m_rewrite_extents;
+			cost.m_rewrite_bytes += next_p - last_p;
 			blocks_rewritten = true;
 		}
 		if (blocks_rewritten) {
@@ -729,11 +1200,28 @@ BeesContext::scan_one_extent(const BeesFileRange &bfr, const Extent &e)
 		}
 	}
 
+	// We kept the whole extent, so identical extents can be deduped to it
+	if (fingerprint && !rewrite_extent) {
+		BeesExtentIndex::Entry entry;
+		entry.m_fid = bfr.fid();
+		entry.m_begin = e.begin();
+		entry.m_size = extent_size;
+		entry.m_addr = BeesAddress(e, e.begin());
+		m_extent_index->insert(fingerprint, entry);
+		BEESCOUNT(extent_index_insert);
+	}
+
 	// Visualize
 	if (bar != string(block_count, '.')) {
 		BEESLOGINFO("scan: " << pretty(e.size()) << " " << to_hex(e.begin()) << " [" << bar << "] " << to_hex(e.end()) << ' ' << name_fd(bfr.fd()));
 	}
 
+	// Blocks in noinsert_set were replaced by references to other copies
+	for (auto p : noinsert_set) {
+		cost.m_dedup_bytes += min(e.end(), p + BLOCK_SIZE_SUMS) - p;
+	}
+
+	bev.outcome(noinsert_set.empty() ? BeesEvent::NO_MATCH : BeesEvent::DEDUPED);
 	return bfr;
 }
 
@@ -773,10 +1261,13 @@ BeesContext::scan_forward(const BeesFileRange &bfr)
 		return bfr;
 	}
 
-	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), root_fd());
+	BtrfsExtentWalker ew(bfr.fd(), bfr.begin(), extent_map(bfr));
 
 	BeesFileRange return_bfr(bfr);
 
+	// Charge everything below to this subvol
+	BeesRootCost cost;
+
 	Extent e;
 	catch_all([&]() {
 		while (!stop_requested()) {
@@ -787,7 +1278,8 @@ BeesContext::scan_forward(const BeesFileRange &bfr)
 				BEESNOTE("waiting for extent bytenr " << to_hex(extent_bytenr));
 				auto extent_lock = m_extent_lock_set.make_lock(extent_bytenr);
 				Timer one_extent_timer;
-				return_bfr = scan_one_extent(bfr, e);
+				++cost.m_extents;
+				return_bfr = scan_one_extent(bfr, e, cost);
 				BEESCOUNTADD(scanf_extent_ms, one_extent_timer.age() * 1000);
 				BEESCOUNT(scanf_extent);
 			});
@@ -805,9 +1297,188 @@ BeesContext::scan_forward(const BeesFileRange &bfr)
 	BEESCOUNTADD(scanf_total_ms, scan_timer.age() * 1000);
 	BEESCOUNT(scanf_total);
 
+	cost.m_scan_seconds = scan_timer.age();
+	roots()->root_cost_add(bfr.fid().root(), cost);
+
 	return return_bfr;
 }
 
+/// Read the blocks of extent e at file offsets that are multiples of
+/// m_sample_interval blocks, and the first and last blocks, and look them
+/// up in the hash table.  The grid is fixed to file offsets, so copies of
+/// a file sample the same blocks even if their extents are split at
+/// different places.  Returns true if the whole extent must be read
+/// because a sampled block is zero or has a duplicate.  Otherwise the
+/// sampled blocks are inserted into the hash table and the rest of the
+/// extent is not read.
+bool
+BeesContext::scan_sample(const BeesFileRange &bfr, const Extent &e, BeesRootCost &cost)
+{
+	BEESNOTE("sampling " << pretty(e.size()) << " " << to_hex(e.begin()) << ".." << to_hex(e.end()) << " " << name_fd(bfr.fd()));
+	BEESTRACE("scan_sample " << e);
+	BEESCOUNT(scan_sample_try);
+
+	const off_t last_p = (e.end() - 1) & ~BLOCK_MASK_SUMS;
+	const off_t step = m_sample_interval * BLOCK_SIZE_SUMS;
+	auto hash_table = this->hash_table();
+	set<off_t> blocks;
+	blocks.insert(e.begin());
+	for (off_t p = (e.begin() + step - 1) / step * step; p < last_p; p += step) {
+		blocks.insert(p);
+	}
+	blocks.insert(last_p);
+	off_t read_bytes = 0;
+
+	map<off_t, pair<BeesHash, BeesAddress>> sample_map;
+	for (auto p : blocks) {
+		BeesAddress addr(e, p);
+		BeesBlockData bbd(bfr.fd(), p, min(BLOCK_SIZE_SUMS, e.end() - p));
+		bbd.addr(addr);
+		const BeesHash hash = bbd.hash();
+		BEESCOUNT(scan_sample_block);
+		read_bytes += bbd.size();
+
+		// Zero blocks are rewritten by the full scan
+		if (bbd.is_data_zero()) {
+			BEESCOUNT(scan_sample_zero);
+			return true;
+		}
+
+		auto found = hash_table->find_cell(hash);
+		for (auto i : found) {
+			const BeesAddress found_addr(i.e_addr);
+			if (!found_addr.is_toxic() && found_addr.get_physical_or_zero() != addr.get_physical_or_zero()) {
+				BEESCOUNT(scan_sample_hit);
+				return true;
+			}
+		}
+		BeesHashTrace::record(BeesHashTraceRecord::LOOKUP, hash, addr, found.empty() ? BeesHashTraceRecord::MISS : BeesHashTraceRecord::HIT);
+		sample_map.insert(make_pair(p, make_pair(hash, addr)));
+	}
+
+	// No duplicates found.  Insert only what we read.  If the whole extent
+	// is scanned instead, the scan counts the read.
+	cost.m_read_bytes += read_bytes;
+	for (auto i : sample_map) {
+		hash_table->push_random_hash_addr(i.second.first, i.second.second);
+		BEESCOUNT(inserted_block);
+	}
+	BEESCOUNT(scan_sample_skip);
+	BEESCOUNTADD(scan_sample_skip_bytes, e.size() - read_bytes);
+	return false;
+}
+
+/// Fingerprint of the first size bytes of extent e:  the size and the hashes
+/// of the first, middle and last blocks, which are returned in hashes.
+/// Returns 0 if the extent should not be deduped as a whole.  The hashes
+/// are not looked up here, so the block scan's hash table lookups are not
+/// repeated for every extent.
+uint64_t
+BeesContext::extent_fingerprint(const BeesFileRange &bfr, const Extent &e, off_t size, vector<BeesHash> &hashes)
+{
+	BEESTRACE("extent_fingerprint " << e << " size " << to_hex(size));
+	set<off_t> blocks;
+	blocks.insert(0);
+	blocks.insert((size / 2) & ~BLOCK_MASK_SUMS);
+	blocks.insert((size - 1) & ~BLOCK_MASK_SUMS);
+
+	vector<uint64_t> fp_data;
+	fp_data.push_back(size);
+	for (auto p : blocks) {
+		BeesBlockData bbd(bfr.fd(), e.begin() + p, min(BLOCK_SIZE_SUMS, size - p));
+		const BeesHash hash = bbd.hash();
+
+		// Zero blocks are removed by the block scan
+		if (bbd.is_data_zero()) {
+			BEESCOUNT(extent_index_zero);
+			return 0;
+		}
+
+		hashes.push_back(hash);
+		fp_data.push_back(hash);
+	}
+
+	return Digest::CRC::crc64(fp_data.data(), fp_data.size() * sizeof(fp_data[0]));
+}
+
+/// Dedupe the first size bytes of extent e in one call if the extent index
+/// has an extent with the same fingerprint.  The kernel compares the data.
+bool
+BeesContext::dedup_whole_extent(const BeesFileRange &bfr, const Extent &e, uint64_t fingerprint, const vector<BeesHash> &hashes, off_t size)
+{
+	BEESTRACE("dedup_whole_extent " << e << " fingerprint " << to_hex(fingerprint));
+	BeesExtentIndex::Entry entry;
+	if (!m_extent_index->find(fingerprint, entry)) {
+		BEESCOUNT(extent_index_miss);
+		return false;
+	}
+
+	// Another reference to the same extent, e.g. in a snapshot
+	const BeesAddress addr(e, e.begin());
+	if (entry.m_addr.get_physical_or_zero() == addr.get_physical_or_zero()) {
+		BEESCOUNT(extent_index_same);
+		return false;
+	}
+
+	if (entry.m_size != size || is_blacklisted(entry.m_fid)) {
+		BEESCOUNT(extent_index_skip);
+		return false;
+	}
+
+	// Leave extents with toxic blocks to the block scan
+	auto hash_table = this->hash_table();
+	for (auto hash : hashes) {
+		for (auto i : hash_table->find_cell(hash)) {
+			if (BeesAddress(i.e_addr).is_toxic()) {
+				BEESCOUNT(extent_index_toxic);
+				return false;
+			}
+		}
+	}
+
+	// The indexed extent must still be where we found it
+	Fd src_fd = roots()->open_root_ino(entry.m_fid.root(), entry.m_fid.ino());
+	if (!src_fd) {
+		BEESCOUNT(extent_index_no_fd);
+		m_extent_index->erase(fingerprint);
+		return false;
+	}
+	const BeesFileRange src_bfr(src_fd, entry.m_begin, entry.m_begin + size);
+	BtrfsExtentWalker ew(src_fd, entry.m_begin, extent_map(src_bfr));
+	const Extent src_e = ew.current();
+	if (src_e.begin() != entry.m_begin || min(src_e.end(), src_bfr.file_size()) - src_e.begin() != size || BeesAddress(src_e, src_e.begin()) != entry.m_addr) {
+		BEESCOUNT(extent_index_stale);
+		m_extent_index->erase(fingerprint);
+		return false;
+	}
+
+	const BeesFileRange dst_bfr(bfr.fd(), e.begin(), e.begin() + size);
+	if (src_bfr.overlaps(dst_bfr)) {
+		BEESCOUNT(extent_index_skip);
+		return false;
+	}
+
+	BeesRangePair brp(src_bfr, dst_bfr, false);
+	off_t deduped;
+	switch (dedup(brp, deduped)) {
+		case DEDUP_OK:
+			break;
+		case DEDUP_DATA_DIFFERS:
+			BEESCOUNT(extent_index_wrong);
+			m_extent_index->erase(fingerprint);
+			return false;
+		default:
+			// e.g. dst is read-only, the index entry may be fine
+			BEESCOUNT(extent_index_skip);
+			return false;
+	}
+
+	BEESCOUNT(extent_index_hit);
+	invalidate_addr(entry.m_addr);
+	invalidate_addr(addr);
+	return true;
+}
+
 BeesResolveAddrResult::BeesResolveAddrResult()
 {
 }
@@ -835,6 +1506,7 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 
 	// Time how long this takes
 	Timer resolve_timer;
+	BeesEvent bev(BeesEvent::RESOLVE, 0, 0, addr.get_physical_or_zero(), 0);
 
         BtrfsIoctlLogicalInoArgs log_ino(addr.get_physical_or_zero());
 
@@ -847,8 +1519,10 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 		BEESNOTE("resolving addr " << addr << " with LOGICAL_INO");
 		if (log_ino.do_ioctl_nothrow(root_fd())) {
 			BEESCOUNT(resolve_ok);
+			bev.outcome(BeesEvent::OK);
 		} else {
 			BEESCOUNT(resolve_fail);
+			bev.outcome(BeesEvent::FAIL);
 		}
 		BEESCOUNTADD(resolve_ms, resolve_timer.age() * 1000);
 	}
@@ -875,6 +1549,7 @@ BeesContext::resolve_addr_uncached(BeesAddress addr)
 	} else {
 		BEESLOGNOTICE("WORKAROUND: toxic address: addr = " << addr << ", sys_usage_delta = " << round(sys_usage_delta* 1000.0) / 1000.0 << ", user_usage_delta = " << round(user_usage_delta * 1000.0) / 1000.0 << ", rt_age = " << rt_age << ", refs " << log_ino.m_iors.size());
 		BEESCOUNT(resolve_toxic);
+		bev.outcome(BeesEvent::TOXIC);
 		rv.m_is_toxic = true;
 	}
 
@@ -894,6 +1569,33 @@ BeesContext::invalidate_addr(BeesAddress addr)
 	return m_resolve_cache.expire(addr.get_physical_or_zero());
 }
 
+/// Extent map shared by everything that walks the extents of bfr's file.
+/// Discarded when the subvol is modified.
+shared_ptr<BtrfsExtentMap>
+BeesContext::extent_map(const BeesFileRange &bfr)
+{
+	const auto fid = bfr.fid();
+	auto rv = m_extent_map_cache(fid.root(), fid.ino());
+	if (rv->generation(roots()->root_generation(fid.root()))) {
+		BEESCOUNT(extent_map_hit);
+	} else {
+		BEESCOUNT(extent_map_miss);
+	}
+	return rv;
+}
+
+/// Called after modifying the file without changing its size or times, e.g. dedupe
+void
+BeesContext::invalidate_extent_map(const BeesFileRange &bfr)
+{
+	const auto fid = bfr.fid();
+	// Don't create a map just to clear it
+	shared_ptr<BtrfsExtentMap> extent_map;
+	if (m_extent_map_cache.peek(extent_map, fid.root(), fid.ino())) {
+		extent_map->clear();
+	}
+}
+
 void
 BeesContext::set_root_fd(Fd fd)
 {
@@ -915,6 +1617,11 @@ BeesContext::set_root_fd(Fd fd)
 	m_resolve_cache.func([&](BeesAddress addr) -> BeesResolveAddrResult {
 		return resolve_addr_uncached(addr);
 	});
+
+	m_extent_map_cache.max_size(BEES_EXTENT_MAP_CACHE_SIZE);
+	m_extent_map_cache.func([&](uint64_t root, uint64_t ino) -> shared_ptr<BtrfsExtentMap> {
+		return make_shared<BtrfsExtentMap>(m_root_fd, root, ino);
+	});
 }
 
 const char *
@@ -974,7 +1681,14 @@ BeesContext::stop()
 	BEESNOTE("stopping hash table");
 	BEESLOGDEBUG("Stopping hash table");
 	if (m_hash_table) {
-		m_hash_table->stop();
+		// Crawl state is already saved, so spend what is left of the
+		// stop timeout on the hash table
+		auto hash_timeout = numeric_limits<double>::infinity();
+		if (m_stop_timeout > 0) {
+			hash_timeout = max(0.0, m_stop_timeout - stop_timer.age());
+			BEESLOGNOTICE("Flushing hash table for at most " << hash_timeout << " sec");
+		}
+		m_hash_table->stop(hash_timeout);
 		m_hash_table.reset();
 	} else {
 		BEESLOGDEBUG("Hash table not running");
@@ -1006,6 +1720,7 @@ BeesContext::stop()
 	m_stop_condvar.notify_all();
 	lock.unlock();
 	m_status_thread.join();
+	m_metrics_thread.join();
 
 	BEESLOGNOTICE("bees stopped in " << stop_timer << " sec");
 }
@@ -1095,11 +1810,59 @@ BeesContext::hash_table()
 	}
 	if (!m_hash_table) {
 		m_hash_table = make_shared<BeesHashTable>(shared_from_this(), "beeshash.dat");
+		m_hash_table->set_policy(m_hash_policy);
 	}
 	auto rv = m_hash_table;
 	return rv;
 }
 
+void
+BeesContext::set_hash_policy(BeesHashTable::Policy policy)
+{
+	THROW_CHECK1(invalid_argument, policy, policy < BeesHashTable::POLICY_MAX);
+	m_hash_policy = policy;
+}
+
+void
+BeesContext::set_stop_timeout(double seconds)
+{
+	THROW_CHECK1(invalid_argument, seconds, seconds >= 0);
+	m_stop_timeout = seconds;
+	if (seconds > 0) {
+		BEESLOGINFO("Stop timeout set to " << seconds << " sec");
+	}
+}
+
+void
+BeesContext::set_sample_interval(off_t blocks)
+{
+	THROW_CHECK1(invalid_argument, blocks, blocks >= 0);
+	m_sample_interval = blocks;
+	if (blocks > 1) {
+		BEESLOGINFO("Sampling every " << blocks << " blocks of uncompressed extents larger than " << pretty(BEES_SAMPLE_EXTENT_MIN));
+	}
+}
+
+void
+BeesContext::set_extent_index(bool enable)
+{
+	if (enable) {
+		m_extent_index = make_shared<BeesExtentIndex>();
+		BEESLOGINFO("Extent index enabled, " << BEES_EXTENT_INDEX_SIZE << " entries");
+	} else {
+		m_extent_index.reset();
+	}
+}
+
+void
+BeesContext::set_trust_kernel_compare(bool trust)
+{
+	m_trust_kernel_compare = trust;
+	if (trust) {
+		BEESLOGINFO("Trusting hash table matches, data will be compared by the kernel");
+	}
+}
+
 void
 BeesContext::set_root_path(string path)
 {
@@ -37,6 +37,21 @@ dump_bucket_locked(BeesHashTable::Cell *p, BeesHashTable::Cell *q)
 
 static const bool VERIFY_CLEARS_BUGS = false;
 
+// Compare cells without the CLOCK reuse counter
+static inline
+bool
+cell_matches(const BeesHashTable::Cell &cell, const BeesHashTable::Cell &mv)
+{
+	return cell.e_hash == mv.e_hash && (cell.e_addr & ~BeesHashTable::c_reuse_mask) == mv.e_addr;
+}
+
+static inline
+BeesHashTable::AddrType
+cell_reuse(const BeesHashTable::Cell &cell)
+{
+	return (cell.e_addr & BeesHashTable::c_reuse_mask) >> BeesHashTable::c_reuse_shift;
+}
+
 bool
 verify_cell_range(BeesHashTable::Cell *p, BeesHashTable::Cell *q, bool clear_bugs = VERIFY_CLEARS_BUGS)
 {
@@ -53,7 +68,10 @@ verify_cell_range(BeesHashTable::Cell *p, BeesHashTable::Cell *q, bool clear_bug
 			}
 			bugs_found = true;
 		}
-		if (cell->e_addr && !seen_it.insert(*cell).second) {
+		// Copies of an entry may have different CLOCK reuse counters
+		BeesHashTable::Cell masked = *cell;
+		masked.e_addr &= ~BeesHashTable::c_reuse_mask;
+		if (cell->e_addr && !seen_it.insert(masked).second) {
 			BEESCOUNT(bug_hash_duplicate_cell);
 			// BEESLOGDEBUG("Duplicate hash table entry:\nthis = " << *cell << "\nold = " << *seen_it.find(*cell));
 			BEESLOGDEBUG("Duplicate hash table entry: " << *cell);
@@ -160,11 +178,110 @@ BeesHashTable::flush_dirty_extents(bool slowly)
 	return wrote_extents;
 }
 
+/// Write the dirty extents between begin_index and end_index, joining
+/// adjacent dirty extents into one write.  Returns the number written.
+/// Extents stay dirty if the write fails, or if they are modified while
+/// the write is running.
+size_t
+BeesHashTable::flush_dirty_run(uint64_t begin_index, uint64_t end_index)
+{
+	BEESNOTE("flushing extents #" << begin_index << ".." << end_index << " of " << m_extents << " extents");
+	size_t rv = 0;
+	vector<uint8_t> run;
+	uint64_t run_index = 0;
+	// m_dirty_count of each extent in run when it was copied
+	vector<uint64_t> run_dirty_counts;
+	const auto write_run = [&]() {
+		if (run.empty()) {
+			return;
+		}
+		const auto run_extents = run.size() / BLOCK_SIZE_HASHTAB_EXTENT;
+		BEESTOOLONG("pwrite(fd " << m_fd << " '" << name_fd(m_fd)<< "', length " << to_hex(run.size()) << ", offset " << to_hex(m_extent_ptr[run_index].p_byte - m_byte_ptr) << ")");
+		pwrite_or_die(m_fd, run, m_extent_ptr[run_index].p_byte - m_byte_ptr);
+		for (size_t i = 0; i < run_extents; ++i) {
+			auto lock = lock_extent_by_index(run_index + i);
+			auto &metadata = m_extent_metadata.at(run_index + i);
+			if (metadata.m_dirty_count == run_dirty_counts.at(i)) {
+				metadata.m_dirty = false;
+			}
+		}
+		BEESCOUNTADD(hash_extent_out, run_extents);
+		rv += run_extents;
+		run.clear();
+		run_dirty_counts.clear();
+	};
+
+	for (auto extent_index = begin_index; extent_index < end_index; ++extent_index) {
+		auto lock = lock_extent_by_index(extent_index);
+		if (!m_extent_metadata.at(extent_index).m_dirty) {
+			lock.unlock();
+			write_run();
+			continue;
+		}
+		if (run.empty()) {
+			run_index = extent_index;
+		}
+		// Copy the extent so we can write without holding the lock
+		run.insert(run.end(), m_extent_ptr[extent_index].p_byte, m_extent_ptr[extent_index + 1].p_byte);
+		run_dirty_counts.push_back(m_extent_metadata.at(extent_index).m_dirty_count);
+	}
+	write_run();
+	return rv;
+}
+
+/// Flush every dirty extent as fast as possible with several threads.
+/// Runs of extents are claimed in ascending order, and no run is started
+/// after timeout seconds, so the extents that are dropped are always the
+/// ones at the end of the table.
+void
+BeesHashTable::flush_dirty_extents_fast(double timeout)
+{
+	THROW_CHECK1(runtime_error, m_buckets, m_buckets > 0);
+
+	Timer flush_timer;
+	atomic<uint64_t> next_index(0);
+	atomic<size_t> wrote_extents(0);
+	vector<shared_ptr<BeesThread>> threads;
+	for (size_t i = 0; i < BEES_SHUTDOWN_FLUSH_THREADS; ++i) {
+		threads.push_back(make_shared<BeesThread>("hash_flush_" + to_string(i), [&]() {
+			while (flush_timer.age() < timeout) {
+				const uint64_t begin_index = next_index.fetch_add(BEES_SHUTDOWN_FLUSH_EXTENTS);
+				if (begin_index >= m_extents) {
+					break;
+				}
+				catch_all([&]() {
+					wrote_extents += flush_dirty_run(begin_index, min(begin_index + BEES_SHUTDOWN_FLUSH_EXTENTS, m_extents));
+				});
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t->join();
+	}
+
+	size_t dropped_extents = 0;
+	uint64_t first_dropped = m_extents;
+	for (uint64_t extent_index = 0; extent_index < m_extents; ++extent_index) {
+		auto lock = lock_extent_by_index(extent_index);
+		if (m_extent_metadata.at(extent_index).m_dirty) {
+			++dropped_extents;
+			first_dropped = min(first_dropped, extent_index);
+		}
+	}
+	BEESCOUNTADD(hash_extent_drop, dropped_extents);
+
+	BEESLOGNOTICE("Hash table flushed " << wrote_extents << " extents (" << pretty(wrote_extents * BLOCK_SIZE_HASHTAB_EXTENT) << ") in " << flush_timer << " sec");
+	if (dropped_extents) {
+		BEESLOGNOTICE("Hash table dropped " << dropped_extents << " dirty extents (" << pretty(dropped_extents * BLOCK_SIZE_HASHTAB_EXTENT) << ") from extent #" << first_dropped << " of " << m_extents << " onward");
+	}
+}
+
 void
 BeesHashTable::set_extent_dirty_locked(uint64_t extent_index)
 {
 	// Must already be locked
 	m_extent_metadata.at(extent_index).m_dirty = true;
+	++m_extent_metadata.at(extent_index).m_dirty_count;
 
 	// Signal writeback thread
 	unique_lock<mutex> dirty_lock(m_dirty_mutex);
@@ -262,6 +379,8 @@ BeesHashTable::prefetch_loop()
 
 		BEESNOTE("calculating hash table statistics");
 
+		m_occupied_cells = occupied_count;
+
 		vector<string> histogram;
 		vector<size_t> thresholds;
 		size_t threshold = 1;
@@ -310,13 +429,21 @@ BeesHashTable::prefetch_loop()
 		graph_blob << "\n\n";
 
 		graph_blob << "TOTAL:\n";
-		auto thisStats = BeesStats::s_global;
+		auto thisStats = BeesStats::snapshot();
 		graph_blob << "\t" << thisStats << "\n";
 
 		graph_blob << "\nRATES:\n";
 		auto avg_rates = thisStats / m_ctx->total_timer().age();
 		graph_blob << "\t" << avg_rates << "\n";
 
+		graph_blob << "\nLATENCY:\n";
+		bees_latency_report(graph_blob);
+
+		graph_blob << "\nSUBVOLS:\n";
+		catch_all([&]() {
+			m_ctx->roots()->root_cost_to_stream(graph_blob);
+		});
+
 		BEESLOGINFO(graph_blob.str());
 		catch_all([&]() {
 			m_stats_file.write(graph_blob.str());
@@ -421,7 +548,18 @@ BeesHashTable::find_cell(HashType hash)
 	auto er = get_cell_range(hash);
 	// FIXME:  Weed out zero addresses in the table due to earlier bugs
 	copy_if(er.first, er.second, back_inserter(rv), [=](const Cell &ip) { return ip.e_hash == hash && ip.e_addr >= 0x1000; });
+	lock.unlock();
+	for (auto &i : rv) {
+		i.e_addr &= ~c_reuse_mask;
+	}
 	BEESCOUNT(hash_lookup);
+	// Miss and hit counters for each policy, indexed by m_policy
+	static const BeesCounters::Id policy_counters[POLICY_MAX][2] = {
+		{ BeesCounters::register_name("hash_miss_random"), BeesCounters::register_name("hash_hit_random") },
+		{ BeesCounters::register_name("hash_miss_clock"), BeesCounters::register_name("hash_hit_clock") },
+		{ BeesCounters::register_name("hash_miss_slru"), BeesCounters::register_name("hash_hit_slru") },
+	};
+	BeesCounters::add(policy_counters[m_policy][!rv.empty()], 1);
 	return rv;
 }
 
@@ -435,8 +573,8 @@ BeesHashTable::erase_hash_addr(HashType hash, AddrType addr)
 	BEESTOOLONG("erase hash " << to_hex(hash) << " addr " << addr);
 	auto lock = lock_extent_by_hash(hash);
 	auto er = get_cell_range(hash);
-	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell mv(hash, addr & ~c_reuse_mask);
+	Cell *ip = find_if(er.first, er.second, [&](const Cell &c) { return cell_matches(c, mv); });
 	bool found = (ip < er.second);
 	if (found) {
 		*ip = Cell(0, 0);
@@ -450,6 +588,8 @@ BeesHashTable::erase_hash_addr(HashType hash, AddrType addr)
 	} else {
 		BEESCOUNT(hash_erase_miss);
 	}
+	lock.unlock();
+	BeesHashTrace::record(BeesHashTraceRecord::ERASE, hash, addr, found ? BeesHashTraceRecord::HIT : BeesHashTraceRecord::MISS);
 }
 
 /// Insert a hash entry at the head of the list.  If entry is already
@@ -458,6 +598,10 @@ BeesHashTable::erase_hash_addr(HashType hash, AddrType addr)
 /// insert it at the front of the list, possibly dropping the last entry
 /// in the list, and return false.  Used to move duplicate hash blocks
 /// to the front of the list.
+///
+/// With the CLOCK policy, entries don't move:  a present entry has its
+/// reuse counter incremented, and a missing one is inserted with a
+/// count of 1.
 bool
 BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 {
@@ -465,9 +609,27 @@ BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 	BEESTOOLONG("push_front_hash_addr hash " << BeesHash(hash) <<" addr " << BeesAddress(addr));
 	auto lock = lock_extent_by_hash(hash);
 	auto er = get_cell_range(hash);
-	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell mv(hash, addr & ~c_reuse_mask);
+	Cell *ip = find_if(er.first, er.second, [&](const Cell &c) { return cell_matches(c, mv); });
 	bool found = (ip < er.second);
+	if (m_policy == CLOCK) {
+		if (!found) {
+			thread_local default_random_engine generator;
+			thread_local uniform_int_distribution<int> distribution(0, c_cells_per_bucket - 1);
+			clock_insert_locked(er, Cell(mv.e_hash, mv.e_addr | (AddrType(1) << c_reuse_shift)), distribution(generator));
+			BEESCOUNT(hash_front);
+			set_extent_dirty_locked(hash_to_extent_index(hash));
+		} else if (cell_reuse(*ip) < c_reuse_max) {
+			ip->e_addr += (AddrType(1) << c_reuse_shift);
+			BEESCOUNT(hash_front);
+			set_extent_dirty_locked(hash_to_extent_index(hash));
+		} else {
+			BEESCOUNT(hash_front_already);
+		}
+		lock.unlock();
+		BeesHashTrace::record(BeesHashTraceRecord::PROMOTE, hash, addr, found ? BeesHashTraceRecord::HIT : BeesHashTraceRecord::MISS);
+		return found;
+	}
 	if (!found) {
 		// If no match found, get rid of an empty space instead
 		// If no empty spaces, ip will point to end
@@ -491,7 +653,7 @@ BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 		}
 	}
 	// There is now a space at the front, insert there if different
-	if (er.first[0] != mv) {
+	if (!cell_matches(er.first[0], mv)) {
 		er.first[0] = mv;
 		set_extent_dirty_locked(hash_to_extent_index(hash));
 		BEESCOUNT(hash_front);
@@ -503,6 +665,8 @@ BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 		BEESLOGDEBUG("while push_fronting hash " << hash << " addr " << addr);
 	}
 #endif
+	lock.unlock();
+	BeesHashTrace::record(BeesHashTraceRecord::PROMOTE, hash, addr, found ? BeesHashTraceRecord::HIT : BeesHashTraceRecord::MISS);
 	return found;
 }
 
@@ -512,6 +676,11 @@ BeesHashTable::push_front_hash_addr(HashType hash, AddrType addr)
 /// inserts at a random position in the list, possibly evicting the entry
 /// at the end of the list.  Used to insert new unique (not-yet-duplicate)
 /// blocks in random order.
+///
+/// The SLRU policy always inserts at the head of the back half of the
+/// list, so new blocks can only evict other blocks that have not been
+/// moved to the front since they were inserted.  The CLOCK policy
+/// leaves present entries alone and inserts with a reuse count of 0.
 bool
 BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 {
@@ -519,19 +688,33 @@ BeesHashTable::push_random_hash_addr(HashType hash, AddrType addr)
 	BEESTOOLONG("push_random_hash_addr hash " << BeesHash(hash) << " addr " << BeesAddress(addr));
 	auto lock = lock_extent_by_hash(hash);
 	auto er = get_cell_range(hash);
-	Cell mv(hash, addr);
-	Cell *ip = find(er.first, er.second, mv);
+	Cell mv(hash, addr & ~c_reuse_mask);
+	Cell *ip = find_if(er.first, er.second, [&](const Cell &c) { return cell_matches(c, mv); });
 	bool found = (ip < er.second);
 
 	thread_local default_random_engine generator;
 	thread_local uniform_int_distribution<int> distribution(0, c_cells_per_bucket - 1);
 	auto pos = distribution(generator);
+	if (m_policy == SLRU) {
+		pos = c_cells_per_bucket / 2;
+	}
 
 	int case_cond = 0;
 #if 0
 	vector<Cell> saved(er.first, er.second);
 #endif
 
+	if (m_policy == CLOCK) {
+		if (found) {
+			BEESCOUNT(hash_already);
+			case_cond = 2;
+			goto ret;
+		}
+		clock_insert_locked(er, mv, pos);
+		case_cond = 6;
+		goto ret_dirty;
+	}
+
 	if (found) {
 		// If hash already exists after pos, swap with pos
 		if (ip > er.first + pos) {
@@ -599,9 +782,52 @@ ret:
 #else
 	(void)case_cond;
 #endif
+	lock.unlock();
+	BeesHashTrace::record(BeesHashTraceRecord::INSERT, hash, addr, found ? BeesHashTraceRecord::HIT : BeesHashTraceRecord::MISS);
 	return found;
 }
 
+/// Insert mv into the first empty cell, or else sweep from pos around
+/// the bucket, decrementing reuse counters until a cell with a count
+/// of 0 is found, and replace that cell.  There is nowhere to store a
+/// clock hand for each bucket, so the sweep starts at a random position.
+void
+BeesHashTable::clock_insert_locked(pair<Cell *, Cell *> er, const Cell &mv, size_t pos)
+{
+	Cell *ip = find(er.first, er.second, Cell(0, 0));
+	if (ip < er.second) {
+		*ip = mv;
+		return;
+	}
+	// Every full pass decrements every counter, so this terminates
+	const size_t cells = er.second - er.first;
+	for (size_t i = pos; ; ++i) {
+		ip = er.first + (i % cells);
+		if (!cell_reuse(*ip)) {
+			*ip = mv;
+			BEESCOUNT(hash_evict);
+			return;
+		}
+		ip->e_addr -= (AddrType(1) << c_reuse_shift);
+	}
+}
+
+const char *
+BeesHashTable::policy_name(Policy policy)
+{
+	static const char *const names[] = { "random", "clock", "slru" };
+	THROW_CHECK1(out_of_range, policy, policy < POLICY_MAX);
+	return names[policy];
+}
+
+void
+BeesHashTable::set_policy(Policy policy)
+{
+	THROW_CHECK1(invalid_argument, policy, policy < POLICY_MAX);
+	m_policy = policy;
+	BEESLOGINFO("Hash table replacement policy set to " << policy_name(policy));
+}
+
 void
 BeesHashTable::try_mmap_flags(int flags)
 {
@@ -659,10 +885,11 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	m_void_ptr_end(nullptr),
 	m_buckets(0),
 	m_cells(0),
+	m_occupied_cells(0),
 	m_writeback_thread("hash_writeback"),
 	m_prefetch_thread("hash_prefetch"),
 	m_flush_rate_limit(BEES_FLUSH_RATE),
-	m_stats_file(m_ctx->home_fd(), "beesstats.txt")
+	m_stats_file(filename.empty() ? Fd() : ctx->home_fd(), "beesstats.txt")
 {
 	// Sanity checks to protect the implementation from its weaknesses
 	THROW_CHECK2(invalid_argument, BLOCK_SIZE_HASHTAB_BUCKET, BLOCK_SIZE_HASHTAB_EXTENT, (BLOCK_SIZE_HASHTAB_EXTENT % BLOCK_SIZE_HASHTAB_BUCKET) == 0);
@@ -673,9 +900,19 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 	THROW_CHECK2(runtime_error, sizeof(Extent), BLOCK_SIZE_HASHTAB_EXTENT, BLOCK_SIZE_HASHTAB_EXTENT == sizeof(Extent));
 	THROW_CHECK2(runtime_error, sizeof(Extent::p_byte), BLOCK_SIZE_HASHTAB_EXTENT, BLOCK_SIZE_HASHTAB_EXTENT == sizeof(Extent::p_byte));
 
+	// Reuse counters must not overlap address bits or flags
+	THROW_CHECK2(runtime_error, c_reuse_mask, BeesAddress::c_all_mask, (c_reuse_mask & BeesAddress::c_all_mask) == 0);
+	THROW_CHECK1(runtime_error, c_reuse_mask, (c_reuse_mask & ~AddrType(BLOCK_MASK_CLONE)) == 0);
+
 	m_filename = filename;
 	m_size = size;
-	open_file();
+	if (m_filename.empty()) {
+		THROW_CHECK1(invalid_argument, m_size, m_size > 0);
+		THROW_CHECK1(invalid_argument, m_size, (m_size % BLOCK_SIZE_HASHTAB_EXTENT) == 0);
+	} else {
+		open_file();
+		BeesHashTrace::table_size(m_size);
+	}
 
 	// Now we know size we can compute stuff
 
@@ -723,6 +960,14 @@ BeesHashTable::BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t
 
 	m_extent_metadata.resize(m_extents);
 
+	// An anonymous table starts empty and is never written back
+	if (m_filename.empty()) {
+		for (auto &i : m_extent_metadata) {
+			i.m_missing = false;
+		}
+		return;
+	}
+
 	m_writeback_thread.exec([&]() {
 		writeback_loop();
         });
@@ -755,7 +1000,7 @@ BeesHashTable::~BeesHashTable()
 }
 
 void
-BeesHashTable::stop()
+BeesHashTable::stop(double timeout)
 {
 	BEESNOTE("stopping BeesHashTable threads");
 	BEESLOGDEBUG("Stopping BeesHashTable threads");
@@ -778,11 +1023,194 @@ BeesHashTable::stop()
 	BEESLOGDEBUG("Waiting for hash_writeback thread");
 	m_writeback_thread.join();
 
-	if (m_cell_ptr && m_size) {
+	if (m_cell_ptr && m_size && !!m_fd) {
 		BEESLOGDEBUG("Flushing hash table");
 		BEESNOTE("flushing hash table");
-		flush_dirty_extents(false);
+		flush_dirty_extents_fast(timeout);
 	}
 
 	BEESLOGDEBUG("BeesHashTable stopped");
 }
+
+// hash table trace ----------------------------------------
+
+static_assert(sizeof(BeesHashTraceRecord) == 3 * sizeof(uint64_t), "BeesHashTraceRecord must be 3 words");
+
+static const char bees_hash_trace_file[] = "beeshash-trace.dat";
+static const char bees_hash_trace_file_old[] = "beeshash-trace.dat.old";
+
+struct BeesHashTraceBuffer {
+	mutex				m_mutex;
+	vector<BeesHashTraceRecord>	m_recs;
+};
+
+static atomic<bool> bees_hash_trace_enabled(false);
+static atomic<uint64_t> bees_hash_trace_table_size(0);
+static mutex bees_hash_trace_mutex;
+static set<shared_ptr<BeesHashTraceBuffer>> bees_hash_trace_buffers;
+static Fd bees_hash_trace_dir_fd;
+static Fd bees_hash_trace_fd;
+
+// Writes the thread's remaining records when the thread exits
+struct BeesHashTraceThread {
+	shared_ptr<BeesHashTraceBuffer>	m_buf;
+	~BeesHashTraceThread();
+};
+
+static thread_local BeesHashTraceThread bees_hash_trace_thread;
+static thread_local bool bees_hash_trace_exited = false;
+
+static
+void
+bees_hash_trace_write(const vector<BeesHashTraceRecord> &recs)
+{
+	unique_lock<mutex> lock(bees_hash_trace_mutex);
+	// Records left over after stop() are discarded
+	if (!bees_hash_trace_dir_fd || recs.empty()) {
+		return;
+	}
+	catch_all([&]() {
+		if (!bees_hash_trace_fd) {
+			bees_hash_trace_fd = openat_or_die(bees_hash_trace_dir_fd, bees_hash_trace_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOATIME, 0600);
+			Stat st(bees_hash_trace_fd);
+			if (st.st_size == 0) {
+				BeesHashTraceRecord header;
+				memset(&header, 0, sizeof(header));
+				header.m_hash = BeesHashTraceRecord::c_magic;
+				header.m_addr = bees_hash_trace_table_size.load();
+				header.m_blocks = sizeof(header);
+				header.m_op = BeesHashTraceRecord::HEADER;
+				write_or_die(bees_hash_trace_fd, header);
+			}
+		}
+
+		write_or_die(bees_hash_trace_fd, recs.data(), recs.size() * sizeof(recs[0]));
+		BEESCOUNTADD(hash_trace_record, recs.size());
+
+		Stat st(bees_hash_trace_fd);
+		if (st.st_size >= BEES_HASH_TRACE_FILE_SIZE) {
+			BEESLOGINFO("Rotating hash table trace " << bees_hash_trace_file << " at " << st.st_size << " bytes");
+			renameat_or_die(bees_hash_trace_dir_fd, bees_hash_trace_file, bees_hash_trace_dir_fd, bees_hash_trace_file_old);
+			bees_hash_trace_fd = Fd();
+		}
+	});
+}
+
+// Takes the buffered records out of buf and writes them
+static
+void
+bees_hash_trace_drain(const shared_ptr<BeesHashTraceBuffer> &buf)
+{
+	vector<BeesHashTraceRecord> recs;
+	unique_lock<mutex> lock(buf->m_mutex);
+	recs.swap(buf->m_recs);
+	lock.unlock();
+	bees_hash_trace_write(recs);
+}
+
+BeesHashTraceThread::~BeesHashTraceThread()
+{
+	bees_hash_trace_exited = true;
+	if (!m_buf) {
+		return;
+	}
+	bees_hash_trace_drain(m_buf);
+	unique_lock<mutex> lock(bees_hash_trace_mutex);
+	bees_hash_trace_buffers.erase(m_buf);
+}
+
+void
+BeesHashTrace::record(BeesHashTraceRecord::Op op, uint64_t hash, uint64_t addr, BeesHashTraceRecord::Outcome outcome, uint32_t blocks)
+{
+	// Don't resurrect the thread_local after it has been destroyed
+	if (!bees_hash_trace_enabled.load(memory_order_relaxed) || bees_hash_trace_exited) {
+		return;
+	}
+	auto &buf = bees_hash_trace_thread.m_buf;
+	if (!buf) {
+		buf = make_shared<BeesHashTraceBuffer>();
+		buf->m_recs.reserve(BEES_HASH_TRACE_RECORDS);
+		unique_lock<mutex> lock(bees_hash_trace_mutex);
+		bees_hash_trace_buffers.insert(buf);
+	}
+
+	BeesHashTraceRecord rec;
+	rec.m_hash = hash;
+	rec.m_addr = addr;
+	rec.m_blocks = blocks;
+	rec.m_op = op;
+	rec.m_outcome = outcome;
+	rec.m_reserved = 0;
+
+	unique_lock<mutex> lock(buf->m_mutex);
+	buf->m_recs.push_back(rec);
+	if (buf->m_recs.size() >= BEES_HASH_TRACE_RECORDS) {
+		lock.unlock();
+		bees_hash_trace_drain(buf);
+	}
+}
+
+void
+BeesHashTrace::start(Fd dir_fd)
+{
+	unique_lock<mutex> lock(bees_hash_trace_mutex);
+	BEESLOGINFO("Writing hash table trace to " << bees_hash_trace_file << " in " << name_fd(dir_fd));
+	bees_hash_trace_dir_fd = dir_fd;
+	bees_hash_trace_enabled.store(true);
+}
+
+void
+BeesHashTrace::stop()
+{
+	if (!bees_hash_trace_enabled.exchange(false)) {
+		return;
+	}
+	unique_lock<mutex> lock(bees_hash_trace_mutex);
+	auto buffers = bees_hash_trace_buffers;
+	lock.unlock();
+	for (auto buf : buffers) {
+		bees_hash_trace_drain(buf);
+	}
+	lock.lock();
+	bees_hash_trace_dir_fd = Fd();
+	bees_hash_trace_fd = Fd();
+}
+
+bool
+BeesHashTrace::enabled()
+{
+	return bees_hash_trace_enabled.load(memory_order_relaxed);
+}
+
+void
+BeesHashTrace::table_size(uint64_t size)
+{
+	bees_hash_trace_table_size.store(size);
+}
+
+const char *
+BeesHashTraceRecord::op_name(uint8_t op)
+{
+	static const char *const names[] = {
+		"header",
+		"lookup",
+		"insert",
+		"promote",
+		"erase",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == OP_MAX, "BeesHashTraceRecord::Op names");
+	return op < OP_MAX ? names[op] : "unknown";
+}
+
+const char *
+BeesHashTraceRecord::outcome_name(uint8_t outcome)
+{
+	static const char *const names[] = {
+		"miss",
+		"hit",
+		"deduped",
+		"toxic",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == OUTCOME_MAX, "BeesHashTraceRecord::Outcome names");
+	return outcome < OUTCOME_MAX ? names[outcome] : "unknown";
+}
@@ -0,0 +1,32 @@
+#include "bees.h"
+
+using namespace crucible;
+using namespace std;
+
+// Everything but main() is in bees.cc, so tools and benchmarks can link it
+
+int
+main(int argc, char *argv[])
+{
+	cerr << "bees version " << BEES_VERSION << endl;
+
+	if (argc < 2) {
+		do_cmd_help(argv);
+		return EXIT_FAILURE;
+	}
+
+	// Don't let a slow log consumer stall worker threads
+	Chatter::enable_async();
+
+	int rv = 1;
+	catch_and_explain([&]() {
+		rv = bees_main(argc, argv);
+	}, [&](string s) {
+		// Get queued messages out before we terminate
+		Chatter::disable_async();
+		default_catch_explainer(s);
+	});
+	BEESLOGNOTICE("Exiting with status " << rv << " " << (rv ? "(failure)" : "(success)"));
+	Chatter::disable_async();
+	return rv;
+}
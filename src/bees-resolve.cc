@@ -35,6 +35,66 @@ BeesResolver::BeesResolver(shared_ptr<BeesContext> ctx, BeesAddress new_addr) :
 	addr(new_addr);
 }
 
+/// Dedupe brp, which was grown from seed.  When matches are not
+/// verified in userspace, a pair the kernel finds different is
+/// shrunk toward seed and retried.  If seed itself differs, the
+/// hash table entry that found it is wrong.  Chunks that the kernel
+/// deduped before it found different data are not submitted again.
+/// On success, brp is the range pair that was deduped.
+bool
+BeesResolver::dedup_grown(BeesRangePair &brp, const BeesRangePair &seed)
+{
+	off_t deduped;
+	auto rv = m_ctx->dedup(brp, deduped);
+	if (rv == BeesContext::DEDUP_OK) {
+		return true;
+	}
+	if (rv != BeesContext::DEDUP_DATA_DIFFERS || !m_ctx->trust_kernel_compare()) {
+		return false;
+	}
+
+	size_t retries = 0;
+	while (true) {
+		if (deduped) {
+			const off_t done_end = brp.first.begin() + deduped;
+			if (done_end > seed.first.begin()) {
+				// seed was deduped, the data that differs is after it
+				BEESCOUNT(dedup_shrink_hit);
+				brp = BeesRangePair(
+					BeesFileRange(brp.first.fd(), brp.first.begin(), done_end),
+					BeesFileRange(brp.second.fd(), brp.second.begin(), brp.second.begin() + deduped),
+					false);
+				return true;
+			}
+			// Skip the part that is already deduped
+			brp = BeesRangePair(
+				BeesFileRange(brp.first.fd(), done_end, brp.first.end()),
+				BeesFileRange(brp.second.fd(), brp.second.begin() + deduped, brp.second.end()),
+				false);
+		}
+		if (!brp.shrink(seed)) {
+			break;
+		}
+		if (++retries > BEES_DEDUP_SHRINK_RETRIES) {
+			brp = seed;
+		}
+		BEESCOUNT(dedup_shrink_try);
+		rv = m_ctx->dedup(brp, deduped);
+		if (rv == BeesContext::DEDUP_OK) {
+			BEESCOUNT(dedup_shrink_hit);
+			return true;
+		}
+		if (rv != BeesContext::DEDUP_DATA_DIFFERS) {
+			return false;
+		}
+	}
+
+	BEESCOUNT(dedup_trust_wrong);
+	m_found_data = false;
+	m_found_hash = false;
+	return false;
+}
+
 BeesBlockData
 BeesResolver::adjust_offset(const BeesFileRange &haystack, const BeesBlockData &needle)
 {
@@ -77,6 +137,14 @@ BeesResolver::adjust_offset(const BeesFileRange &haystack, const BeesBlockData &
 		BEESTRACE("Reading haystack (haystack_size = " << to_hex(haystack_size) << ")");
 		BeesBlockData straw(haystack.fd(), haystack_size & ~BLOCK_MASK_CLONE, haystack_size & BLOCK_MASK_CLONE);
 
+		// The hash table says it matches, and the kernel will check
+		if (m_ctx->trust_kernel_compare()) {
+			BEESCOUNT(adjust_eof_trusted);
+			m_found_data = true;
+			m_found_hash = true;
+			return straw;
+		}
+
 		// It either matches or it doesn't
 		BEESTRACE("Verifying haystack " << straw);
 		if (straw.is_data_equal(needle)) {
@@ -102,7 +170,7 @@ BeesResolver::adjust_offset(const BeesFileRange &haystack, const BeesBlockData &
 	bool is_compressed_offset = false;
 	bool is_exact = false;
 	if (m_addr.is_compressed()) {
-		BtrfsExtentWalker ew(haystack.fd(), haystack.begin(), m_ctx->root_fd());
+		BtrfsExtentWalker ew(haystack.fd(), haystack.begin(), m_ctx->extent_map(haystack));
 		BEESTRACE("haystack extent data " << ew);
 		Extent e = ew.current();
 		THROW_CHECK1(runtime_error, m_addr, m_addr.has_compressed_offset());
@@ -143,6 +211,14 @@ BeesResolver::adjust_offset(const BeesFileRange &haystack, const BeesBlockData &
 
 	BEESTRACE("straw = " << straw);
 
+	// The hash table says it matches, and the kernel will check
+	if (m_ctx->trust_kernel_compare()) {
+		BEESCOUNT(adjust_trusted);
+		m_found_data = true;
+		m_found_hash = true;
+		return straw;
+	}
+
 	// Stop if we find a match
 	if (straw.is_data_equal(needle)) {
 		BEESCOUNT(adjust_hit);
@@ -282,8 +358,9 @@ BeesResolver::replace_src(const BeesFileRange &src_bfr)
 
 		// Make pair(src, dst)
 		BEESTRACE("creating brp (" << i_bfr << ", " << j_bfr << ")");
-		BeesRangePair brp(i_bfr, j_bfr);
+		BeesRangePair brp(i_bfr, j_bfr, !m_ctx->trust_kernel_compare());
 		BEESTRACE("Found matching range: " << brp);
+		const BeesRangePair seed = brp;
 
 		// Extend range at beginning
 		BEESNOTE("Extending matching range: " << brp);
@@ -294,7 +371,7 @@ BeesResolver::replace_src(const BeesFileRange &src_bfr)
 
 		// Dedup
 		BEESNOTE("dedup " << brp);
-		if (m_ctx->dedup(brp)) {
+		if (dedup_grown(brp, seed)) {
 			BEESCOUNT(replacesrc_dedup_hit);
 			m_found_dup = true;
 		} else {
@@ -421,8 +498,9 @@ BeesResolver::replace_dst(const BeesFileRange &dst_bfr)
 
 		// Make pair(src, dst)
 		BEESTRACE("creating brp (" << src_bfr << ", " << dst_bfr << ")");
-		BeesRangePair brp(src_bfr, dst_bfr);
+		BeesRangePair brp(src_bfr, dst_bfr, !m_ctx->trust_kernel_compare());
 		BEESTRACE("Found matching range: " << brp);
+		const BeesRangePair seed = brp;
 
 		// Extend range at beginning
 		BEESNOTE("Extending matching range: " << brp);
@@ -434,7 +512,7 @@ BeesResolver::replace_dst(const BeesFileRange &dst_bfr)
 
 		// Dedup
 		BEESNOTE("dedup " << brp);
-		if (m_ctx->dedup(brp)) {
+		if (dedup_grown(brp, seed)) {
 			BEESCOUNT(replacedst_dedup_hit);
 			m_found_dup = true;
 			overlap_bfr = brp.second;
@@ -1,10 +1,12 @@
 #include "bees.h"
 
 #include "crucible/cache.h"
+#include "crucible/crc64.h"
 #include "crucible/ntoa.h"
 #include "crucible/string.h"
 #include "crucible/task.h"
 
+#include <cmath>
 #include <fstream>
 #include <tuple>
 
@@ -48,6 +50,44 @@ BeesCrawlState::operator<(const BeesCrawlState &that) const
 		< tie(that.m_min_transid, that.m_max_transid, that.m_objectid, that.m_offset, that.m_root);
 }
 
+bool
+BeesCrawlState::operator==(const BeesCrawlState &that) const
+{
+	return tie(m_min_transid, m_max_transid, m_objectid, m_offset, m_root, m_started)
+		== tie(that.m_min_transid, that.m_max_transid, that.m_objectid, that.m_offset, that.m_root, that.m_started);
+}
+
+BeesRootCost &
+BeesRootCost::operator+=(const BeesRootCost &that)
+{
+	m_extents += that.m_extents;
+	m_read_bytes += that.m_read_bytes;
+	m_scan_seconds += that.m_scan_seconds;
+	m_dedup_bytes += that.m_dedup_bytes;
+	m_rewrite_extents += that.m_rewrite_extents;
+	m_rewrite_bytes += that.m_rewrite_bytes;
+	m_toxic += that.m_toxic;
+	return *this;
+}
+
+double
+BeesRootCost::yield() const
+{
+	return m_scan_seconds > 0 ? m_dedup_bytes / m_scan_seconds : 0;
+}
+
+ostream &
+operator<<(ostream &os, const BeesRootCost &brc)
+{
+	return os << "extents " << brc.m_extents
+		<< " read " << pretty(brc.m_read_bytes)
+		<< " time " << round(brc.m_scan_seconds * 1000.0) / 1000.0 << "s"
+		<< " dedup " << pretty(brc.m_dedup_bytes)
+		<< " rewrite " << brc.m_rewrite_extents << " (" << pretty(brc.m_rewrite_bytes) << ")"
+		<< " toxic " << brc.m_toxic
+		<< " yield " << pretty(brc.yield()) << "/s";
+}
+
 string
 BeesRoots::scan_mode_ntoa(BeesRoots::ScanMode mode)
 {
@@ -99,25 +139,98 @@ BeesRoots::crawl_state_filename() const
 	return rv;
 }
 
-ostream &
-BeesRoots::state_to_stream(ostream &ofs)
+BeesCrawlStateRecord::BeesCrawlStateRecord(const BeesCrawlState &bcs, uint64_t flags) :
+	m_root(bcs.m_root),
+	m_objectid(bcs.m_objectid),
+	m_offset(bcs.m_offset),
+	m_min_transid(bcs.m_min_transid),
+	m_max_transid(bcs.m_max_transid),
+	m_started(bcs.m_started),
+	m_flags(flags),
+	m_crc(crc())
+{
+}
+
+BeesCrawlStateRecord
+BeesCrawlStateRecord::header(uint64_t seq)
+{
+	BeesCrawlStateRecord rv;
+	rv.m_root = c_magic;
+	rv.m_objectid = sizeof(BeesCrawlStateRecord);
+	rv.m_offset = seq;
+	rv.m_min_transid = rv.m_max_transid = rv.m_started = 0;
+	rv.m_crc = rv.crc();
+	return rv;
+}
+
+BeesCrawlState
+BeesCrawlStateRecord::state() const
+{
+	BeesCrawlState rv;
+	rv.m_root = m_root;
+	rv.m_objectid = m_objectid;
+	rv.m_offset = m_offset;
+	rv.m_min_transid = m_min_transid;
+	rv.m_max_transid = m_max_transid;
+	rv.m_started = m_started;
+	return rv;
+}
+
+uint64_t
+BeesCrawlStateRecord::crc() const
+{
+	return Digest::CRC::crc64(this, offsetof(BeesCrawlStateRecord, m_crc));
+}
+
+// Apply the records in data to states, and return the sequence number
+// from the header.  Stops at the first damaged record.
+static
+uint64_t
+bees_crawl_records_apply(const string &data, const string &name, map<uint64_t, BeesCrawlState> &states)
+{
+	const size_t rec_size = sizeof(BeesCrawlStateRecord);
+	THROW_CHECK2(runtime_error, name, data.size(), data.size() >= rec_size);
+	BeesCrawlStateRecord rec;
+	memcpy(&rec, data.data(), rec_size);
+	THROW_CHECK2(runtime_error, name, rec.m_root, rec.valid() && rec.m_root == BeesCrawlStateRecord::c_magic);
+	THROW_CHECK2(runtime_error, name, rec.m_objectid, rec.m_objectid == rec_size);
+	const auto seq = rec.m_offset;
+
+	for (size_t pos = rec_size; pos + rec_size <= data.size(); pos += rec_size) {
+		memcpy(&rec, data.data() + pos, rec_size);
+		if (!rec.valid()) {
+			// The rest was not completely written before a crash
+			BEESLOGWARN("Ignoring damaged records after offset " << pos << " in " << name);
+			BEESCOUNT(crawl_journal_bad);
+			break;
+		}
+		if (rec.m_flags & BeesCrawlStateRecord::ERASED) {
+			states.erase(rec.m_root);
+		} else {
+			states[rec.m_root] = rec.state();
+		}
+	}
+	return seq;
+}
+
+map<uint64_t, BeesCrawlState>
+BeesRoots::state_current()
 {
+	map<uint64_t, BeesCrawlState> rv;
+	unique_lock<mutex> lock(m_mutex);
 	for (auto i : m_root_crawl_map) {
 		auto ibcs = i.second->get_state_begin();
 		if (ibcs.m_max_transid) {
-			ofs << "root "        << ibcs.m_root                 << " ";
-			ofs << "objectid "    << ibcs.m_objectid             << " ";
-			ofs << "offset "      << ibcs.m_offset               << " ";
-			ofs << "min_transid " << ibcs.m_min_transid          << " ";
-			ofs << "max_transid " << ibcs.m_max_transid          << " ";
-			ofs << "started "     << ibcs.m_started              << " ";
-			ofs << "start_ts "    << format_time(ibcs.m_started) << "\n";
+			rv[ibcs.m_root] = ibcs;
 		}
 	}
-	return ofs;
+	m_crawl_dirty = false;
+	return rv;
 }
 
-void
+/// Write the state of every crawler to beescrawl.bin, and start a new
+/// journal.  Returns the number of crawlers saved.
+size_t
 BeesRoots::state_save()
 {
 	BEESNOTE("saving crawl state");
@@ -126,39 +239,79 @@ BeesRoots::state_save()
 
 	Timer save_time;
 
-	unique_lock<mutex> lock(m_mutex);
+	const auto states = state_current();
+	if (states.empty()) {
+		BEESLOGWARN("Crawl state empty!");
+		return 0;
+	}
 
 	// We don't have ofstreamat or ofdstream in C++11, so we're building a string and writing it with raw syscalls.
-	ostringstream ofs;
-
-	if (!m_crawl_dirty) {
-		BEESLOGINFO("Nothing to save");
-		return;
+	const auto seq = m_crawl_journal_seq + 1;
+	vector<BeesCrawlStateRecord> recs;
+	recs.push_back(BeesCrawlStateRecord::header(seq));
+	for (auto i : states) {
+		recs.push_back(BeesCrawlStateRecord(i.second));
 	}
+	m_crawl_state_file.write(string(reinterpret_cast<const char *>(recs.data()), recs.size() * sizeof(recs[0])));
+
+	// The old journal has the old sequence number, so it won't be replayed
+	// if we crash before it is replaced
+	const auto header = BeesCrawlStateRecord::header(seq);
+	m_crawl_journal_file.write(string(reinterpret_cast<const char *>(&header), sizeof(header)));
+	m_crawl_journal_fd = openat_or_die(m_ctx->home_fd(), m_crawl_journal_file.name(), O_WRONLY | O_APPEND | O_CLOEXEC | O_NOATIME, 0);
+	m_crawl_journal_size = sizeof(header);
+	m_crawl_journal_seq = seq;
+	m_crawl_saved = states;
+	m_crawl_save_timer.reset();
+
+	BEESCOUNT(crawl_save);
+	BEESLOGINFO("Saved crawl state in " << save_time << "s");
+	return states.size();
+}
 
-	state_to_stream(ofs);
+/// Append crawlers that made progress since the last save or checkpoint
+/// to the journal.  This is cheap enough to do every few seconds.  The
+/// journal is not synced (see BeesStringFile::write for why), so after a
+/// host crash the tail may be lost and that work is repeated.
+/// Returns the number of crawlers saved.
+size_t
+BeesRoots::state_checkpoint()
+{
+	BEESNOTE("checkpointing crawl state");
 
-	if (ofs.str().empty()) {
-		BEESLOGWARN("Crawl state empty!");
-		m_crawl_dirty = false;
-		return;
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_crawl_dirty) {
+		return 0;
 	}
-
 	lock.unlock();
 
-	m_crawl_state_file.write(ofs.str());
+	if (!m_crawl_journal_fd || m_crawl_journal_size >= BEES_CRAWL_JOURNAL_MAX || m_crawl_save_timer.age() >= BEES_WRITEBACK_INTERVAL) {
+		return state_save();
+	}
 
-	// Renaming things is hard after release
-	if (m_crawl_state_file.name() != "beescrawl.dat") {
-		renameat(m_ctx->home_fd(), m_crawl_state_file.name().c_str(), m_ctx->home_fd(), "beescrawl.dat");
-		m_crawl_state_file.name("beescrawl.dat");
+	const auto states = state_current();
+	vector<BeesCrawlStateRecord> recs;
+	for (auto i : states) {
+		auto found = m_crawl_saved.find(i.first);
+		if (found == m_crawl_saved.end() || found->second != i.second) {
+			recs.push_back(BeesCrawlStateRecord(i.second));
+		}
+	}
+	for (auto i : m_crawl_saved) {
+		if (!states.count(i.first)) {
+			recs.push_back(BeesCrawlStateRecord(i.second, BeesCrawlStateRecord::ERASED));
+		}
+	}
+	if (recs.empty()) {
+		return 0;
 	}
 
-	BEESNOTE("relocking crawl state");
-	lock.lock();
-	// Not really correct but probably close enough
-	m_crawl_dirty = false;
-	BEESLOGINFO("Saved crawl state in " << save_time << "s");
+	write_or_die(m_crawl_journal_fd, recs.data(), recs.size() * sizeof(recs[0]));
+	m_crawl_journal_size += recs.size() * sizeof(recs[0]);
+	m_crawl_saved = states;
+	BEESCOUNT(crawl_checkpoint);
+	BEESCOUNTADD(crawl_checkpoint_record, recs.size());
+	return recs.size();
 }
 
 void
@@ -247,7 +400,7 @@ BeesRoots::transid_max()
 }
 
 size_t
-BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl)
+BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl, size_t batch_max)
 {
 	BEESNOTE("Crawling batch " << this_crawl->get_state_begin());
 	auto ctx_copy = m_ctx;
@@ -256,7 +409,7 @@ BeesRoots::crawl_batch(shared_ptr<BeesCrawl> this_crawl)
 	ostringstream oss;
 	oss << "crawl_" << subvol;
 	auto task_title = oss.str();
-	while (batch_count < BEES_MAX_CRAWL_BATCH) {
+	while (batch_count < batch_max) {
 		auto this_range = this_crawl->pop_front();
 		if (!this_range) {
 			break;
@@ -290,6 +443,9 @@ BeesRoots::crawl_roots()
 		BEESLOGINFO("idle: crawl map is empty!");
 	}
 
+	// Subvols that have produced little dedup for the time we spent on them
+	auto poor_roots = root_cost_poor();
+
 	switch (m_scan_mode) {
 
 		case SCAN_MODE_ZERO: {
@@ -326,9 +482,15 @@ BeesRoots::crawl_roots()
 
 		case SCAN_MODE_ONE: {
 			// Scan each subvol one extent at a time (good for continuous forward progress)
+			// Subvols with poor dedup yield get a smaller share of the queue
 			size_t batch_count = 0;
 			for (auto i : crawl_map_copy) {
-				batch_count += crawl_batch(i.second);
+				if (poor_roots.count(i.first)) {
+					BEESCOUNT(crawl_deprioritized);
+					batch_count += crawl_batch(i.second, BEES_MAX_CRAWL_BATCH_POOR);
+				} else {
+					batch_count += crawl_batch(i.second);
+				}
 			}
 
 			if (batch_count) {
@@ -344,16 +506,22 @@ BeesRoots::crawl_roots()
 			for (auto i : crawl_map_copy) {
 				crawl_vector.push_back(i.second);
 			}
+			// Subvols with poor dedup yield go after all the others
 			sort(crawl_vector.begin(), crawl_vector.end(), [&](const shared_ptr<BeesCrawl> &a, const shared_ptr<BeesCrawl> &b) -> bool {
 				auto a_state = a->get_state_end();
 				auto b_state = b->get_state_end();
-				return tie(a_state.m_started, a_state.m_root) < tie(b_state.m_started, b_state.m_root);
+				bool a_poor = poor_roots.count(a_state.m_root);
+				bool b_poor = poor_roots.count(b_state.m_root);
+				return tie(a_poor, a_state.m_started, a_state.m_root) < tie(b_poor, b_state.m_started, b_state.m_root);
 			});
 
 			size_t batch_count = 0;
 			for (auto i : crawl_vector) {
 				batch_count += crawl_batch(i);
 				if (batch_count) {
+					if (poor_roots.count(i->get_state_end().m_root)) {
+						BEESCOUNT(crawl_deprioritized);
+					}
 					return true;
 				}
 			}
@@ -375,13 +543,124 @@ BeesRoots::crawl_roots()
 	return false;
 }
 
+/// Subvols that have been deleted but not yet cleaned up.  Deleting a
+/// subvol inserts an orphan item for it in the root tree, which the
+/// cleaner removes when it is done.
+set<uint64_t>
+BeesRoots::deleted_roots()
+{
+	set<uint64_t> rv;
+	BtrfsIoctlSearchKey sk;
+	sk.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk.min_objectid = sk.max_objectid = BTRFS_ORPHAN_OBJECTID;
+	sk.min_type = sk.max_type = BTRFS_ORPHAN_ITEM_KEY;
+
+	while (true) {
+		sk.nr_items = 1024;
+		sk.do_ioctl(m_ctx->root_fd());
+
+		if (sk.m_result.empty()) {
+			break;
+		}
+
+		for (auto i : sk.m_result) {
+			sk.next_min(i);
+			if (i.objectid == BTRFS_ORPHAN_OBJECTID && i.type == BTRFS_ORPHAN_ITEM_KEY) {
+				rv.insert(i.offset);
+			}
+		}
+	}
+	return rv;
+}
+
 void
 BeesRoots::clear_caches()
 {
-	m_ctx->fd_cache()->clear();
+	// Open FDs in deleted subvols prevent the cleaner from removing them.
+	// Drop those and leave the rest of the cache warm.
+	for (auto root : deleted_roots()) {
+		BEESLOGDEBUG("Closing FDs in deleted root " << root);
+		m_ctx->fd_cache()->clear_root(root);
+	}
+
+	// Retry subvols that could not be opened
+	m_ctx->fd_cache()->clear_failed_roots();
+
+	// Subvol flags can change at any time, and are cheap to check
+	// when the root FD is cached
 	m_root_ro_cache.clear();
 }
 
+void
+BeesRoots::root_cost_add(uint64_t root, const BeesRootCost &cost)
+{
+	unique_lock<mutex> lock(m_cost_mutex);
+	m_cost_total[root] += cost;
+	m_cost_cycle[root] += cost;
+}
+
+void
+BeesRoots::root_cost_new_cycle(uint64_t root)
+{
+	unique_lock<mutex> lock(m_cost_mutex);
+	auto found = m_cost_cycle.find(root);
+	if (found != m_cost_cycle.end()) {
+		m_cost_last_cycle[root] = found->second;
+		m_cost_cycle.erase(found);
+	}
+}
+
+map<uint64_t, BeesRootCost>
+BeesRoots::root_cost_total()
+{
+	unique_lock<mutex> lock(m_cost_mutex);
+	return m_cost_total;
+}
+
+set<uint64_t>
+BeesRoots::root_cost_poor()
+{
+	unique_lock<mutex> lock(m_cost_mutex);
+	BeesRootCost all;
+	for (auto i : m_cost_total) {
+		all += i.second;
+	}
+	set<uint64_t> rv;
+	// If nothing has been deduped anywhere, there's nothing to compare with
+	if (!all.m_dedup_bytes) {
+		return rv;
+	}
+	for (auto i : m_cost_total) {
+		if (i.second.m_scan_seconds >= BEES_ROOT_COST_MIN_SECONDS &&
+			i.second.yield() < all.yield() * BEES_ROOT_COST_POOR_FRACTION) {
+			rv.insert(i.first);
+		}
+	}
+	return rv;
+}
+
+ostream &
+BeesRoots::root_cost_to_stream(ostream &os)
+{
+	unique_lock<mutex> lock(m_cost_mutex);
+	auto cost_total = m_cost_total;
+	auto cost_cycle = m_cost_cycle;
+	auto cost_last_cycle = m_cost_last_cycle;
+	lock.unlock();
+
+	auto poor_roots = root_cost_poor();
+	for (auto i : cost_total) {
+		os << "\troot " << i.first << (poor_roots.count(i.first) ? " (deprioritized)" : "") << ":\n";
+		os << "\t\ttotal:      " << i.second << "\n";
+		os << "\t\tthis cycle: " << cost_cycle[i.first] << "\n";
+		auto found = cost_last_cycle.find(i.first);
+		if (found != cost_last_cycle.end()) {
+			os << "\t\tlast cycle: " << found->second << "\n";
+		}
+	}
+	return os;
+}
+
 void
 BeesRoots::crawl_thread()
 {
@@ -431,10 +710,16 @@ BeesRoots::crawl_thread()
 		// Even open files are a problem if they're big enough.
 		auto new_count = m_transid_re.count();
 		if (new_count != last_count) {
-			clear_caches();
+			catch_all([&]() {
+				clear_caches();
+			});
 		}
 		last_count = new_count;
 
+		// Deleted files are a problem too if they are big enough,
+		// so don't keep idle FDs forever
+		m_ctx->fd_cache()->expire_idle(BEES_FD_CACHE_IDLE_AGE);
+
 		// If no crawl task is running, start a new one
 		m_crawl_task.run();
 
@@ -457,8 +742,8 @@ BeesRoots::writeback_thread()
 		BEESNOTE("idle, " << (m_crawl_dirty ? "dirty" : "clean"));
 
 		catch_all([&]() {
-			BEESNOTE("saving crawler state");
-			state_save();
+			BEESNOTE("checkpointing crawler state");
+			state_checkpoint();
 		});
 
 		unique_lock<mutex> lock(m_stop_mutex);
@@ -466,11 +751,13 @@ BeesRoots::writeback_thread()
 			BEESLOGDEBUG("Stop requested in writeback thread");
 			catch_all([&]() {
 				BEESNOTE("flushing crawler state");
-				state_save();
+				Timer flush_timer;
+				const auto saved = state_checkpoint();
+				BEESLOGNOTICE("Crawl state saved for " << saved << " changed subvols in " << flush_timer << " sec, " << m_crawl_saved.size() << " subvols on disk");
 			});
 			return;
 		}
-		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_WRITEBACK_INTERVAL));
+		m_stop_condvar.wait_for(lock, chrono::duration<double>(BEES_CRAWL_CHECKPOINT_INTERVAL));
 	}
 }
 
@@ -520,13 +807,15 @@ BeesRoots::insert_new_crawl()
 	}
 }
 
+/// Read beescrawl.dat, the text format used before beescrawl.bin
 void
-BeesRoots::state_load()
+BeesRoots::state_load_text(map<uint64_t, BeesCrawlState> &states)
 {
-	BEESNOTE("loading crawl state");
-	BEESLOGINFO("loading crawl state");
-
-	string crawl_data = m_crawl_state_file.read();
+	BeesStringFile text_file(m_ctx->home_fd(), crawl_state_filename());
+	string crawl_data = text_file.read();
+	if (!crawl_data.empty()) {
+		BEESLOGINFO("Loading crawl state from " << text_file.name());
+	}
 
 	for (auto line : split("\n", crawl_data)) {
 		BEESLOGDEBUG("Read line: " << line);
@@ -551,6 +840,41 @@ BeesRoots::state_load()
 		if (d.count("started")) {
 			loaded_state.m_started = d.at("started");
 		}
+		states[loaded_state.m_root] = loaded_state;
+	}
+}
+
+void
+BeesRoots::state_load()
+{
+	BEESNOTE("loading crawl state");
+	BEESLOGINFO("loading crawl state");
+
+	map<uint64_t, BeesCrawlState> states;
+	string crawl_data = m_crawl_state_file.read();
+	if (crawl_data.empty()) {
+		state_load_text(states);
+	} else {
+		const auto seq = bees_crawl_records_apply(crawl_data, m_crawl_state_file.name(), states);
+		m_crawl_journal_seq = seq;
+		catch_all([&]() {
+			string journal_data = m_crawl_journal_file.read();
+			if (journal_data.empty()) {
+				return;
+			}
+			// Apply to a copy so a bad header doesn't lose beescrawl.bin's state
+			auto journal_states = states;
+			const auto journal_seq = bees_crawl_records_apply(journal_data, m_crawl_journal_file.name(), journal_states);
+			if (journal_seq == seq) {
+				states = journal_states;
+			} else {
+				BEESLOGINFO("Ignoring " << m_crawl_journal_file.name() << " sequence " << journal_seq << ", expected " << seq);
+			}
+		});
+	}
+
+	for (auto i : states) {
+		auto loaded_state = i.second;
 		BEESLOGDEBUG("loaded_state " << loaded_state);
 		if (loaded_state.m_min_transid == numeric_limits<uint64_t>::max()) {
 			BEESLOGWARN("WARNING: root " << loaded_state.m_root << ": bad min_transid " << loaded_state.m_min_transid << ", resetting to 0");
@@ -568,9 +892,11 @@ BeesRoots::state_load()
 
 BeesRoots::BeesRoots(shared_ptr<BeesContext> ctx) :
 	m_ctx(ctx),
-	m_crawl_state_file(ctx->home_fd(), crawl_state_filename()),
+	m_crawl_state_file(ctx->home_fd(), "beescrawl.bin"),
+	m_crawl_journal_file(ctx->home_fd(), "beescrawl.journal", BEES_CRAWL_JOURNAL_MAX * 4),
 	m_crawl_thread("crawl_transid"),
-	m_writeback_thread("crawl_writeback")
+	m_writeback_thread("crawl_writeback"),
+	m_open_by_handle(true)
 {
 
 	m_root_ro_cache.func([&](uint64_t root) -> bool {
@@ -578,6 +904,12 @@ BeesRoots::BeesRoots(shared_ptr<BeesContext> ctx) :
 	});
 	m_root_ro_cache.max_size(BEES_ROOT_FD_CACHE_SIZE);
 
+	// Keyed by transid_max too, so entries are refreshed when it changes
+	m_root_gen_cache.func([&](uint64_t root, uint64_t) -> uint64_t {
+		return root_generation_nocache(root);
+	});
+	m_root_gen_cache.max_size(BEES_ROOT_FD_CACHE_SIZE);
+
 	m_crawl_thread.exec([&]() {
 		// Measure current transid before creating any crawlers
 		catch_all([&]() {
@@ -619,6 +951,59 @@ BeesRoots::stop()
 	BEESLOGDEBUG("BeesRoots stopped");
 }
 
+/// Open root, ino with a btrfs file handle, which needs no path lookups
+/// and is not affected by renames.  Returns false if file handles are
+/// not supported and the caller should fall back to paths, otherwise
+/// returns true with the open Fd, or an empty Fd if the inode is gone.
+bool
+BeesRoots::open_by_handle(uint64_t root, uint64_t ino, int flags, Fd &rv, bool &gone)
+{
+	gone = false;
+	if (!m_open_by_handle) {
+		return false;
+	}
+
+	BEESTRACE("open_by_handle root " << root << " ino " << ino);
+	BEESTOOLONG("open_by_handle(root " << root << ", ino " << ino << ")");
+	const auto generation = btrfs_get_inode_generation(m_ctx->root_fd(), root, ino);
+	if (!generation) {
+		BEESCOUNT(open_handle_enoent);
+		rv = Fd();
+		gone = true;
+		return true;
+	}
+
+	{
+		LatencyTimer lt(latency_open);
+		rv = btrfs_open_by_handle(m_ctx->root_fd(), root, ino, generation, flags);
+	}
+	if (rv) {
+		BEESCOUNT(open_handle_ok);
+		return true;
+	}
+
+	switch (errno) {
+		case ESTALE:
+		case ENOENT:
+			// Deleted or replaced since we looked up the generation
+			BEESCOUNT(open_handle_stale);
+			gone = true;
+			return true;
+		case EPERM:
+		case EOPNOTSUPP:
+		case ENOSYS:
+		case EINVAL:
+			BEESLOGNOTICE("Opening files by handle not supported (" << strerror(errno) << "), using paths instead");
+			BEESCOUNT(open_handle_unsupported);
+			m_open_by_handle = false;
+			return false;
+		default:
+			BEESLOGINFO("Open by handle root " << root << " ino " << ino << " failed: " << strerror(errno));
+			BEESCOUNT(open_handle_error);
+			return true;
+	}
+}
+
 Fd
 BeesRoots::open_root_nocache(uint64_t rootid)
 {
@@ -630,6 +1015,18 @@ BeesRoots::open_root_nocache(uint64_t rootid)
 		return m_ctx->root_fd();
 	}
 
+	// The top directory of a subvol is always BTRFS_FIRST_FREE_OBJECTID
+	Fd handle_fd;
+	bool gone;
+	if (open_by_handle(rootid, BTRFS_FIRST_FREE_OBJECTID, FLAGS_OPEN_DIR, handle_fd, gone)) {
+		if (handle_fd) {
+			BEESCOUNT(root_ok);
+		} else {
+			BEESCOUNT(root_notfound);
+		}
+		return handle_fd;
+	}
+
 	// Find backrefs for this rootid and follow up to root
 	BtrfsIoctlSearchKey sk;
 	sk.tree_id = BTRFS_ROOT_TREE_OBJECTID;
@@ -756,6 +1153,42 @@ BeesRoots::is_root_ro(uint64_t root)
 	return m_root_ro_cache(root);
 }
 
+uint64_t
+BeesRoots::root_generation_nocache(uint64_t root)
+{
+	BEESTRACE("root_generation " << root);
+	BtrfsIoctlSearchKey sk;
+	sk.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk.min_objectid = sk.max_objectid = root;
+	sk.min_type = sk.max_type = BTRFS_ROOT_ITEM_KEY;
+
+	uint64_t rv = 0;
+	while (true) {
+		sk.nr_items = 1024;
+		sk.do_ioctl(m_ctx->root_fd());
+
+		if (sk.m_result.empty()) {
+			break;
+		}
+
+		for (auto i : sk.m_result) {
+			sk.next_min(i);
+			if (i.objectid == root && i.type == BTRFS_ROOT_ITEM_KEY) {
+				rv = max(rv, uint64_t(call_btrfs_get(btrfs_root_generation, i.m_data)));
+			}
+		}
+	}
+	return rv;
+}
+
+/// Generation of the subvol root, i.e. the last transid that modified it.
+/// Read at most once for each transid_max.
+uint64_t
+BeesRoots::root_generation(uint64_t root)
+{
+	return m_root_gen_cache(root, transid_max());
+}
+
 uint64_t
 BeesRoots::next_root(uint64_t root)
 {
@@ -791,10 +1224,60 @@ BeesRoots::next_root(uint64_t root)
 	}
 }
 
+/// The kernel rejects dedup requests with src and dst that have
+/// different datasum flags (datasum is a flag in the inode).
+///
+/// We can detect the common case where a file is marked with nodatacow
+/// (which implies nodatasum).  nodatacow files are arguably out of
+/// scope for dedup, since dedup would just make them datacow again.
+/// To handle these we pretend we couldn't open them.
+///
+/// A less common case is nodatasum + datacow files.  Those are availble
+/// for dedup but we have to solve some other problems before we can
+/// dedup them.  They require a separate hash table namespace from
+/// datasum + datacow files, and we have to create nodatasum temporary
+/// files when we rewrite extents.
+///
+/// FIXME:  the datasum flag is scooped up by TREE_SEARCH_V2 during
+/// crawls.  We throw the inode items away when we should be examining
+/// them for the nodatasum flag.
+static
+bool
+bees_open_flags_ok(const Fd &fd)
+{
+	int attr = ioctl_iflags_get(fd);
+	if (attr & FS_NOCOW_FL) {
+		BEESLOGWARN("Opening " << name_fd(fd) << " found FS_NOCOW_FL flag in " << to_hex(attr));
+		BEESCOUNT(open_wrong_flags);
+		return false;
+	}
+	return true;
+}
+
+/// gone is set when the file can't be opened until the subvol is modified:
+/// the inode does not exist, or its flags make it unsuitable for dedupe.
+/// It is not set for failures that may be transient, like running out of FDs.
 Fd
-BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
+BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino, bool &gone)
 {
 	BEESTRACE("opening root " << root << " ino " << ino);
+	gone = false;
+
+	// Just open file RO.  root can do the dedup ioctl without
+	// opening in write mode, and if we do open in write mode,
+	// we can't exec the file while we have it open.
+	Fd handle_fd;
+	if (open_by_handle(root, ino, FLAGS_OPEN_FILE, handle_fd, gone)) {
+		if (!handle_fd) {
+			return handle_fd;
+		}
+		if (!bees_open_flags_ok(handle_fd)) {
+			gone = true;
+			return Fd();
+		}
+		BEESCOUNT(open_hit);
+		return handle_fd;
+	}
 
 	Fd root_fd = open_root(root);
 	if (!root_fd) {
@@ -809,6 +1292,7 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 	if (!ipa.do_ioctl_nothrow(root_fd)) {
 		if (errno == ENOENT) {
 			BEESCOUNT(open_lookup_enoent);
+			gone = true;
 		} else {
 			BEESLOGINFO("Lookup root " << root << " ino " << ino << " failed: " << strerror(errno));
 			BEESCOUNT(open_lookup_error);
@@ -818,6 +1302,8 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 
 	BEESTRACE("searching paths for root " << root << " ino " << ino);
 	Fd rv;
+	// Only ENOENT for every path means the inode is gone
+	bool all_enoent = true;
 	if (ipa.m_paths.empty()) {
 		BEESLOGWARN("No paths for root " << root << " ino " << ino);
 		BEESCOUNT(open_lookup_empty);
@@ -827,11 +1313,11 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 	for (auto file_path : ipa.m_paths) {
 		BEESTRACE("Looking up root " << root << " ino " << ino << " in dir " << name_fd(root_fd) << " path " << file_path);
 		BEESCOUNT(open_file);
-		// Just open file RO.  root can do the dedup ioctl without
-		// opening in write mode, and if we do open in write mode,
-		// we can't exec the file while we have it open.
 		const char *fp_cstr = file_path.c_str();
-		rv = openat(root_fd, fp_cstr, FLAGS_OPEN_FILE);
+		{
+			LatencyTimer lt(latency_open);
+			rv = openat(root_fd, fp_cstr, FLAGS_OPEN_FILE);
+		}
 		if (!rv) {
 			// errno == ENOENT is the most common error case.
 			// No need to report it.
@@ -840,6 +1326,7 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 			} else {
 				BEESLOGWARN("Could not open path '" << file_path << "' at root " << root << " " << name_fd(root_fd) << ": " << strerror(errno));
 				BEESCOUNT(open_fail_error);
+				all_enoent = false;
 			}
 			continue;
 		}
@@ -871,33 +1358,9 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 			break;
 		}
 
-		// The kernel rejects dedup requests with
-		// src and dst that have different datasum flags
-		// (datasum is a flag in the inode).
-		//
-		// We can detect the common case where a file is
-		// marked with nodatacow (which implies nodatasum).
-		// nodatacow files are arguably out of scope for dedup,
-		// since dedup would just make them datacow again.
-		// To handle these we pretend we couldn't open them.
-		//
-		// A less common case is nodatasum + datacow files.
-		// Those are availble for dedup but we have to solve
-		// some other problems before we can dedup them.  They
-		// require a separate hash table namespace from datasum
-		// + datacow files, and we have to create nodatasum
-		// temporary files when we rewrite extents.
-		//
-		// FIXME:  the datasum flag is scooped up by
-		// TREE_SEARCH_V2 during crawls.  We throw the inode
-		// items away when we should be examining them for the
-		// nodatasum flag.
-
-		int attr = ioctl_iflags_get(rv);
-		if (attr & FS_NOCOW_FL) {
-			BEESLOGWARN("Opening " << name_fd(rv) << " found FS_NOCOW_FL flag in " << to_hex(attr));
+		if (!bees_open_flags_ok(rv)) {
 			rv = Fd();
-			BEESCOUNT(open_wrong_flags);
+			gone = true;
 			break;
 		}
 
@@ -907,6 +1370,9 @@ BeesRoots::open_root_ino_nocache(uint64_t root, uint64_t ino)
 
 	// All of the paths we tried were wrong.
 	BEESCOUNT(open_no_path);
+	if (all_enoent) {
+		gone = true;
+	}
 	return Fd();
 }
 
@@ -951,6 +1417,7 @@ BeesCrawl::next_transid()
 		crawl_state.m_offset = 0;
 		crawl_state.m_started = current_time;
 		BEESCOUNT(crawl_restart);
+		roots->root_cost_new_cycle(crawl_state.m_root);
 		set_state(crawl_state);
 		m_deferred = false;
 		BEESLOGINFO("Crawl started " << crawl_state);
@@ -0,0 +1,844 @@
+#include "bees.h"
+
+#include "crucible/process.h"
+#include "crucible/task.h"
+
+#include <cmath>
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+using namespace crucible;
+using namespace std;
+
+int bees_log_level = 8;
+
+// tracing ----------------------------------------
+
+thread_local BeesTracer *BeesTracer::tl_next_tracer = nullptr;
+thread_local bool BeesTracer::tl_silent = false;
+
+BeesTracer::~BeesTracer()
+{
+	if (!tl_silent && uncaught_exception()) {
+		try {
+			m_render(m_arg);
+		} catch (exception &e) {
+			BEESLOGNOTICE("Nested exception: " << e.what());
+		} catch (...) {
+			BEESLOGNOTICE("Nested exception ...");
+		}
+		if (!m_next_tracer) {
+			BEESLOGNOTICE("---  END  TRACE --- exception ---");
+		}
+	}
+	tl_next_tracer = m_next_tracer;
+	if (!m_next_tracer) {
+		tl_silent = false;
+	}
+}
+
+void
+BeesTracer::push(bool silent)
+{
+	m_next_tracer = tl_next_tracer;
+	tl_next_tracer = this;
+	tl_silent = silent;
+}
+
+void
+BeesTracer::trace_now()
+{
+	BeesTracer *tp = tl_next_tracer;
+	BEESLOGNOTICE("--- BEGIN TRACE ---");
+	while (tp) {
+		tp->m_render(tp->m_arg);
+		tp = tp->m_next_tracer;
+	}
+	BEESLOGNOTICE("---  END  TRACE ---");
+}
+
+bool
+BeesTracer::get_silent()
+{
+	return tl_silent;
+}
+
+void
+BeesTracer::set_silent()
+{
+	tl_silent = true;
+}
+
+// Status slots are never freed, only reused by later threads, so
+// get_status() can walk the list without taking any lock.
+struct BeesNote::ThreadSlot {
+	atomic<BeesNote*>	m_top;
+	atomic<const string*>	m_name;
+	atomic<pid_t>		m_tid;
+	pthread_t		m_pthread;
+	atomic<bool>		m_in_use;
+	atomic<unsigned>	m_readers;
+	ThreadSlot		*m_next = nullptr;
+
+	ThreadSlot() : m_top(nullptr), m_name(nullptr), m_tid(0), m_in_use(true), m_readers(0) {}
+	void publish_pop(BeesNote *prev);
+	void publish_name(const string *name);
+	void wait_for_readers();
+};
+
+void
+BeesNote::ThreadSlot::wait_for_readers()
+{
+	while (m_readers.load()) {
+		this_thread::yield();
+	}
+}
+
+void
+BeesNote::ThreadSlot::publish_pop(BeesNote *prev)
+{
+	// Once the note is unlinked, a reader that arrives later cannot find it,
+	// but a reader that arrived earlier may still be rendering it.
+	m_top.store(prev);
+	wait_for_readers();
+}
+
+void
+BeesNote::ThreadSlot::publish_name(const string *name)
+{
+	auto old_name = m_name.exchange(name);
+	if (old_name) {
+		wait_for_readers();
+		delete old_name;
+	}
+}
+
+static
+string
+bees_pthread_name(pthread_t thread)
+{
+	char buf[24];
+	memset(buf, '\0', sizeof(buf));
+	int err = pthread_getname_np(thread, buf, sizeof(buf));
+	if (err) {
+		return string("pthread_getname_np: ") + strerror(err);
+	}
+	buf[sizeof(buf) - 1] = '\0';
+
+	// thread_getname_np returns process name
+	// ...by default?  ...for the main thread?
+	// ...except during exception handling?
+	// ...randomly?
+	return buf;
+}
+
+// Releases the thread's status slot for reuse when the thread exits
+struct BeesNoteThread {
+	bool m_exited = false;
+	~BeesNoteThread();
+};
+
+static thread_local BeesNoteThread bees_note_thread;
+
+thread_local BeesNote *BeesNote::tl_next = nullptr;
+thread_local BeesNote::ThreadSlot *BeesNote::tl_slot = nullptr;
+atomic<BeesNote::ThreadSlot*> BeesNote::s_slots(nullptr);
+thread_local string BeesNote::tl_name;
+
+BeesNoteThread::~BeesNoteThread()
+{
+	m_exited = true;
+	BeesNote::release_slot();
+}
+
+void
+BeesNote::release_slot()
+{
+	auto slot = tl_slot;
+	if (!slot) {
+		return;
+	}
+	tl_slot = nullptr;
+	slot->publish_pop(nullptr);
+	slot->publish_name(nullptr);
+	slot->m_in_use.store(false);
+}
+
+BeesNote::ThreadSlot *
+BeesNote::get_slot()
+{
+	if (tl_slot) {
+		return tl_slot;
+	}
+	// Don't resurrect the thread_local after it has been destroyed
+	if (bees_note_thread.m_exited) {
+		return nullptr;
+	}
+	// Reuse a slot left behind by an exited thread
+	ThreadSlot *slot = s_slots.load();
+	while (slot) {
+		bool expected = false;
+		if (slot->m_in_use.compare_exchange_strong(expected, true)) {
+			break;
+		}
+		slot = slot->m_next;
+	}
+	// None free, add a new one to the list
+	if (!slot) {
+		slot = new ThreadSlot;
+		slot->m_next = s_slots.load();
+		while (!s_slots.compare_exchange_weak(slot->m_next, slot)) {
+		}
+	}
+	slot->m_tid.store(gettid());
+	slot->m_pthread = pthread_self();
+	if (!tl_name.empty()) {
+		slot->publish_name(new string(tl_name));
+	}
+	tl_slot = slot;
+	return slot;
+}
+
+BeesNote::~BeesNote()
+{
+	tl_next = m_prev;
+	auto slot = tl_slot;
+	if (slot) {
+		slot->publish_pop(m_prev);
+	}
+}
+
+void
+BeesNote::push()
+{
+	// Thread names are published in the slot, Task names are rendered on demand
+	if (tl_name.empty()) {
+		m_task = Task::current_task();
+	}
+	m_prev = tl_next;
+	tl_next = this;
+	auto slot = get_slot();
+	if (slot) {
+		slot->m_top.store(this, memory_order_release);
+	}
+}
+
+void
+BeesNote::set_name(const string &name)
+{
+	tl_name = name;
+	// get_slot() publishes tl_name when it creates the slot
+	if (tl_slot) {
+		tl_slot->publish_name(new string(name));
+	} else {
+		get_slot();
+	}
+	catch_all([&]() {
+		DIE_IF_MINUS_ERRNO(pthread_setname_np(pthread_self(), name.c_str()));
+	});
+}
+
+string
+BeesNote::get_name()
+{
+	// Use explicit name if given
+	if (!tl_name.empty()) {
+		return tl_name;
+	}
+
+	// Try a Task name.  If there is one, return it, but do not
+	// remember it.  Each output message may be a different Task.
+	// The current task is thread_local so we don't need to worry
+	// about it being destroyed under us.
+	auto current_task = Task::current_task();
+	if (current_task) {
+		return current_task.title();
+	}
+
+	// OK try the pthread name next.
+	return bees_pthread_name(pthread_self());
+}
+
+BeesNote::ThreadStatusMap
+BeesNote::get_status()
+{
+	ThreadStatusMap rv;
+	for (auto slot = s_slots.load(); slot; slot = slot->m_next) {
+		// Hold off the owning thread from destroying the note while we render it
+		slot->m_readers.fetch_add(1);
+		BeesNote *note = slot->m_top.load();
+		if (note) {
+			ostringstream oss;
+			auto name = slot->m_name.load();
+			if (name) {
+				oss << *name << ": ";
+			} else if (note->m_task) {
+				oss << note->m_task.title() << ": ";
+			} else {
+				oss << bees_pthread_name(slot->m_pthread) << ": ";
+			}
+			if (note->m_timer.age() > BEES_TOO_LONG) {
+				oss << "[" << note->m_timer << "s] ";
+			}
+			catch_all([&]() {
+				note->m_render(note->m_arg, oss);
+			});
+			rv[slot->m_tid.load()] = oss.str();
+		}
+		slot->m_readers.fetch_sub(1);
+	}
+	return rv;
+}
+
+// ostream operators ----------------------------------------
+
+template <class T>
+ostream &
+operator<<(ostream &os, const BeesStatTmpl<T> &bs)
+{
+	unique_lock<mutex> lock(bs.m_mutex);
+	bool first = true;
+	string last_tag;
+	for (auto i : bs.m_stats_map) {
+		if (i.second == 0) {
+			continue;
+		}
+		string tag = i.first.substr(0, i.first.find_first_of("_"));
+		if (!last_tag.empty() && tag != last_tag) {
+			os << "\n\t";
+		} else if (!first) {
+			os << " ";
+		}
+		last_tag = tag;
+		first = false;
+		os << i.first << "=" << i.second;
+	}
+	return os;
+}
+
+// other ----------------------------------------
+
+template <class T>
+T&
+BeesStatTmpl<T>::at(string idx)
+{
+	if (!m_stats_map.count(idx)) {
+		m_stats_map[idx] = 0;
+	}
+	return m_stats_map[idx];
+}
+
+template <class T>
+T
+BeesStatTmpl<T>::at(string idx) const
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto rv = m_stats_map.at(idx);
+	return rv;
+}
+
+template <class T>
+map<string, T>
+BeesStatTmpl<T>::get_map() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_stats_map;
+}
+
+template <class T>
+void
+BeesStatTmpl<T>::add_count(string idx, size_t amount)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (!m_stats_map.count(idx)) {
+		m_stats_map[idx] = amount;
+	} else {
+		m_stats_map[idx] += amount;
+	}
+}
+
+template <class T>
+BeesStatTmpl<T>::BeesStatTmpl(const BeesStatTmpl &that)
+{
+	if (&that == this) return;
+	unique_lock<mutex> lock(m_mutex);
+	unique_lock<mutex> lock2(that.m_mutex);
+	m_stats_map = that.m_stats_map;
+}
+
+template <class T>
+BeesStatTmpl<T> &
+BeesStatTmpl<T>::operator=(const BeesStatTmpl<T> &that)
+{
+	if (&that == this) return *this;
+	unique_lock<mutex> lock(m_mutex);
+	unique_lock<mutex> lock2(that.m_mutex);
+	m_stats_map = that.m_stats_map;
+	return *this;
+}
+
+// event counters ----------------------------------------
+
+thread_local BeesCounters::Slots *BeesCounters::tl_slots = nullptr;
+
+static mutex bees_counters_mutex;
+static vector<string> bees_counters_names;
+static map<string, BeesCounters::Id> bees_counters_ids;
+static set<shared_ptr<BeesCounters::Slots>> bees_counters_live;
+static vector<uint64_t> bees_counters_retired;
+
+// Folds a thread's counts into the retired totals when the thread exits
+struct BeesCountersThread {
+	shared_ptr<BeesCounters::Slots>	m_slots;
+	~BeesCountersThread();
+};
+
+static thread_local BeesCountersThread bees_counters_thread;
+static thread_local bool bees_counters_exited = false;
+
+BeesCountersThread::~BeesCountersThread()
+{
+	bees_counters_exited = true;
+	BeesCounters::retire(m_slots);
+}
+
+void
+BeesCounters::retire(const shared_ptr<Slots> &slots)
+{
+	tl_slots = nullptr;
+	if (!slots) {
+		return;
+	}
+	unique_lock<mutex> lock(bees_counters_mutex);
+	for (size_t i = 0; i < bees_counters_retired.size() && i < BEES_MAX_COUNTERS; ++i) {
+		bees_counters_retired[i] += slots->m_counts[i].load(memory_order_relaxed);
+	}
+	bees_counters_live.erase(slots);
+}
+
+BeesCounters::Id
+BeesCounters::register_name(const char *name)
+{
+	unique_lock<mutex> lock(bees_counters_mutex);
+	auto found = bees_counters_ids.find(name);
+	if (found != bees_counters_ids.end()) {
+		return found->second;
+	}
+	Id rv = bees_counters_names.size();
+	bees_counters_names.push_back(name);
+	bees_counters_retired.push_back(0);
+	bees_counters_ids[name] = rv;
+	return rv;
+}
+
+BeesCounters::Slots *
+BeesCounters::register_thread()
+{
+	// Don't resurrect the thread_local after it has been destroyed
+	if (bees_counters_exited) {
+		return nullptr;
+	}
+	auto slots = make_shared<Slots>();
+	unique_lock<mutex> lock(bees_counters_mutex);
+	bees_counters_live.insert(slots);
+	lock.unlock();
+	bees_counters_thread.m_slots = slots;
+	tl_slots = slots.get();
+	return tl_slots;
+}
+
+void
+BeesCounters::add_slow(Id id, uint64_t amount)
+{
+	if (id < BEES_MAX_COUNTERS && register_thread()) {
+		add(id, amount);
+		return;
+	}
+	// Counters beyond BEES_MAX_COUNTERS, or threads that are exiting
+	unique_lock<mutex> lock(bees_counters_mutex);
+	THROW_CHECK2(out_of_range, id, bees_counters_retired.size(), id < bees_counters_retired.size());
+	bees_counters_retired[id] += amount;
+}
+
+BeesStats
+BeesCounters::snapshot()
+{
+	unique_lock<mutex> lock(bees_counters_mutex);
+	auto totals = bees_counters_retired;
+	for (auto slots : bees_counters_live) {
+		for (size_t i = 0; i < totals.size() && i < BEES_MAX_COUNTERS; ++i) {
+			totals[i] += slots->m_counts[i].load(memory_order_relaxed);
+		}
+	}
+	auto names = bees_counters_names;
+	lock.unlock();
+
+	BeesStats rv;
+	for (size_t i = 0; i < totals.size(); ++i) {
+		rv.add_count(names[i], totals[i]);
+	}
+	return rv;
+}
+
+BeesStats
+BeesStats::snapshot()
+{
+	return BeesCounters::snapshot();
+}
+
+BeesStats
+BeesStats::operator-(const BeesStats &that) const
+{
+	if (&that == this) return BeesStats();
+
+	unique_lock<mutex> this_lock(m_mutex);
+	BeesStats this_copy;
+	this_copy.m_stats_map = m_stats_map;
+	this_lock.unlock();
+
+	unique_lock<mutex> that_lock(that.m_mutex);
+	BeesStats that_copy;
+	that_copy.m_stats_map = that.m_stats_map;
+	that_lock.unlock();
+
+	for (auto i : that.m_stats_map) {
+		if (i.second != 0) {
+			this_copy.at(i.first) -= i.second;
+		}
+	}
+	return this_copy;
+}
+
+BeesRates
+BeesStats::operator/(double d) const
+{
+	BeesRates rv;
+	unique_lock<mutex> lock(m_mutex);
+	for (auto i : m_stats_map) {
+		rv.m_stats_map[i.first] = ceil(i.second / d * 1000) / 1000;
+	}
+	return rv;
+}
+
+BeesStats::operator bool() const
+{
+	unique_lock<mutex> lock(m_mutex);
+	for (auto i : m_stats_map) {
+		if (i.second != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+const vector<BeesLatencyInterface> &
+bees_latency_interfaces()
+{
+	static const vector<BeesLatencyInterface> interfaces {
+		{ "LOGICAL_INO", latency_logical_ino },
+		{ "FILE_EXTENT_SAME", latency_extent_same },
+		{ "TREE_SEARCH_V2", latency_tree_search },
+		{ "INO_PATHS", latency_ino_paths },
+		{ "open", latency_open },
+		{ "pread", latency_pread },
+		{ "pwrite", latency_pwrite },
+	};
+	return interfaces;
+}
+
+ostream &
+bees_latency_report(ostream &os)
+{
+	for (const auto &i : bees_latency_interfaces()) {
+		os << "\t" << i.name << ": " << i.histogram << "\n";
+	}
+	return os;
+}
+
+void
+BeesTooLong::check() const
+{
+	if (age() > m_limit) {
+		ostringstream oss;
+		m_render(m_arg, oss);
+		BEESLOGWARN("PERFORMANCE: " << *this << " sec: " << oss.str());
+	}
+}
+
+BeesTooLong::~BeesTooLong()
+{
+	check();
+}
+
+// binary event trace ----------------------------------------
+
+static_assert(sizeof(BeesEventRecord) == 8 * sizeof(uint64_t), "BeesEventRecord must be 8 words");
+
+// Ring buffer slot.  m_state is 2 * seq + 1 while the record is being
+// written and 2 * seq + 2 when it is complete.  m_words holds the
+// record after m_seq.
+struct BeesEventSlot {
+	atomic<uint64_t>	m_state;
+	atomic<uint64_t>	m_words[sizeof(BeesEventRecord) / sizeof(uint64_t) - 1];
+};
+
+static const char bees_event_file[] = "beesevents.dat";
+static const char bees_event_file_old[] = "beesevents.dat.old";
+
+static atomic<BeesEventSlot *> bees_event_slots(nullptr);
+static atomic<uint64_t> bees_event_head(0);
+static BeesEventSlot *bees_event_ring = nullptr;
+static mutex bees_event_mutex;
+static condition_variable bees_event_condvar;
+static bool bees_event_stop = false;
+static shared_ptr<thread> bees_event_thread;
+static Fd bees_event_dir_fd;
+static Fd bees_event_fd;
+
+static
+uint64_t
+bees_event_clock(clockid_t clock_id)
+{
+	struct timespec ts;
+	DIE_IF_MINUS_ONE(clock_gettime(clock_id, &ts));
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+BeesEvent::BeesEvent(Type type, uint64_t root, uint64_t ino, uint64_t offset, uint64_t bytes) :
+	m_type(type),
+	m_root(root),
+	m_ino(ino),
+	m_offset(offset),
+	m_bytes(bytes)
+{
+	if (bees_event_slots.load(memory_order_relaxed)) {
+		m_start_ns = bees_event_clock(CLOCK_MONOTONIC);
+	}
+}
+
+BeesEvent::~BeesEvent()
+{
+	auto slots = bees_event_slots.load(memory_order_acquire);
+	if (!slots || !m_start_ns) {
+		return;
+	}
+
+	BeesEventRecord rec;
+	rec.m_duration_ns = bees_event_clock(CLOCK_MONOTONIC) - m_start_ns;
+	rec.m_time_ns = bees_event_clock(CLOCK_REALTIME) - rec.m_duration_ns;
+	rec.m_root = m_root;
+	rec.m_ino = m_ino;
+	rec.m_offset = m_offset;
+	rec.m_bytes = m_bytes;
+	rec.m_tid = gettid();
+	rec.m_outcome = m_outcome;
+	rec.m_type = m_type;
+	rec.m_reserved = 0;
+
+	uint64_t words[sizeof(rec) / sizeof(uint64_t)];
+	memcpy(words, &rec, sizeof(rec));
+
+	const auto seq = bees_event_head.fetch_add(1, memory_order_relaxed);
+	auto &slot = slots[seq % BEES_EVENT_TRACE_RECORDS];
+	slot.m_state.store(seq * 2 + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (size_t i = 0; i < sizeof(slot.m_words) / sizeof(slot.m_words[0]); ++i) {
+		slot.m_words[i].store(words[i + 1], memory_order_relaxed);
+	}
+	slot.m_state.store(seq * 2 + 2, memory_order_release);
+}
+
+static
+void
+bees_event_write(const vector<BeesEventRecord> &recs)
+{
+	if (!bees_event_fd) {
+		bees_event_fd = openat_or_die(bees_event_dir_fd, bees_event_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOATIME, 0600);
+		struct stat st;
+		DIE_IF_MINUS_ONE(fstat(bees_event_fd, &st));
+		if (st.st_size == 0) {
+			BeesEventRecord header;
+			memset(&header, 0, sizeof(header));
+			header.m_time_ns = bees_event_clock(CLOCK_REALTIME);
+			header.m_root = BeesEventRecord::c_magic;
+			header.m_bytes = sizeof(header);
+			header.m_type = BeesEvent::HEADER;
+			write_or_die(bees_event_fd, header);
+		}
+	}
+
+	if (!recs.empty()) {
+		write_or_die(bees_event_fd, recs.data(), recs.size() * sizeof(recs[0]));
+	}
+
+	struct stat st;
+	DIE_IF_MINUS_ONE(fstat(bees_event_fd, &st));
+	if (st.st_size >= BEES_EVENT_TRACE_FILE_SIZE) {
+		BEESLOGINFO("Rotating event trace " << bees_event_file << " at " << st.st_size << " bytes");
+		DIE_IF_MINUS_ONE(renameat(bees_event_dir_fd, bees_event_file, bees_event_dir_fd, bees_event_file_old));
+		bees_event_fd = Fd();
+	}
+}
+
+// Copies completed records from the ring to the trace file.
+// Records overwritten before we got to them are counted as dropped.
+static
+void
+bees_event_flush(uint64_t &tail)
+{
+	BEESNOTE("flushing event trace");
+	const auto head = bees_event_head.load(memory_order_acquire);
+	uint64_t dropped = 0;
+	if (head - tail > BEES_EVENT_TRACE_RECORDS) {
+		dropped += head - BEES_EVENT_TRACE_RECORDS - tail;
+		tail = head - BEES_EVENT_TRACE_RECORDS;
+	}
+
+	vector<BeesEventRecord> recs;
+	recs.reserve(head - tail);
+	for (; tail < head; ++tail) {
+		auto &slot = bees_event_ring[tail % BEES_EVENT_TRACE_RECORDS];
+		const auto state = slot.m_state.load(memory_order_acquire);
+		if (state < tail * 2 + 2) {
+			// Still being written, try again next time
+			break;
+		}
+		if (state > tail * 2 + 2) {
+			++dropped;
+			continue;
+		}
+		uint64_t words[sizeof(BeesEventRecord) / sizeof(uint64_t)];
+		words[0] = tail;
+		for (size_t i = 0; i < sizeof(slot.m_words) / sizeof(slot.m_words[0]); ++i) {
+			words[i + 1] = slot.m_words[i].load(memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (slot.m_state.load(memory_order_relaxed) != state) {
+			++dropped;
+			continue;
+		}
+		BeesEventRecord rec;
+		memcpy(&rec, words, sizeof(rec));
+		recs.push_back(rec);
+	}
+
+	BEESCOUNTADD(event_trace_record, recs.size());
+	BEESCOUNTADD(event_trace_drop, dropped);
+	bees_event_write(recs);
+}
+
+static
+void
+bees_event_loop()
+{
+	BeesNote::set_name("event_trace");
+	uint64_t tail = bees_event_head.load(memory_order_acquire);
+	while (true) {
+		unique_lock<mutex> lock(bees_event_mutex);
+		if (!bees_event_stop) {
+			BEESNOTE("idle " << BEES_EVENT_TRACE_INTERVAL);
+			bees_event_condvar.wait_for(lock, chrono::duration<double>(BEES_EVENT_TRACE_INTERVAL));
+		}
+		const bool stopping = bees_event_stop;
+		lock.unlock();
+
+		catch_all([&]() {
+			bees_event_flush(tail);
+		});
+
+		if (stopping) {
+			break;
+		}
+	}
+	bees_event_fd = Fd();
+}
+
+void
+BeesEvent::start(Fd dir_fd)
+{
+	unique_lock<mutex> lock(bees_event_mutex);
+	if (bees_event_thread) {
+		return;
+	}
+	BEESLOGINFO("Writing binary event trace to " << bees_event_file << " in " << name_fd(dir_fd));
+	// Never freed, so a BeesEvent that loaded the pointer before stop() can still write to it
+	if (!bees_event_ring) {
+		bees_event_ring = new BeesEventSlot[BEES_EVENT_TRACE_RECORDS]();
+	}
+	bees_event_dir_fd = dir_fd;
+	bees_event_stop = false;
+	bees_event_thread = make_shared<thread>(bees_event_loop);
+	bees_event_slots.store(bees_event_ring, memory_order_release);
+}
+
+void
+BeesEvent::stop()
+{
+	unique_lock<mutex> lock(bees_event_mutex);
+	if (!bees_event_thread) {
+		return;
+	}
+	bees_event_slots.store(nullptr, memory_order_release);
+	bees_event_stop = true;
+	bees_event_condvar.notify_all();
+	auto event_thread = bees_event_thread;
+	bees_event_thread.reset();
+	lock.unlock();
+	event_thread->join();
+}
+
+bool
+BeesEvent::enabled()
+{
+	return bees_event_slots.load(memory_order_relaxed);
+}
+
+const char *
+BeesEvent::type_name(uint8_t type)
+{
+	static const char *const names[] = {
+		"header",
+		"scan",
+		"resolve",
+		"dedup",
+		"copy",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == TYPE_MAX, "BeesEvent::Type names");
+	return type < TYPE_MAX ? names[type] : "unknown";
+}
+
+const char *
+BeesEvent::outcome_name(uint16_t outcome)
+{
+	static const char *const names[] = {
+		"exception",
+		"ok",
+		"fail",
+		"hole",
+		"prealloc",
+		"toxic",
+		"no_match",
+		"deduped",
+		"readonly",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == OUTCOME_MAX, "BeesEvent::Outcome names");
+	return outcome < OUTCOME_MAX ? names[outcome] : "unknown";
+}
+
+// instantiate templates for linkage ----------------------------------------
+
+template class BeesStatTmpl<uint64_t>;
+template ostream & operator<<(ostream &os, const BeesStatTmpl<uint64_t> &bs);
+
+template class BeesStatTmpl<double>;
+template ostream & operator<<(ostream &os, const BeesStatTmpl<double> &bs);
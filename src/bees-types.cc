@@ -1,5 +1,6 @@
 #include "bees.h"
 
+#include "crucible/backend.h"
 #include "crucible/crc64.h"
 #include "crucible/limits.h"
 #include "crucible/ntoa.h"
@@ -325,7 +326,17 @@ BeesFileRange::fid() const
 	return m_fid;
 }
 
-BeesRangePair::BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst) :
+BeesEvent::BeesEvent(Type type, const BeesFileRange &bfr, uint64_t offset, uint64_t bytes) :
+	BeesEvent(type, 0, 0, offset, bytes)
+{
+	if (m_start_ns) {
+		const auto fid = bfr.fid();
+		m_root = fid.root();
+		m_ino = fid.ino();
+	}
+}
+
+BeesRangePair::BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst, bool verify) :
 	pair<BeesFileRange, BeesFileRange>(src, dst)
 {
 	BEESTRACE("checking constraints on " << *this);
@@ -336,8 +347,8 @@ BeesRangePair::BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst)
 	// Must initially be equal
 	THROW_CHECK2(invalid_argument, first, second, first.size() == second.size());
 
-	// Can't check content unless open
-	if (!first.fd() || !second.fd()) {
+	// Can't check content unless open, and don't if the kernel will do it
+	if (!verify || !first.fd() || !second.fd()) {
 		return;
 	}
 
@@ -363,6 +374,18 @@ BeesRangePair::operator<(const BeesRangePair &that) const
 	return tie(second, first) < tie(that.second, that.first);
 }
 
+static
+bool
+is_zero_block(const uint8_t *p, size_t len)
+{
+	for (const uint8_t *end = p + len; p < end; ++p) {
+		if (*p) {
+			return false;
+		}
+	}
+	return true;
+}
+
 bool
 BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 {
@@ -377,10 +400,14 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 	// We should not be overlapping already
 	THROW_CHECK2(invalid_argument, first, second, !first.overlaps(second));
 
-	BtrfsExtentWalker ew_second(second.fd());
+	// Ranges in the same file must not grow into each other
+	const bool same_file = first.is_same_file(second);
 
 	// Stop on aligned extent boundary
-	ew_second.seek(second.begin());
+	BtrfsExtentWalker ew_second(second.fd(), second.begin(), ctx->extent_map(second));
+
+	// For source addresses
+	BtrfsExtentWalker ew_first(first.fd(), first.begin(), ctx->extent_map(first));
 
 	Extent e_second = ew_second.current();
 	BEESTRACE("e_second " << e_second);
@@ -391,6 +418,17 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 
 	auto hash_table = ctx->hash_table();
 
+	// Let the kernel compare blocks that the hash table has already matched
+	const bool trust = ctx->trust_kernel_compare();
+
+	// Source extent containing the block being added, and the last
+	// source extent that was checked for a toxic address.
+	// Growing works on the part of both ranges that lies within a
+	// single extent on each side, so the extent addresses and flags
+	// are constant across each chunk of data.
+	Extent e_first;
+	Extent e_first_checked;
+
 	// Look backward
 	BEESTRACE("grow_backward " << *this);
 	while (first.size() < BLOCK_SIZE_MAX_EXTENT) {
@@ -416,86 +454,138 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 		}
 		BEESCOUNT(pairbackward_try);
 
-		// Extend first range.  If we hit BOF we can go no further.
-		BeesFileRange new_first = first;
-		BEESTRACE("new_first = " << new_first);
-		new_first.grow_begin(BLOCK_SIZE_CLONE);
-		if (new_first.begin() == first.begin()) {
+		// If we hit BOF we can go no further
+		if (first.begin() == 0) {
 			BEESCOUNT(pairbackward_bof_first);
 			break;
 		}
-
-		// Source extent cannot be toxic
-		BeesAddress first_addr(first.fd(), new_first.begin());
-		if (!first_addr.is_magic()) {
-			auto first_resolved = ctx->resolve_addr(first_addr);
-			if (first_resolved.is_toxic()) {
-				BEESLOGWARN("WORKAROUND: not growing matching pair backward because src addr is toxic:\n" << *this);
-				BEESCOUNT(pairbackward_toxic_addr);
-				break;
-			}
-		}
-
-		// Extend second range.  If we hit BOF we can go no further.
-		BeesFileRange new_second = second;
-		BEESTRACE("new_second = " << new_second);
-		new_second.grow_begin(BLOCK_SIZE_CLONE);
-		if (new_second.begin() == second.begin()) {
+		if (second.begin() == 0) {
 			BEESCOUNT(pairbackward_bof_second);
 			break;
 		}
 
-		// If the ranges now overlap we went too far
-		if (new_first.overlaps(new_second)) {
-			BEESCOUNT(pairbackward_overlap);
-			break;
+		const off_t first_pos = first.begin() - BLOCK_SIZE_CLONE;
+		const off_t second_pos = second.begin() - BLOCK_SIZE_CLONE;
+		if (first_pos < e_first.begin() || first_pos >= e_first.end()) {
+			ew_first.seek(first_pos);
+			e_first = ew_first.current();
 		}
+		BEESTRACE("e_first " << e_first);
 
-		BEESTRACE("first " << first << " new_first " << new_first);
-		BeesBlockData first_bbd(first.fd(), new_first.begin(), first.begin() - new_first.begin());
-		BEESTRACE("first_bbd " << first_bbd);
-		BEESTRACE("second " << second << " new_second " << new_second);
-		BeesBlockData second_bbd(second.fd(), new_second.begin(), second.begin() - new_second.begin());
-		BEESTRACE("second_bbd " << second_bbd);
-
-		// Both blocks must have identical content
-		if (!first_bbd.is_data_equal(second_bbd)) {
-			BEESCOUNT(pairbackward_miss);
-			break;
+		// Source extent cannot be toxic
+		BeesAddress first_addr(e_first, first_pos);
+		if (e_first != e_first_checked) {
+			if (!first_addr.is_magic()) {
+				auto first_resolved = ctx->resolve_addr(first_addr);
+				if (first_resolved.is_toxic()) {
+					BEESLOGWARN("WORKAROUND: not growing matching pair backward because src addr is toxic:\n" << *this);
+					BEESCOUNT(pairbackward_toxic_addr);
+					break;
+				}
+			}
+			e_first_checked = e_first;
 		}
 
-		// Physical blocks must be distinct
-		if (first_bbd.addr().get_physical_or_zero() == second_bbd.addr().get_physical_or_zero()) {
+		// Physical blocks must be distinct.  Both extents are the same
+		// for the entire chunk, so the distance between blocks is too.
+		BeesAddress second_addr(e_second, second_pos);
+		if (first_addr.get_physical_or_zero() == second_addr.get_physical_or_zero()) {
 			BEESCOUNT(pairbackward_same);
 			break;
 		}
 
-		// Source block cannot be zero in a non-compressed non-magic extent
-		if (first_bbd.is_data_zero() && !first_addr.is_magic() && !first_addr.is_compressed()) {
-			BEESCOUNT(pairbackward_zero);
+		off_t len = min(first.begin() - e_first.begin(), second.begin() - e_second.begin());
+		len = min(len, BLOCK_SIZE_GROW_CHUNK);
+		len = min(len, BLOCK_SIZE_MAX_EXTENT - first.size()) & ~BLOCK_MASK_CLONE;
+
+		// If the ranges would overlap we must stop before they do
+		if (same_file) {
+			if (second.end() <= first.begin()) {
+				len = min(len, first.begin() - second.end());
+			}
+			if (first.end() <= second.begin()) {
+				len = min(len, second.begin() - first.end());
+			}
+		}
+		if (len <= 0) {
+			BEESCOUNT(pairbackward_overlap);
 			break;
 		}
 
-		// Source block cannot have a toxic hash
-		auto found_hashes = hash_table->find_cell(first_bbd.hash());
-		bool found_toxic = false;
-		for (auto i : found_hashes) {
-			if (BeesAddress(i.e_addr).is_toxic()) {
-				found_toxic = true;
+		// The src chunk is only read if some block is not matched by the hash table
+		BEESTRACE("reading " << len << " bytes before " << *this);
+		vector<uint8_t> first_data, second_data(len);
+		btrfs_pread_or_die(second.fd(), second_data, second.begin() - len);
+		BEESCOUNTADD(pairbackward_read_bytes, len);
+
+		// Check blocks from the end of the chunk, nearest to the matching ranges
+		off_t matched = 0;
+		bool stop = false;
+		while (matched < len) {
+			const off_t block_offset = len - matched - BLOCK_SIZE_CLONE;
+			const off_t block_pos = first.begin() - len + block_offset;
+			const uint8_t *const second_block = second_data.data() + block_offset;
+			const BeesHash second_hash(Digest::CRC::crc64(second_block, BLOCK_SIZE_CLONE));
+
+			// Look for toxic hashes, and for the src block at the dst block's hash
+			const BeesAddress first_block_addr = trust ? BeesAddress(e_first, block_pos) : BeesAddress();
+			bool found_toxic = false;
+			bool found_first = false;
+			for (auto i : hash_table->find_cell(second_hash)) {
+				const BeesAddress found_addr(i.e_addr);
+				if (found_addr.is_toxic()) {
+					found_toxic = true;
+					break;
+				}
+				if (trust && found_addr == first_block_addr) {
+					found_first = true;
+				}
+			}
+
+			// Both blocks must have identical content
+			if (found_first) {
+				BEESCOUNT(pairbackward_trusted);
+			} else {
+				if (first_data.empty()) {
+					first_data.resize(len);
+					btrfs_pread_or_die(first.fd(), first_data, first.begin() - len);
+					BEESCOUNTADD(pairbackward_read_bytes, len);
+				}
+				if (memcmp(first_data.data() + block_offset, second_block, BLOCK_SIZE_CLONE)) {
+					BEESCOUNT(pairbackward_miss);
+					stop = true;
+					break;
+				}
+			}
+
+			// Source block cannot be zero in a non-compressed non-magic extent
+			if (!first_addr.is_magic() && !first_addr.is_compressed() && is_zero_block(second_block, BLOCK_SIZE_CLONE)) {
+				BEESCOUNT(pairbackward_zero);
+				stop = true;
 				break;
 			}
+
+			// Source block cannot have a toxic hash
+			if (found_toxic) {
+				BEESLOGWARN("WORKAROUND: found toxic hash " << second_hash << " in " << BeesFileRange(first.fd(), block_pos, block_pos + BLOCK_SIZE_CLONE) << " while extending backward:\n" << *this);
+				BEESCOUNT(pairbackward_toxic_hash);
+				stop = true;
+				break;
+			}
+
+			matched += BLOCK_SIZE_CLONE;
+			BEESCOUNT(pairbackward_hit);
+		}
+
+		if (matched) {
+			first.grow_begin(matched);
+			second.grow_begin(matched);
+			THROW_CHECK2(invalid_argument, first.size(), second.size(), first.size() == second.size());
+			rv = true;
 		}
-		if (found_toxic) {
-			BEESLOGWARN("WORKAROUND: found toxic hash in " << first_bbd << " while extending backward:\n" << *this);
-			BEESCOUNT(pairbackward_toxic_hash);
+		if (stop) {
 			break;
 		}
-
-		THROW_CHECK2(invalid_argument, new_first.size(), new_second.size(), new_first.size() == new_second.size());
-		first = new_first;
-		second = new_second;
-		rv = true;
-		BEESCOUNT(pairbackward_hit);
 	}
 	BEESCOUNT(pairbackward_stop);
 	BEESCOUNTADD(pairbackward_ms, grow_backward_timer.age() * 1000);
@@ -519,95 +609,149 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 		}
 		BEESCOUNT(pairforward_try);
 
-		// Extend first range.  If we hit EOF we can go no further.
-		BeesFileRange new_first = first;
-		BEESTRACE("new_first = " << new_first);
-		new_first.grow_end(BLOCK_SIZE_CLONE);
-		if (new_first.end() == first.end()) {
+		// If we hit EOF we can go no further
+		if (first.end() >= first.file_size()) {
 			BEESCOUNT(pairforward_eof_first);
 			break;
 		}
+		if (second.end() >= second.file_size()) {
+			BEESCOUNT(pairforward_eof_second);
+			break;
+		}
+
+		if (first.end() < e_first.begin() || first.end() >= e_first.end()) {
+			ew_first.seek(first.end());
+			e_first = ew_first.current();
+		}
+		BEESTRACE("e_first " << e_first);
 
 		// Source extent cannot be toxic
-		BeesAddress first_addr(first.fd(), new_first.begin());
-		if (!first_addr.is_magic()) {
-			auto first_resolved = ctx->resolve_addr(first_addr);
-			if (first_resolved.is_toxic()) {
-				BEESLOGWARN("WORKAROUND: not growing matching pair forward because src is toxic:\n" << *this);
-				BEESCOUNT(pairforward_toxic);
-				break;
+		BeesAddress first_addr(e_first, first.end());
+		if (e_first != e_first_checked) {
+			if (!first_addr.is_magic()) {
+				auto first_resolved = ctx->resolve_addr(first_addr);
+				if (first_resolved.is_toxic()) {
+					BEESLOGWARN("WORKAROUND: not growing matching pair forward because src is toxic:\n" << *this);
+					BEESCOUNT(pairforward_toxic_addr);
+					break;
+				}
 			}
+			e_first_checked = e_first;
 		}
 
-		// Extend second range.  If we hit EOF we can go no further.
-		BeesFileRange new_second = second;
-		BEESTRACE("new_second = " << new_second);
-		new_second.grow_end(BLOCK_SIZE_CLONE);
-		if (new_second.end() == second.end()) {
-			BEESCOUNT(pairforward_eof_second);
+		// Physical blocks must be distinct
+		BeesAddress second_addr(e_second, second.end());
+		if (first_addr.get_physical_or_zero() == second_addr.get_physical_or_zero()) {
+			BEESCOUNT(pairforward_same);
 			break;
 		}
 
+		off_t len = min(e_first.end() - first.end(), e_second.end() - second.end());
+		len = min(len, BLOCK_SIZE_GROW_CHUNK);
+		len = min(len, BLOCK_SIZE_MAX_EXTENT - first.size());
+		len = min(len, first.file_size() - first.end());
+		len = min(len, second.file_size() - second.end());
+
 		// If we have hit an unaligned EOF then it has to be the same unaligned EOF.
-		// If we haven't hit EOF then the ends of the ranges are still aligned,
-		// so the misalignment (zero) will be equal.
-		if ((new_second.end() & BLOCK_MASK_CLONE) != (new_first.end() & BLOCK_MASK_CLONE)) {
-			BEESCOUNT(pairforward_eof_malign);
-			break;
+		// If we haven't hit EOF then the ends of the ranges are still aligned.
+		if (len & BLOCK_MASK_CLONE) {
+			if (first.end() + len != first.file_size() || second.end() + len != second.file_size()) {
+				len &= ~BLOCK_MASK_CLONE;
+			}
+			if (!len) {
+				BEESCOUNT(pairforward_eof_malign);
+				break;
+			}
 		}
 
-		// If the ranges now overlap we went too far
-		if (new_first.overlaps(new_second)) {
+		// If the ranges would overlap we must stop before they do
+		if (same_file) {
+			if (first.end() <= second.begin()) {
+				len = min(len, second.begin() - first.end());
+			}
+			if (second.end() <= first.begin()) {
+				len = min(len, first.begin() - second.end());
+			}
+		}
+		if (len <= 0) {
 			BEESCOUNT(pairforward_overlap);
 			break;
 		}
 
-		BEESTRACE("first " << first << " new_first " << new_first);
-		BeesBlockData first_bbd(first.fd(), first.end(), new_first.end() - first.end());
-		BEESTRACE("first_bbd " << first_bbd);
-		BEESTRACE("second " << second << " new_second " << new_second);
-		BeesBlockData second_bbd(second.fd(), second.end(), new_second.end() - second.end());
-		BEESTRACE("second_bbd " << second_bbd);
-
-		// Both blocks must have identical content
-		if (!first_bbd.is_data_equal(second_bbd)) {
-			BEESCOUNT(pairforward_miss);
-			break;
-		}
+		// The src chunk is only read if some block is not matched by the hash table
+		BEESTRACE("reading " << len << " bytes after " << *this);
+		vector<uint8_t> first_data, second_data(len);
+		btrfs_pread_or_die(second.fd(), second_data, second.end());
+		BEESCOUNTADD(pairforward_read_bytes, len);
+
+		off_t matched = 0;
+		bool stop = false;
+		while (matched < len) {
+			const off_t block_len = min(BLOCK_SIZE_CLONE, len - matched);
+			const off_t block_pos = first.end() + matched;
+			const uint8_t *const second_block = second_data.data() + matched;
+			const BeesHash second_hash(Digest::CRC::crc64(second_block, block_len));
+
+			// Look for toxic hashes, and for the src block at the dst block's hash
+			const BeesAddress first_block_addr = trust ? BeesAddress(e_first, block_pos) : BeesAddress();
+			bool found_toxic = false;
+			bool found_first = false;
+			for (auto i : hash_table->find_cell(second_hash)) {
+				const BeesAddress found_addr(i.e_addr);
+				if (found_addr.is_toxic()) {
+					found_toxic = true;
+					break;
+				}
+				if (trust && found_addr == first_block_addr) {
+					found_first = true;
+				}
+			}
 
-		// Physical blocks must be distinct
-		if (first_bbd.addr().get_physical_or_zero() == second_bbd.addr().get_physical_or_zero()) {
-			BEESCOUNT(pairforward_same);
-			break;
-		}
+			// Both blocks must have identical content
+			if (found_first) {
+				BEESCOUNT(pairforward_trusted);
+			} else {
+				if (first_data.empty()) {
+					first_data.resize(len);
+					btrfs_pread_or_die(first.fd(), first_data, first.end());
+					BEESCOUNTADD(pairforward_read_bytes, len);
+				}
+				if (memcmp(first_data.data() + matched, second_block, block_len)) {
+					BEESCOUNT(pairforward_miss);
+					stop = true;
+					break;
+				}
+			}
 
-		// Source block cannot be zero in a non-compressed non-magic extent
-		if (first_bbd.is_data_zero() && !first_addr.is_magic() && !first_addr.is_compressed()) {
-			BEESCOUNT(pairforward_zero);
-			break;
-		}
+			// Source block cannot be zero in a non-compressed non-magic extent
+			if (!first_addr.is_magic() && !first_addr.is_compressed() && is_zero_block(second_block, block_len)) {
+				BEESCOUNT(pairforward_zero);
+				stop = true;
+				break;
+			}
 
-		// Source block cannot have a toxic hash
-		auto found_hashes = hash_table->find_cell(first_bbd.hash());
-		bool found_toxic = false;
-		for (auto i : found_hashes) {
-			if (BeesAddress(i.e_addr).is_toxic()) {
-				found_toxic = true;
+			// Source block cannot have a toxic hash
+			if (found_toxic) {
+				BEESLOGWARN("WORKAROUND: found toxic hash " << second_hash << " in " << BeesFileRange(first.fd(), block_pos, block_pos + block_len) << " while extending forward:\n" << *this);
+				BEESCOUNT(pairforward_toxic_hash);
+				stop = true;
 				break;
 			}
+
+			// OK, next block
+			matched += block_len;
+			BEESCOUNT(pairforward_hit);
 		}
-		if (found_toxic) {
-			BEESLOGWARN("WORKAROUND: found toxic hash in " << first_bbd << " while extending forward:\n" << *this);
-			BEESCOUNT(pairforward_toxic_hash);
+
+		if (matched) {
+			first.grow_end(matched);
+			second.grow_end(matched);
+			THROW_CHECK2(invalid_argument, first.size(), second.size(), first.size() == second.size());
+			rv = true;
+		}
+		if (stop) {
 			break;
 		}
-
-		// OK, next block
-		THROW_CHECK2(invalid_argument, new_first.size(), new_second.size(), new_first.size() == new_second.size());
-		first = new_first;
-		second = new_second;
-		rv = true;
-		BEESCOUNT(pairforward_hit);
 	}
 
 	if (first.overlaps(second)) {
@@ -620,6 +764,28 @@ BeesRangePair::grow(shared_ptr<BeesContext> ctx, bool constrained)
 	return rv;
 }
 
+/// Remove half of what grow() added around seed, keeping the blocks
+/// aligned.  Returns false if this pair is already the same as seed.
+bool
+BeesRangePair::shrink(const BeesRangePair &seed)
+{
+	BEESTRACE("shrink " << *this << " toward " << seed);
+	const off_t before = seed.first.begin() - first.begin();
+	const off_t after = first.end() - seed.first.end();
+	THROW_CHECK2(invalid_argument, *this, seed, before >= 0 && after >= 0);
+	THROW_CHECK2(invalid_argument, *this, seed, seed.second.begin() - second.begin() == before);
+	THROW_CHECK2(invalid_argument, *this, seed, second.end() - seed.second.end() == after);
+	if (!before && !after) {
+		return false;
+	}
+
+	const off_t new_before = (before / 2) & ~BLOCK_MASK_CLONE;
+	const off_t new_after = (after / 2) & ~BLOCK_MASK_CLONE;
+	first = BeesFileRange(first.fd(), seed.first.begin() - new_before, seed.first.end() + new_after);
+	second = BeesFileRange(second.fd(), seed.second.begin() - new_before, seed.second.end() + new_after);
+	return true;
+}
+
 BeesRangePair
 BeesRangePair::copy_closed() const
 {
@@ -946,7 +1112,7 @@ BeesBlockData::data() const
 		Timer read_timer;
 
 		Blob rv(size());
-		pread_or_die(m_fd, rv, m_offset);
+		btrfs_pread_or_die(m_fd, rv, m_offset);
 		THROW_CHECK2(runtime_error, rv.size(), size(), ranged_cast<off_t>(rv.size()) == size());
 		m_data = rv;
 		BEESCOUNT(block_read);
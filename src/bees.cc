@@ -30,8 +30,6 @@
 using namespace crucible;
 using namespace std;
 
-int bees_log_level = 8;
-
 void
 do_cmd_help(char *argv[])
 {
@@ -54,6 +52,17 @@ do_cmd_help(char *argv[])
 		"Filesystem tree traversal options:\n"
 		"    -m, --scan-mode       Scanning mode (0..2, default 0)\n"
 		"\n"
+		"Hash table options:\n"
+		"    -R, --hash-policy     Bucket replacement policy (random, clock, slru; default random)\n"
+		"\n"
+		"Dedupe options:\n"
+		"    -K, --trust-kernel-compare    Let the kernel verify hash table matches\n"
+		"    -x, --extent-index    Dedupe identical whole extents in one call\n"
+		"    -n, --sample-interval    Probe every Nth block of large extents first\n"
+		"\n"
+		"Shutdown options:\n"
+		"    -S, --stop-timeout    Seconds to spend saving state on SIGTERM (default no limit)\n"
+		"\n"
 		"Workarounds:\n"
 		"    -a, --workaround-btrfs-send    Workaround for btrfs send\n"
 		"\n"
@@ -63,6 +72,8 @@ do_cmd_help(char *argv[])
 		"    -p, --absolute-paths  Show absolute paths (default)\n"
 		"    -P, --strip-paths     Strip $CWD from beginning of all paths in the log\n"
 		"    -v, --verbose         Set maximum log level (0..8, default 8)\n"
+		"    -e, --event-trace     Write binary event trace to BEESHOME/beesevents.dat\n"
+		"    -H, --hash-trace      Write hash table trace to BEESHOME/beeshash-trace.dat\n"
 		"\n"
 		"Optional environment variables:\n"
 		"    BEESHOME    Path to hash table and configuration files\n"
@@ -71,154 +82,13 @@ do_cmd_help(char *argv[])
 		"    BEESSTATUS  File to write status to (tmpfs recommended, e.g. /run).\n"
 		"                No status is written if this variable is unset.\n"
 		"\n"
+		"    BEESMETRICS Unix socket path to serve OpenMetrics text on.\n"
+		"                No socket is created if this variable is unset.\n"
+		"\n"
 	// 80col 01234567890123456789012345678901234567890123456789012345678901234567890123456789
 	<< endl;
 }
 
-// tracing ----------------------------------------
-
-thread_local BeesTracer *BeesTracer::tl_next_tracer = nullptr;
-thread_local bool BeesTracer::tl_silent = false;
-
-BeesTracer::~BeesTracer()
-{
-	if (!tl_silent && uncaught_exception()) {
-		try {
-			m_func();
-		} catch (exception &e) {
-			BEESLOGNOTICE("Nested exception: " << e.what());
-		} catch (...) {
-			BEESLOGNOTICE("Nested exception ...");
-		}
-		if (!m_next_tracer) {
-			BEESLOGNOTICE("---  END  TRACE --- exception ---");
-		}
-	}
-	tl_next_tracer = m_next_tracer;
-	if (!m_next_tracer) {
-		tl_silent = false;
-	}
-}
-
-BeesTracer::BeesTracer(function<void()> f, bool silent) :
-	m_func(f)
-{
-	m_next_tracer = tl_next_tracer;
-	tl_next_tracer = this;
-	tl_silent = silent;
-}
-
-void
-BeesTracer::trace_now()
-{
-	BeesTracer *tp = tl_next_tracer;
-	BEESLOGNOTICE("--- BEGIN TRACE ---");
-	while (tp) {
-		tp->m_func();
-		tp = tp->m_next_tracer;
-	}
-	BEESLOGNOTICE("---  END  TRACE ---");
-}
-
-bool
-BeesTracer::get_silent()
-{
-	return tl_silent;
-}
-
-void
-BeesTracer::set_silent()
-{
-	tl_silent = true;
-}
-
-thread_local BeesNote *BeesNote::tl_next = nullptr;
-mutex BeesNote::s_mutex;
-map<pid_t, BeesNote*> BeesNote::s_status;
-thread_local string BeesNote::tl_name;
-
-BeesNote::~BeesNote()
-{
-	tl_next = m_prev;
-	unique_lock<mutex> lock(s_mutex);
-	if (tl_next) {
-		s_status[gettid()] = tl_next;
-	} else {
-		s_status.erase(gettid());
-	}
-}
-
-BeesNote::BeesNote(function<void(ostream &os)> f) :
-	m_func(f)
-{
-	m_name = get_name();
-	m_prev = tl_next;
-	tl_next = this;
-	unique_lock<mutex> lock(s_mutex);
-	s_status[gettid()] = tl_next;
-}
-
-void
-BeesNote::set_name(const string &name)
-{
-	tl_name = name;
-	catch_all([&]() {
-		DIE_IF_MINUS_ERRNO(pthread_setname_np(pthread_self(), name.c_str()));
-	});
-}
-
-string
-BeesNote::get_name()
-{
-	// Use explicit name if given
-	if (!tl_name.empty()) {
-		return tl_name;
-	}
-
-	// Try a Task name.  If there is one, return it, but do not
-	// remember it.  Each output message may be a different Task.
-	// The current task is thread_local so we don't need to worry
-	// about it being destroyed under us.
-	auto current_task = Task::current_task();
-	if (current_task) {
-		return current_task.title();
-	}
-
-	// OK try the pthread name next.
-	char buf[24];
-	memset(buf, '\0', sizeof(buf));
-	int err = pthread_getname_np(pthread_self(), buf, sizeof(buf));
-	if (err) {
-		return string("pthread_getname_np: ") + strerror(err);
-	}
-	buf[sizeof(buf) - 1] = '\0';
-
-	// thread_getname_np returns process name
-	// ...by default?  ...for the main thread?
-	// ...except during exception handling?
-	// ...randomly?
-	return buf;
-}
-
-BeesNote::ThreadStatusMap
-BeesNote::get_status()
-{
-	unique_lock<mutex> lock(s_mutex);
-	ThreadStatusMap rv;
-	for (auto t : s_status) {
-		ostringstream oss;
-		if (!t.second->m_name.empty()) {
-			oss << t.second->m_name << ": ";
-		}
-		if (t.second->m_timer.age() > BEES_TOO_LONG) {
-			oss << "[" << t.second->m_timer << "s] ";
-		}
-		t.second->m_func(oss);
-		rv[t.first] = oss.str();
-	}
-	return rv;
-}
-
 // static inline helpers ----------------------------------------
 
 static inline
@@ -250,166 +120,6 @@ pretty(double d)
 	return oss.str();
 }
 
-// ostream operators ----------------------------------------
-
-template <class T>
-ostream &
-operator<<(ostream &os, const BeesStatTmpl<T> &bs)
-{
-	unique_lock<mutex> lock(bs.m_mutex);
-	bool first = true;
-	string last_tag;
-	for (auto i : bs.m_stats_map) {
-		if (i.second == 0) {
-			continue;
-		}
-		string tag = i.first.substr(0, i.first.find_first_of("_"));
-		if (!last_tag.empty() && tag != last_tag) {
-			os << "\n\t";
-		} else if (!first) {
-			os << " ";
-		}
-		last_tag = tag;
-		first = false;
-		os << i.first << "=" << i.second;
-	}
-	return os;
-}
-
-// other ----------------------------------------
-
-template <class T>
-T&
-BeesStatTmpl<T>::at(string idx)
-{
-	if (!m_stats_map.count(idx)) {
-		m_stats_map[idx] = 0;
-	}
-	return m_stats_map[idx];
-}
-
-template <class T>
-T
-BeesStatTmpl<T>::at(string idx) const
-{
-	unique_lock<mutex> lock(m_mutex);
-	auto rv = m_stats_map.at(idx);
-	return rv;
-}
-
-template <class T>
-void
-BeesStatTmpl<T>::add_count(string idx, size_t amount)
-{
-	unique_lock<mutex> lock(m_mutex);
-	if (!m_stats_map.count(idx)) {
-		m_stats_map[idx] = amount;
-	} else {
-		m_stats_map[idx] += amount;
-	}
-}
-
-template <class T>
-BeesStatTmpl<T>::BeesStatTmpl(const BeesStatTmpl &that)
-{
-	if (&that == this) return;
-	unique_lock<mutex> lock(m_mutex);
-	unique_lock<mutex> lock2(that.m_mutex);
-	m_stats_map = that.m_stats_map;
-}
-
-template <class T>
-BeesStatTmpl<T> &
-BeesStatTmpl<T>::operator=(const BeesStatTmpl<T> &that)
-{
-	if (&that == this) return *this;
-	unique_lock<mutex> lock(m_mutex);
-	unique_lock<mutex> lock2(that.m_mutex);
-	m_stats_map = that.m_stats_map;
-	return *this;
-}
-
-BeesStats BeesStats::s_global;
-
-BeesStats
-BeesStats::operator-(const BeesStats &that) const
-{
-	if (&that == this) return BeesStats();
-
-	unique_lock<mutex> this_lock(m_mutex);
-	BeesStats this_copy;
-	this_copy.m_stats_map = m_stats_map;
-	this_lock.unlock();
-
-	unique_lock<mutex> that_lock(that.m_mutex);
-	BeesStats that_copy;
-	that_copy.m_stats_map = that.m_stats_map;
-	that_lock.unlock();
-
-	for (auto i : that.m_stats_map) {
-		if (i.second != 0) {
-			this_copy.at(i.first) -= i.second;
-		}
-	}
-	return this_copy;
-}
-
-BeesRates
-BeesStats::operator/(double d) const
-{
-	BeesRates rv;
-	unique_lock<mutex> lock(m_mutex);
-	for (auto i : m_stats_map) {
-		rv.m_stats_map[i.first] = ceil(i.second / d * 1000) / 1000;
-	}
-	return rv;
-}
-
-BeesStats::operator bool() const
-{
-	unique_lock<mutex> lock(m_mutex);
-	for (auto i : m_stats_map) {
-		if (i.second != 0) {
-			return true;
-		}
-	}
-	return false;
-}
-
-BeesTooLong::BeesTooLong(const string &s, double limit) :
-	m_limit(limit),
-	m_func([s](ostream &os) { os << s; })
-{
-}
-
-BeesTooLong::BeesTooLong(const func_type &func, double limit) :
-	m_limit(limit),
-	m_func(func)
-{
-}
-
-void
-BeesTooLong::check() const
-{
-	if (age() > m_limit) {
-		ostringstream oss;
-		m_func(oss);
-		BEESLOGWARN("PERFORMANCE: " << *this << " sec: " << oss.str());
-	}
-}
-
-BeesTooLong::~BeesTooLong()
-{
-	check();
-}
-
-BeesTooLong &
-BeesTooLong::operator=(const func_type &f)
-{
-	m_func = f;
-	return *this;
-}
-
 void
 bees_sync(int fd)
 {
@@ -621,6 +331,7 @@ BeesTempFile::make_copy(const BeesFileRange &src)
 	resize(end);
 
 	Timer copy_timer;
+	BeesEvent bev(BeesEvent::COPY, src, src.begin(), src.size());
 	BeesFileRange rv(m_fd, begin, end);
 	BEESTRACE("copying to: " << rv);
 	BEESNOTE("copying " << src << " to " << rv);
@@ -660,6 +371,7 @@ BeesTempFile::make_copy(const BeesFileRange &src)
 	}
 
 	BEESCOUNT(tmp_copy);
+	bev.outcome(BeesEvent::OK);
 	return rv;
 }
 
@@ -771,21 +483,30 @@ bees_main(int argc, char *argv[])
 	unsigned thread_min = 0;
 	double load_target = 0;
 	bool workaround_btrfs_send = false;
+	bool event_trace = false;
+	bool hash_trace = false;
 
 	// Configure getopt_long
 	static const struct option long_options[] = {
 		{ "thread-factor",         required_argument, NULL, 'C' },
 		{ "thread-min",            required_argument, NULL, 'G' },
+		{ "hash-trace",            no_argument,       NULL, 'H' },
+		{ "trust-kernel-compare",  no_argument,       NULL, 'K' },
 		{ "strip-paths",           no_argument,       NULL, 'P' },
+		{ "hash-policy",           required_argument, NULL, 'R' },
+		{ "stop-timeout",          required_argument, NULL, 'S' },
 		{ "no-timestamps",         no_argument,       NULL, 'T' },
 		{ "workaround-btrfs-send", no_argument,       NULL, 'a' },
 		{ "thread-count",          required_argument, NULL, 'c' },
+		{ "event-trace",           no_argument,       NULL, 'e' },
 		{ "loadavg-target",        required_argument, NULL, 'g' },
 		{ "help",                  no_argument,       NULL, 'h' },
 		{ "scan-mode",             required_argument, NULL, 'm' },
+		{ "sample-interval",       required_argument, NULL, 'n' },
 		{ "absolute-paths",        no_argument,       NULL, 'p' },
 		{ "timestamps",            no_argument,       NULL, 't' },
 		{ "verbose",               required_argument, NULL, 'v' },
+		{ "extent-index",          no_argument,       NULL, 'x' },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -823,9 +544,33 @@ bees_main(int argc, char *argv[])
 			case 'G':
 				thread_min = stoul(optarg);
 				break;
+			case 'H':
+				hash_trace = true;
+				break;
+			case 'K':
+				bc->set_trust_kernel_compare(true);
+				break;
 			case 'P':
 				crucible::set_relative_path(cwd);
 				break;
+			case 'R':
+				{
+					auto policy = BeesHashTable::POLICY_MAX;
+					for (int i = 0; i < BeesHashTable::POLICY_MAX; ++i) {
+						if (optarg == string(BeesHashTable::policy_name(static_cast<BeesHashTable::Policy>(i)))) {
+							policy = static_cast<BeesHashTable::Policy>(i);
+						}
+					}
+					if (policy == BeesHashTable::POLICY_MAX) {
+						BEESLOGERR("Unknown hash table replacement policy '" << optarg << "'");
+						return EXIT_FAILURE;
+					}
+					bc->set_hash_policy(policy);
+				}
+				break;
+			case 'S':
+				bc->set_stop_timeout(stod(optarg));
+				break;
 			case 'T':
 				chatter_prefix_timestamp = false;
 				break;
@@ -835,12 +580,18 @@ bees_main(int argc, char *argv[])
 			case 'c':
 				thread_count = stoul(optarg);
 				break;
+			case 'e':
+				event_trace = true;
+				break;
 			case 'g':
 				load_target = stod(optarg);
 				break;
 			case 'm':
 				bc->roots()->set_scan_mode(static_cast<BeesRoots::ScanMode>(stoul(optarg)));
 				break;
+			case 'n':
+				bc->set_sample_interval(stoul(optarg));
+				break;
 			case 'p':
 				crucible::set_relative_path("");
 				break;
@@ -856,6 +607,9 @@ bees_main(int argc, char *argv[])
 					BEESLOGNOTICE("log level set to " << bees_log_level);
 				}
 				break;
+			case 'x':
+				bc->set_extent_index(true);
+				break;
 
 			case 'h':
 			default:
@@ -916,6 +670,14 @@ bees_main(int argc, char *argv[])
 	// Create a context and start crawlers
 	bc->set_root_path(argv[optind++]);
 
+	// Binary event trace goes in BEESHOME
+	if (event_trace) {
+		BeesEvent::start(bc->home_fd());
+	}
+	if (hash_trace) {
+		BeesHashTrace::start(bc->home_fd());
+	}
+
 	// Start crawlers
 	bc->start();
 
@@ -924,33 +686,9 @@ bees_main(int argc, char *argv[])
 
 	// Shut it down
 	bc->stop();
+	BeesEvent::stop();
+	BeesHashTrace::stop();
 
 	// That is all.
 	return EXIT_SUCCESS;
 }
-
-int
-main(int argc, char *argv[])
-{
-	cerr << "bees version " << BEES_VERSION << endl;
-
-	if (argc < 2) {
-		do_cmd_help(argv);
-		return EXIT_FAILURE;
-	}
-
-	int rv = 1;
-	catch_and_explain([&]() {
-		rv = bees_main(argc, argv);
-	});
-	BEESLOGNOTICE("Exiting with status " << rv << " " << (rv ? "(failure)" : "(success)"));
-	return rv;
-}
-
-// instantiate templates for linkage ----------------------------------------
-
-template class BeesStatTmpl<uint64_t>;
-template ostream & operator<<(ostream &os, const BeesStatTmpl<uint64_t> &bs);
-
-template class BeesStatTmpl<double>;
-template ostream & operator<<(ostream &os, const BeesStatTmpl<double> &bs);
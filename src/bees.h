@@ -45,6 +45,9 @@ const off_t BLOCK_SIZE_MAX_COMPRESSED_EXTENT = 128 * 1024;
 // ...FIEMAP is slow and full of lies
 const off_t BLOCK_SIZE_MAX_EXTENT = 128 * 1024 * 1024;
 
+// Maximum length of data read from each file at once when growing a matching range pair
+const off_t BLOCK_SIZE_GROW_CHUNK = 1024 * 1024;
+
 // Masks, so we don't have to write "(BLOCK_SIZE_CLONE - 1)" everywhere
 const off_t BLOCK_MASK_CLONE = BLOCK_SIZE_CLONE - 1;
 const off_t BLOCK_MASK_SUMS = BLOCK_SIZE_SUMS - 1;
@@ -61,9 +64,19 @@ const off_t BLOCK_SIZE_HASHTAB_EXTENT = BLOCK_SIZE_MAX_COMPRESSED_EXTENT;
 // Bytes per second we want to flush (8GB every two hours)
 const double BEES_FLUSH_RATE = 8.0 * 1024 * 1024 * 1024 / 7200.0;
 
-// Interval between writing crawl state to disk
+// Threads writing the hash table at shutdown, and hash table extents per write
+const size_t BEES_SHUTDOWN_FLUSH_THREADS = 4;
+const size_t BEES_SHUTDOWN_FLUSH_EXTENTS = 64;
+
+// Interval between rewriting the whole crawl state to disk
 const int BEES_WRITEBACK_INTERVAL = 900;
 
+// Interval between appending crawl state changes to the journal
+const double BEES_CRAWL_CHECKPOINT_INTERVAL = 5;
+
+// Rewrite the whole crawl state when the journal reaches this size
+const off_t BEES_CRAWL_JOURNAL_MAX = 1024 * 1024;
+
 // Statistics reports while scanning
 const int BEES_STATS_INTERVAL = 3600;
 
@@ -79,6 +92,21 @@ const size_t BEES_FILE_FD_CACHE_SIZE = 4096;
 // Number of root FDs to cache when not in active use
 const size_t BEES_ROOT_FD_CACHE_SIZE = 1024;
 
+// Number of (root, ino) pairs that could not be opened to remember
+const size_t BEES_OPEN_NEGATIVE_CACHE_SIZE = 65536;
+
+// Number of files to keep extent maps for
+const size_t BEES_EXTENT_MAP_CACHE_SIZE = 64;
+
+// Number of whole extents to remember in the extent index
+const size_t BEES_EXTENT_INDEX_SIZE = 65536;
+
+// With --sample-interval, probe uncompressed extents at least this large before reading them
+const off_t BEES_SAMPLE_EXTENT_MIN = 1024 * 1024;
+
+// Close cached FDs that have not been used for this many seconds
+const double BEES_FD_CACHE_IDLE_AGE = 60;
+
 // Number of FDs to open (rlimit)
 const size_t BEES_OPEN_FILE_LIMIT = (BEES_FILE_FD_CACHE_SIZE + BEES_ROOT_FD_CACHE_SIZE) * 2 + 100;
 
@@ -94,6 +122,9 @@ const double BEES_TOO_LONG = 5.0;
 // Avoid any extent where LOGICAL_INO takes this much kernel CPU time
 const double BEES_TOXIC_SYS_DURATION = 0.1;
 
+// Halve a grown range pair this many times after the kernel finds different data, then retry the original match
+const size_t BEES_DEDUP_SHRINK_RETRIES = 2;
+
 // How long between hash table histograms
 const double BEES_HASH_TABLE_ANALYZE_INTERVAL = BEES_STATS_INTERVAL;
 
@@ -106,9 +137,36 @@ const size_t BEES_MAX_CRAWL_SIZE = 1024;
 // Insert this many items before switching to a new subvol
 const size_t BEES_MAX_CRAWL_BATCH = 128;
 
+// Insert this many items from a subvol that yields little dedup for its scan time
+const size_t BEES_MAX_CRAWL_BATCH_POOR = 16;
+
+// Don't judge a subvol's dedup yield until we have spent this long scanning it
+const double BEES_ROOT_COST_MIN_SECONDS = 60;
+
+// A subvol is poor when its yield is less than this fraction of the filesystem average
+const double BEES_ROOT_COST_POOR_FRACTION = 0.1;
+
 // Wait this many transids between crawls
 const size_t BEES_TRANSID_FACTOR = 10;
 
+// Number of distinct event counters with lock-free per-thread slots
+const size_t BEES_MAX_COUNTERS = 1024;
+
+// Binary event trace records buffered in memory between flushes
+const size_t BEES_EVENT_TRACE_RECORDS = 64 * 1024;
+
+// Interval between binary event trace flushes
+const double BEES_EVENT_TRACE_INTERVAL = 1.0;
+
+// Rename the binary event trace file to .old when it reaches this size
+const off_t BEES_EVENT_TRACE_FILE_SIZE = 256 * 1024 * 1024;
+
+// Hash table trace records buffered by each thread between writes
+const size_t BEES_HASH_TRACE_RECORDS = 4096;
+
+// Rename the hash table trace file to .old when it reaches this size
+const off_t BEES_HASH_TRACE_FILE_SIZE = 1024 * 1024 * 1024;
+
 // Flags
 const int FLAGS_OPEN_COMMON   = O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOATIME | O_LARGEFILE | O_NOCTTY;
 const int FLAGS_OPEN_DIR      = FLAGS_OPEN_COMMON | O_RDONLY | O_DIRECTORY;
@@ -125,9 +183,22 @@ const int FLAGS_OPEN_FANOTIFY = O_RDWR | O_NOATIME | O_CLOEXEC | O_LARGEFILE;
 #define BEESLOG(lv,x)   do { if (lv < bees_log_level) { Chatter c(lv, BeesNote::get_name()); c << x; } } while (0)
 #define BEESLOGTRACE(x) do { BEESLOG(LOG_DEBUG, x); BeesTracer::trace_now(); } while (0)
 
-#define BEESTRACE(x)   BeesTracer  SRSLY_WTF_C(beesTracer_,  __LINE__) ([&]()                 { BEESLOG(LOG_ERR, x);   })
-#define BEESTOOLONG(x) BeesTooLong SRSLY_WTF_C(beesTooLong_, __LINE__) ([&](ostream &_btl_os) { _btl_os << x; })
-#define BEESNOTE(x)    BeesNote    SRSLY_WTF_C(beesNote_,    __LINE__) ([&](ostream &_btl_os) { _btl_os << x; })
+// Each frame refers to a lambda stored next to it on the stack.
+// Nothing is allocated and the message is only built if it is rendered.
+// Build with -DBEES_NO_TRACE to strip BEESTRACE frames entirely.
+#ifdef BEES_NO_TRACE
+#define BEESTRACE(x)   do { } while (0)
+#else
+#define BEESTRACE(x) \
+	auto SRSLY_WTF_C(beesTracerFn_,  __LINE__) = [&]()                 { BEESLOG(LOG_ERR, x); }; \
+	BeesTracer  SRSLY_WTF_C(beesTracer_,  __LINE__) (SRSLY_WTF_C(beesTracerFn_,  __LINE__))
+#endif
+#define BEESTOOLONG(x) \
+	auto SRSLY_WTF_C(beesTooLongFn_, __LINE__) = [&](ostream &_btl_os) { _btl_os << x; }; \
+	BeesTooLong SRSLY_WTF_C(beesTooLong_, __LINE__) (SRSLY_WTF_C(beesTooLongFn_, __LINE__))
+#define BEESNOTE(x) \
+	auto SRSLY_WTF_C(beesNoteFn_,    __LINE__) = [&](ostream &_btl_os) { _btl_os << x; }; \
+	BeesNote    SRSLY_WTF_C(beesNote_,    __LINE__) (SRSLY_WTF_C(beesNoteFn_,    __LINE__))
 
 #define BEESLOGERR(x)    BEESLOG(LOG_ERR, x)
 #define BEESLOGWARN(x)   BEESLOG(LOG_WARNING, x)
@@ -136,11 +207,13 @@ const int FLAGS_OPEN_FANOTIFY = O_RDWR | O_NOATIME | O_CLOEXEC | O_LARGEFILE;
 #define BEESLOGDEBUG(x)  BEESLOG(LOG_DEBUG, x)
 
 #define BEESCOUNT(stat) do { \
-	BeesStats::s_global.add_count(#stat); \
+	static const BeesCounters::Id BEESCOUNT_id = BeesCounters::register_name(#stat); \
+	BeesCounters::add(BEESCOUNT_id, 1); \
 } while (0)
 
 #define BEESCOUNTADD(stat, amount) do { \
-	BeesStats::s_global.add_count(#stat, (amount)); \
+	static const BeesCounters::Id BEESCOUNT_id = BeesCounters::register_name(#stat); \
+	BeesCounters::add(BEESCOUNT_id, (amount)); \
 } while (0)
 
 // ----------------------------------------
@@ -160,6 +233,7 @@ public:
 	BeesStatTmpl &operator=(const BeesStatTmpl &that);
 	void add_count(string idx, size_t amount = 1);
 	T at(string idx) const;
+	map<string, T> get_map() const;
 
 friend ostream& operator<< <>(ostream &os, const BeesStatTmpl<T> &bs);
 friend class BeesStats;
@@ -168,44 +242,112 @@ friend class BeesStats;
 using BeesRates = BeesStatTmpl<double>;
 
 struct BeesStats : public BeesStatTmpl<uint64_t> {
-	static BeesStats s_global;
+	// Sum of all BEESCOUNT event counters
+	static BeesStats snapshot();
 
 	BeesStats operator-(const BeesStats &that) const;
 	BeesRates operator/(double d) const;
 	explicit operator bool() const;
 };
 
+// Event counters are registered once per name and incremented in
+// per-thread slots without locks.  Slots are summed by snapshot().
+class BeesCounters {
+public:
+	using Id = size_t;
+
+	struct Slots {
+		// Padding keeps other heap objects off the ends of the counter array
+		uint8_t			m_pad_front[64];
+		atomic<uint64_t>	m_counts[BEES_MAX_COUNTERS];
+		uint8_t			m_pad_back[64];
+	};
+
+	static Id register_name(const char *name);
+	static void add(Id id, uint64_t amount);
+	static BeesStats snapshot();
+	static void retire(const shared_ptr<Slots> &slots);
+
+private:
+	static Slots *register_thread();
+	static void add_slow(Id id, uint64_t amount);
+
+	thread_local static Slots	*tl_slots;
+};
+
+inline
+void
+BeesCounters::add(Id id, uint64_t amount)
+{
+	Slots *slots = tl_slots;
+	if (!slots || id >= BEES_MAX_COUNTERS) {
+		add_slow(id, amount);
+		return;
+	}
+	// Only this thread writes this slot, so there is no read-modify-write race
+	auto &count = slots->m_counts[id];
+	count.store(count.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
 class BeesContext;
 class BeesBlockData;
 
 class BeesTracer {
-	function<void()> m_func;
-	BeesTracer *m_next_tracer = 0;
+	using render_type = void (*)(const void *);
+	render_type	m_render;
+	const void	*m_arg;
+	BeesTracer	*m_next_tracer = 0;
 
 	thread_local static BeesTracer *tl_next_tracer;
 	thread_local static bool tl_silent;
+
+	template <class F> static void render(const void *arg) { (*static_cast<const F *>(arg))(); }
+	void push(bool silent);
+
+	BeesTracer(const BeesTracer &) = delete;
+	BeesTracer &operator=(const BeesTracer &) = delete;
 public:
-	BeesTracer(function<void()> f, bool silent = false);
+	// f must outlive the BeesTracer
+	template <class F> BeesTracer(const F &f, bool silent = false);
 	~BeesTracer();
 	static void trace_now();
 	static bool get_silent();
 	static void set_silent();
 };
 
+template <class F>
+BeesTracer::BeesTracer(const F &f, bool silent) :
+	m_render(&render<F>),
+	m_arg(&f)
+{
+	push(silent);
+}
+
 class BeesNote {
-	function<void(ostream &)>	m_func;
+	using render_type = void (*)(const void *, ostream &);
+	render_type			m_render;
+	const void			*m_arg;
 	BeesNote			*m_prev;
 	Timer				m_timer;
-	string				m_name;
+	Task				m_task;
 
-	static mutex			s_mutex;
-	static map<pid_t, BeesNote*>	s_status;
+	// One status slot per thread, published with atomics
+	struct ThreadSlot;
+	static atomic<ThreadSlot*>	s_slots;
+	static ThreadSlot		*get_slot();
 
 	thread_local static BeesNote	*tl_next;
+	thread_local static ThreadSlot	*tl_slot;
 	thread_local static string	tl_name;
 
+	template <class F> static void render(const void *arg, ostream &os) { (*static_cast<const F *>(arg))(os); }
+	void push();
+
+	BeesNote(const BeesNote &) = delete;
+	BeesNote &operator=(const BeesNote &) = delete;
 public:
-	BeesNote(function<void(ostream &)> f);
+	// f must outlive the BeesNote
+	template <class F> BeesNote(const F &f);
 	~BeesNote();
 
 	using ThreadStatusMap = map<pid_t, string>;
@@ -214,8 +356,20 @@ public:
 
 	static void set_name(const string &name);
 	static string get_name();
+
+	// Called at thread exit
+	static void release_slot();
 };
 
+template <class F>
+BeesNote::BeesNote(const F &f) :
+	m_render(&render<F>),
+	m_arg(&f),
+	m_prev(nullptr)
+{
+	push();
+}
+
 // C++ threads dumbed down even further
 class BeesThread {
 	string			m_name;
@@ -410,20 +564,45 @@ public:
 		uint8_t	p_byte[BLOCK_SIZE_HASHTAB_EXTENT];
 	} __attribute__((packed));
 
+	// Bucket replacement policies
+	enum Policy {
+		RANDOM,		// Insert at a random position, move to front on dedup
+		CLOCK,		// Evict the first cell with no reuse from a random start
+		SLRU,		// Insert at the head of the back half, move to front on dedup
+		POLICY_MAX,
+	};
+	static const char *policy_name(Policy policy);
+
+	// CLOCK reuse counter, in address bits that are always zero in BeesAddress
+	static const AddrType c_reuse_shift = 6;
+	static const AddrType c_reuse_max = 7;
+	static const AddrType c_reuse_mask = c_reuse_max << c_reuse_shift;
+
+	// An empty filename makes an anonymous in-memory table with no
+	// background threads (ctx may be null), e.g. for benchmarks
 	BeesHashTable(shared_ptr<BeesContext> ctx, string filename, off_t size = BLOCK_SIZE_HASHTAB_EXTENT);
 	~BeesHashTable();
 
-	void stop();
+	// Flush dirty extents for at most timeout seconds, and drop the rest
+	void stop(double timeout = numeric_limits<double>::infinity());
+
+	void		set_policy(Policy policy);
+	Policy		policy() const { return m_policy; }
 
 	vector<Cell>	find_cell(HashType hash);
 	bool		push_random_hash_addr(HashType hash, AddrType addr);
 	void		erase_hash_addr(HashType hash, AddrType addr);
 	bool		push_front_hash_addr(HashType hash, AddrType addr);
 
+	// Occupied cells counted by the most recent prefetch pass
+	uint64_t	occupied_cells() const { return m_occupied_cells.load(); }
+	uint64_t	total_cells() const { return m_cells; }
+
 private:
 	string		m_filename;
 	Fd		m_fd;
 	uint64_t	m_size;
+	Policy		m_policy = RANDOM;
 	union {
 		void	*m_void_ptr;	// Save some casting
 		uint8_t	*m_byte_ptr;	// for pointer arithmetic
@@ -441,6 +620,7 @@ private:
 	uint64_t		m_buckets;
 	uint64_t		m_extents;
 	uint64_t		m_cells;
+	atomic<uint64_t>	m_occupied_cells;
 	BeesThread  		m_writeback_thread;
 	BeesThread	        m_prefetch_thread;
 	RateLimiter		m_flush_rate_limit;
@@ -460,6 +640,7 @@ private:
 	struct ExtentMetaData {
 		shared_ptr<mutex> m_mutex_ptr;		// Access serializer
 		bool	m_dirty = false;	// Needs to be written back to disk
+		uint64_t m_dirty_count = 0;	// Times m_dirty was set, to detect writes during a flush
 		bool	m_missing = true;	// Needs to be read from disk
 		ExtentMetaData();
 	};
@@ -470,12 +651,15 @@ private:
 	void prefetch_loop();
 	void try_mmap_flags(int flags);
 	pair<Cell *, Cell *> get_cell_range(HashType hash);
+	void clock_insert_locked(pair<Cell *, Cell *> er, const Cell &mv, size_t pos);
 	pair<uint8_t *, uint8_t *> get_extent_range(HashType hash);
 	void fetch_missing_extent_by_hash(HashType hash);
 	void fetch_missing_extent_by_index(uint64_t extent_index);
 	void set_extent_dirty_locked(uint64_t extent_index);
 	size_t flush_dirty_extents(bool slowly);
 	bool flush_dirty_extent(uint64_t extent_index);
+	size_t flush_dirty_run(uint64_t begin_index, uint64_t end_index);
+	void flush_dirty_extents_fast(double timeout);
 
 	size_t			hash_to_extent_index(HashType ht);
 	unique_lock<mutex>	lock_extent_by_hash(HashType ht);
@@ -496,8 +680,56 @@ struct BeesCrawlState {
 	time_t		m_started;
 	BeesCrawlState();
 	bool operator<(const BeesCrawlState &that) const;
+	bool operator==(const BeesCrawlState &that) const;
+	bool operator!=(const BeesCrawlState &that) const { return !(*this == that); }
+};
+
+// Crawl state record in beescrawl.bin and beescrawl.journal.
+// The first record in each file is a header with m_root == c_magic,
+// m_objectid == record size, and m_offset == sequence number.
+// beescrawl.bin holds the state of every crawler.  The journal holds
+// changes since beescrawl.bin was written, and is only replayed if its
+// sequence number matches.
+struct BeesCrawlStateRecord {
+	static const uint64_t c_magic = 0x3177726373656562ULL; // "beescrw1" in little-endian
+
+	enum Flags : uint64_t {
+		ERASED = 1,	// crawler was removed
+	};
+
+	uint64_t	m_root;
+	uint64_t	m_objectid;
+	uint64_t	m_offset;
+	uint64_t	m_min_transid;
+	uint64_t	m_max_transid;
+	uint64_t	m_started;
+	uint64_t	m_flags;
+	uint64_t	m_crc;		// crc64 of the fields above, catches torn writes
+
+	BeesCrawlStateRecord(const BeesCrawlState &bcs = BeesCrawlState(), uint64_t flags = 0);
+	static BeesCrawlStateRecord header(uint64_t seq);
+	BeesCrawlState state() const;
+	uint64_t crc() const;
+	bool valid() const { return m_crc == crc(); }
 };
 
+// What scanning a subvol costs, and what it saves
+struct BeesRootCost {
+	uint64_t	m_extents = 0;
+	uint64_t	m_read_bytes = 0;
+	double		m_scan_seconds = 0;
+	uint64_t	m_dedup_bytes = 0;
+	uint64_t	m_rewrite_extents = 0;
+	uint64_t	m_rewrite_bytes = 0;
+	uint64_t	m_toxic = 0;
+
+	BeesRootCost &operator+=(const BeesRootCost &that);
+	// Bytes removed by dedup per second of scan time
+	double yield() const;
+};
+
+ostream &operator<<(ostream &os, const BeesRootCost &brc);
+
 class BeesCrawl {
 	shared_ptr<BeesContext>			m_ctx;
 
@@ -528,9 +760,17 @@ class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	shared_ptr<BeesContext>			m_ctx;
 
 	BeesStringFile				m_crawl_state_file;
+	BeesStringFile				m_crawl_journal_file;
 	map<uint64_t, shared_ptr<BeesCrawl>>	m_root_crawl_map;
 	mutex					m_mutex;
 	bool					m_crawl_dirty = false;
+
+	// Only used by the crawl_writeback thread
+	Fd					m_crawl_journal_fd;
+	off_t					m_crawl_journal_size = 0;
+	uint64_t				m_crawl_journal_seq = 0;
+	map<uint64_t, BeesCrawlState>		m_crawl_saved;
+	Timer					m_crawl_save_timer;
 	Timer					m_crawl_timer;
 	BeesThread				m_crawl_thread;
 	BeesThread				m_writeback_thread;
@@ -539,6 +779,13 @@ class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	Task					m_crawl_task;
 	bool					m_workaround_btrfs_send = false;
 	LRUCache<bool, uint64_t>		m_root_ro_cache;
+	LRUCache<uint64_t, uint64_t, uint64_t>	m_root_gen_cache;
+	atomic<bool>				m_open_by_handle;
+
+	mutex					m_cost_mutex;
+	map<uint64_t, BeesRootCost>		m_cost_total;
+	map<uint64_t, BeesRootCost>		m_cost_cycle;
+	map<uint64_t, BeesRootCost>		m_cost_last_cycle;
 
 	mutex					m_stop_mutex;
 	condition_variable			m_stop_condvar;
@@ -547,14 +794,18 @@ class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	void insert_new_crawl();
 	void insert_root(const BeesCrawlState &bcs);
 	Fd open_root_nocache(uint64_t root);
-	Fd open_root_ino_nocache(uint64_t root, uint64_t ino);
+	Fd open_root_ino_nocache(uint64_t root, uint64_t ino, bool &gone);
+	bool open_by_handle(uint64_t root, uint64_t ino, int flags, Fd &rv, bool &gone);
 	bool is_root_ro_nocache(uint64_t root);
+	uint64_t root_generation_nocache(uint64_t root);
 	uint64_t transid_min();
 	uint64_t transid_max();
 	uint64_t transid_max_nocache();
 	void state_load();
-	ostream &state_to_stream(ostream &os);
-	void state_save();
+	void state_load_text(map<uint64_t, BeesCrawlState> &states);
+	map<uint64_t, BeesCrawlState> state_current();
+	size_t state_save();
+	size_t state_checkpoint();
 	bool crawl_roots();
 	string crawl_state_filename() const;
 	void crawl_state_set_dirty();
@@ -564,8 +815,11 @@ class BeesRoots : public enable_shared_from_this<BeesRoots> {
 	uint64_t next_root(uint64_t root = 0);
 	void current_state_set(const BeesCrawlState &bcs);
 	RateEstimator& transid_re();
-	size_t crawl_batch(shared_ptr<BeesCrawl> crawl);
+	size_t crawl_batch(shared_ptr<BeesCrawl> crawl, size_t batch_max = BEES_MAX_CRAWL_BATCH);
 	void clear_caches();
+	set<uint64_t> deleted_roots();
+	void root_cost_new_cycle(uint64_t root);
+	set<uint64_t> root_cost_poor();
 
 friend class BeesFdCache;
 friend class BeesCrawl;
@@ -579,6 +833,11 @@ public:
 	Fd open_root_ino(uint64_t root, uint64_t ino);
 	Fd open_root_ino(const BeesFileId &bfi) { return open_root_ino(bfi.root(), bfi.ino()); }
 	bool is_root_ro(uint64_t root);
+	uint64_t root_generation(uint64_t root);
+
+	void root_cost_add(uint64_t root, const BeesRootCost &cost);
+	map<uint64_t, BeesRootCost> root_cost_total();
+	ostream &root_cost_to_stream(ostream &os);
 
 	// TODO:  think of better names for these.
 	// or TODO:  do extent-tree scans instead
@@ -652,8 +911,9 @@ friend ostream &operator<<(ostream &, const BeesBlockData &);
 
 class BeesRangePair : public pair<BeesFileRange, BeesFileRange> {
 public:
-	BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst);
+	BeesRangePair(const BeesFileRange &src, const BeesFileRange &dst, bool verify = true);
 	bool grow(shared_ptr<BeesContext> ctx, bool constrained);
+	bool shrink(const BeesRangePair &seed);
 	BeesRangePair copy_closed() const;
 	bool operator<(const BeesRangePair &that) const;
 friend ostream & operator<<(ostream &os, const BeesRangePair &brp);
@@ -681,12 +941,52 @@ class BeesFdCache {
 	Timer								m_root_cache_timer;
 	Timer								m_file_cache_timer;
 
+	// (root, ino) pairs that no longer exist or can't be deduped, with
+	// the root's generation at the time.  Oldest entries are dropped first.
+	using RootIno = pair<uint64_t, uint64_t>;
+	struct NegativeSlot {
+		uint64_t			m_generation;
+		list<RootIno>::iterator		m_order;
+	};
+	mutex								m_negative_mutex;
+	map<RootIno, NegativeSlot>					m_negative_cache;
+	list<RootIno>							m_negative_order;
+
 public:
 	BeesFdCache();
 	Fd open_root(shared_ptr<BeesContext> ctx, uint64_t root);
 	Fd open_root_ino(shared_ptr<BeesContext> ctx, uint64_t root, uint64_t ino);
 	void insert_root_ino(shared_ptr<BeesContext> ctx, Fd fd);
 	void clear();
+	void clear_root(uint64_t root);
+	void clear_failed_roots();
+	void expire_idle(double seconds);
+};
+
+// Extents that were scanned and kept, by a fingerprint of their size
+// and block hashes.  Oldest entries are dropped first.
+class BeesExtentIndex {
+public:
+	struct Entry {
+		BeesFileId	m_fid;
+		off_t		m_begin = 0;
+		off_t		m_size = 0;
+		BeesAddress	m_addr;
+	};
+
+	bool find(uint64_t fingerprint, Entry &entry);
+	void insert(uint64_t fingerprint, const Entry &entry);
+	void erase(uint64_t fingerprint);
+
+private:
+	struct Slot {
+		Entry				m_entry;
+		list<uint64_t>::iterator	m_order;
+	};
+	mutex					m_mutex;
+	map<uint64_t, Slot>			m_map;
+	// Fingerprints, least recently inserted first
+	list<uint64_t>				m_order;
 };
 
 struct BeesResolveAddrResult {
@@ -707,10 +1007,16 @@ class BeesContext : public enable_shared_from_this<BeesContext> {
 
 	shared_ptr<BeesFdCache>				m_fd_cache;
 	shared_ptr<BeesHashTable>			m_hash_table;
+	BeesHashTable::Policy				m_hash_policy = BeesHashTable::RANDOM;
+	double						m_stop_timeout = 0;
+	bool						m_trust_kernel_compare = false;
+	shared_ptr<BeesExtentIndex>			m_extent_index;
+	off_t						m_sample_interval = 0;
 	shared_ptr<BeesRoots>				m_roots;
 	map<thread::id, shared_ptr<BeesTempFile>>	m_tmpfiles;
 
 	LRUCache<BeesResolveAddrResult, BeesAddress>	m_resolve_cache;
+	LRUCache<shared_ptr<BtrfsExtentMap>, uint64_t, uint64_t>	m_extent_map_cache;
 
 	string						m_root_path;
 	Fd						m_root_fd;
@@ -730,18 +1036,30 @@ class BeesContext : public enable_shared_from_this<BeesContext> {
 
 	BeesThread					m_progress_thread;
 	BeesThread					m_status_thread;
+	BeesThread					m_metrics_thread;
+
+	void serve_metrics_client(int client_fd);
 
 	void set_root_fd(Fd fd);
 
 	BeesResolveAddrResult resolve_addr_uncached(BeesAddress addr);
 
-	BeesFileRange scan_one_extent(const BeesFileRange &bfr, const Extent &e);
-	void rewrite_file_range(const BeesFileRange &bfr);
+	BeesFileRange scan_one_extent(const BeesFileRange &bfr, const Extent &e, BeesRootCost &cost);
+	bool scan_sample(const BeesFileRange &bfr, const Extent &e, BeesRootCost &cost);
+	uint64_t extent_fingerprint(const BeesFileRange &bfr, const Extent &e, off_t size, vector<BeesHash> &hashes);
+	bool dedup_whole_extent(const BeesFileRange &bfr, const Extent &e, uint64_t fingerprint, const vector<BeesHash> &hashes, off_t size);
+	void rewrite_file_range(const BeesFileRange &bfr, const map<off_t, pair<BeesHash, BeesAddress>> &hashes);
 
 public:
 	BeesContext(shared_ptr<BeesContext> parent_ctx = nullptr);
 
 	void set_root_path(string path);
+	void set_hash_policy(BeesHashTable::Policy policy);
+	void set_stop_timeout(double seconds);
+	void set_trust_kernel_compare(bool trust);
+	void set_extent_index(bool enable);
+	void set_sample_interval(off_t blocks);
+	bool trust_kernel_compare() const { return m_trust_kernel_compare; }
 
 	Fd root_fd() const { return m_root_fd; }
 	Fd home_fd();
@@ -752,6 +1070,12 @@ public:
 
 	bool is_root_ro(uint64_t root);
 	BeesRangePair dup_extent(const BeesFileRange &src);
+	enum DedupResult {
+		DEDUP_OK,		// The whole pair was deduped
+		DEDUP_DATA_DIFFERS,	// The kernel found different data after deduping a leading part
+		DEDUP_REFUSED,		// Not submitted, e.g. dst is in a read-only subvol
+	};
+	DedupResult dedup(const BeesRangePair &brp, off_t &deduped);
 	bool dedup(const BeesRangePair &brp);
 
 	void blacklist_add(const BeesFileId &fid);
@@ -760,8 +1084,13 @@ public:
 	BeesResolveAddrResult resolve_addr(BeesAddress addr);
 	void invalidate_addr(BeesAddress addr);
 
+	shared_ptr<BtrfsExtentMap> extent_map(const BeesFileRange &bfr);
+	void invalidate_extent_map(const BeesFileRange &bfr);
+
 	void dump_status();
 	void show_progress();
+	void serve_metrics();
+	void write_metrics(ostream &os);
 
 	void start();
 	void stop();
@@ -807,6 +1136,7 @@ class BeesResolver {
 	BeesFileRange chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesBlockData &needle_bbd);
 	BeesBlockData adjust_offset(const BeesFileRange &haystack, const BeesBlockData &needle);
 	void find_matches(bool just_one, BeesBlockData &bbd);
+	bool dedup_grown(BeesRangePair &brp, const BeesRangePair &seed);
 
 	// FIXME: Do we need these?  We probably always have at least one BBD
 	BeesFileRange chase_extent_ref(const BtrfsInodeOffsetRoot &bior, BeesHash hash);
@@ -842,24 +1172,166 @@ public:
 };
 
 class BeesTooLong : public Timer {
-	using func_type = function<void(ostream &)>;
+	using render_type = void (*)(const void *, ostream &);
 	double m_limit;
-	func_type m_func;
+	render_type m_render;
+	const void *m_arg;
 
+	template <class F> static void render(const void *arg, ostream &os) { (*static_cast<const F *>(arg))(os); }
+
+	BeesTooLong(const BeesTooLong &) = delete;
+	BeesTooLong &operator=(const BeesTooLong &) = delete;
 public:
-	BeesTooLong(const func_type &func = [](ostream &os) { os << __PRETTY_FUNCTION__; }, double limit = BEES_TOO_LONG);
-	BeesTooLong(const string &s, double limit = BEES_TOO_LONG);
-	BeesTooLong &operator=(const func_type &s);
+	// f must outlive the BeesTooLong
+	template <class F> BeesTooLong(const F &f, double limit = BEES_TOO_LONG);
 	~BeesTooLong();
 	void check() const;
 
 };
 
+template <class F>
+BeesTooLong::BeesTooLong(const F &f, double limit) :
+	m_limit(limit),
+	m_render(&render<F>),
+	m_arg(&f)
+{
+}
+
+// One record in the binary event trace file, host byte order.
+// The first record in each file is a HEADER with m_root = c_magic
+// and m_bytes = sizeof(BeesEventRecord).
+struct BeesEventRecord {
+	static const uint64_t c_magic = 0x3174766573656562ULL; // "beesevt1" in little-endian
+
+	uint64_t	m_seq;		// gaps are dropped records
+	uint64_t	m_time_ns;	// CLOCK_REALTIME at start
+	uint64_t	m_duration_ns;
+	uint64_t	m_root;
+	uint64_t	m_ino;
+	uint64_t	m_offset;
+	uint64_t	m_bytes;
+	uint32_t	m_tid;
+	uint16_t	m_outcome;
+	uint8_t		m_type;
+	uint8_t		m_reserved;
+};
+
+// Times one scan, resolve, dedup or copy operation and appends it to
+// the binary event trace when it goes out of scope.  Does nothing
+// unless the trace was started.
+class BeesEvent {
+public:
+	enum Type : uint8_t {
+		HEADER,
+		SCAN,
+		RESOLVE,
+		DEDUP,
+		COPY,
+		TYPE_MAX,
+	};
+	enum Outcome : uint16_t {
+		EXCEPTION,	// no outcome set, i.e. unwinding
+		OK,		// dedup, copy or resolve succeeded
+		FAIL,		// dedup or resolve failed
+		HOLE,		// scan: extent is a hole
+		PREALLOC,	// scan: prealloc extent replaced with a hole
+		TOXIC,		// scan: extent has toxic hash or address
+		NO_MATCH,	// scan: no duplicate found, blocks inserted
+		DEDUPED,	// scan: duplicate blocks removed
+		READONLY,	// dedup: destination is read-only
+		OUTCOME_MAX,
+	};
+
+	BeesEvent(Type type, uint64_t root, uint64_t ino, uint64_t offset, uint64_t bytes);
+	// Looks up bfr.fid() only when the trace is enabled
+	BeesEvent(Type type, const BeesFileRange &bfr, uint64_t offset, uint64_t bytes);
+	~BeesEvent();
+	void outcome(Outcome outcome) { m_outcome = outcome; }
+	void bytes(uint64_t bytes) { m_bytes = bytes; }
+
+	static void start(Fd dir_fd);
+	static void stop();
+	static bool enabled();
+
+	static const char *type_name(uint8_t type);
+	static const char *outcome_name(uint16_t outcome);
+
+private:
+	Type		m_type;
+	Outcome		m_outcome = EXCEPTION;
+	uint64_t	m_root;
+	uint64_t	m_ino;
+	uint64_t	m_offset;
+	uint64_t	m_bytes;
+	uint64_t	m_start_ns = 0;
+
+	BeesEvent(const BeesEvent &) = delete;
+	BeesEvent &operator=(const BeesEvent &) = delete;
+};
+
+// One record in the hash table trace file, host byte order.
+// The first record in each file is a HEADER with m_hash = c_magic,
+// m_addr = hash table size in bytes (0 if not known yet), and
+// m_blocks = sizeof(BeesHashTraceRecord).
+struct BeesHashTraceRecord {
+	static const uint64_t c_magic = 0x3172746873656562ULL; // "beeshtr1" in little-endian
+
+	enum Op : uint8_t {
+		HEADER,
+		LOOKUP,		// scan looked up the hash of the block at m_addr
+		INSERT,		// push_random_hash_addr
+		PROMOTE,	// push_front_hash_addr
+		ERASE,		// erase_hash_addr
+		OP_MAX,
+	};
+	enum Outcome : uint8_t {
+		MISS,		// lookup: no match; others: (hash, addr) was not in the table
+		HIT,		// lookup: matched but nothing deduped; others: (hash, addr) was in the table
+		DEDUPED,	// lookup: matched and m_blocks blocks were deduped
+		TOXIC,		// lookup: matched a toxic extent
+		OUTCOME_MAX,
+	};
+
+	uint64_t	m_hash;
+	uint64_t	m_addr;
+	uint32_t	m_blocks;
+	uint8_t		m_op;
+	uint8_t		m_outcome;
+	uint16_t	m_reserved;
+
+	static const char *op_name(uint8_t op);
+	static const char *outcome_name(uint8_t outcome);
+};
+
+// Records hash table operations in BEESHOME/beeshash-trace.dat, for
+// offline replay with beeshashsim.  Each thread buffers its own records,
+// so records from different threads are interleaved in chunks.  Does
+// nothing unless the trace was started.
+class BeesHashTrace {
+public:
+	static void start(Fd dir_fd);
+	static void stop();
+	static bool enabled();
+	// Size of the hash table being traced, for the file header
+	static void table_size(uint64_t size);
+	static void record(BeesHashTraceRecord::Op op, uint64_t hash, uint64_t addr, BeesHashTraceRecord::Outcome outcome, uint32_t blocks = 0);
+};
+
 // And now, a giant pile of extern declarations
 extern int bees_log_level;
 extern const char *BEES_VERSION;
+int bees_main(int argc, char *argv[]);
+void do_cmd_help(char *argv[]);
 string pretty(double d);
 void bees_sync(int fd);
 string format_time(time_t t);
+ostream &bees_latency_report(ostream &os);
+
+// Kernel interfaces with latency histograms, for reports and metrics
+struct BeesLatencyInterface {
+	const char		*name;
+	const LatencyHistogram	&histogram;
+};
+const vector<BeesLatencyInterface> &bees_latency_interfaces();
 
 #endif
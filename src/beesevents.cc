@@ -0,0 +1,239 @@
+#include "bees.h"
+
+#include "crucible/error.h"
+#include "crucible/fd.h"
+#include "crucible/histogram.h"
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+
+using namespace crucible;
+using namespace std;
+
+// Summarize binary event trace files written by bees --event-trace
+
+struct TypeSummary {
+	uint64_t		m_count = 0;
+	uint64_t		m_bytes = 0;
+	uint64_t		m_duration_ns = 0;
+	LatencyHistogram	m_latency;
+	map<uint16_t, pair<uint64_t, uint64_t>>	m_outcomes;
+};
+
+static
+string
+format_ns(uint64_t ns)
+{
+	time_t t = ns / 1000000000ULL;
+	struct tm tm;
+	DIE_IF_ZERO(localtime_r(&t, &tm));
+	char buf[64];
+	DIE_IF_ZERO(strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm));
+	ostringstream oss;
+	oss << buf << "." << setw(3) << setfill('0') << ns / 1000000 % 1000;
+	return oss.str();
+}
+
+static
+double
+mib(uint64_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+static
+void
+usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " [-n COUNT] beesevents.dat [more files...]\n"
+		"Summarize throughput, slow operations and dedup efficiency\n"
+		"from bees binary event trace files.\n"
+		"\n"
+		"    -n COUNT   Show the COUNT slowest operations (default 20)\n"
+		<< endl;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t slow_count = 20;
+	int c;
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+			case 'n':
+				slow_count = stoul(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	vector<TypeSummary> types(BeesEvent::TYPE_MAX);
+	uint64_t first_ns = numeric_limits<uint64_t>::max();
+	uint64_t last_ns = 0;
+	uint64_t records = 0;
+	uint64_t dropped = 0;
+
+	// Min-heap on duration keeps the slowest records
+	auto slower = [](const BeesEventRecord &a, const BeesEventRecord &b) {
+		return a.m_duration_ns > b.m_duration_ns;
+	};
+	priority_queue<BeesEventRecord, vector<BeesEventRecord>, decltype(slower)> slowest(slower);
+
+	int rv = EXIT_SUCCESS;
+	for (int i = optind; i < argc; ++i) {
+		catch_all([&]() {
+			Fd fd = open_or_die(argv[i], O_RDONLY | O_CLOEXEC);
+			// Sequence numbers restart at each header
+			bool have_seq = false;
+			uint64_t next_seq = 0;
+			vector<BeesEventRecord> buf(64 * 1024);
+			while (true) {
+				size_t got = 0;
+				read_partial_or_die(fd, buf.data(), buf.size() * sizeof(buf[0]), got);
+				if (!got) {
+					break;
+				}
+				if (got % sizeof(buf[0])) {
+					cerr << argv[i] << ": ignoring truncated record at end of file" << endl;
+				}
+				for (size_t j = 0; j < got / sizeof(buf[0]); ++j) {
+					const auto &rec = buf[j];
+					if (rec.m_type == BeesEvent::HEADER) {
+						THROW_CHECK1(runtime_error, rec.m_root, rec.m_root == BeesEventRecord::c_magic);
+						THROW_CHECK1(runtime_error, rec.m_bytes, rec.m_bytes == sizeof(BeesEventRecord));
+						have_seq = false;
+						continue;
+					}
+					THROW_CHECK1(runtime_error, rec.m_type, rec.m_type < BeesEvent::TYPE_MAX);
+					if (have_seq && rec.m_seq > next_seq) {
+						dropped += rec.m_seq - next_seq;
+					}
+					have_seq = true;
+					next_seq = rec.m_seq + 1;
+
+					++records;
+					first_ns = min(first_ns, rec.m_time_ns);
+					last_ns = max(last_ns, rec.m_time_ns + rec.m_duration_ns);
+
+					auto &ts = types.at(rec.m_type);
+					++ts.m_count;
+					ts.m_bytes += rec.m_bytes;
+					ts.m_duration_ns += rec.m_duration_ns;
+					ts.m_latency.add(rec.m_duration_ns);
+					auto &oc = ts.m_outcomes[rec.m_outcome];
+					++oc.first;
+					oc.second += rec.m_bytes;
+
+					if (slow_count) {
+						if (slowest.size() < slow_count) {
+							slowest.push(rec);
+						} else if (rec.m_duration_ns > slowest.top().m_duration_ns) {
+							slowest.pop();
+							slowest.push(rec);
+						}
+					}
+				}
+			}
+		}, [&](string s) {
+			cerr << argv[i] << ": " << s << endl;
+			rv = EXIT_FAILURE;
+		});
+	}
+
+	if (!records) {
+		cout << "No records" << endl;
+		return rv;
+	}
+
+	const double span = (last_ns - first_ns) / 1e9;
+	cout << "Records: " << records << ", dropped " << dropped << "\n";
+	cout << "Span:    " << format_ns(first_ns) << " .. " << format_ns(last_ns) << " (" << span << " sec)\n\n";
+
+	cout << left << setw(8) << "type" << right
+		<< setw(10) << "count"
+		<< setw(12) << "MiB"
+		<< setw(10) << "MiB/s"
+		<< setw(10) << "busy%"
+		<< setw(10) << "mean ms"
+		<< setw(10) << "p50 ms"
+		<< setw(10) << "p99 ms"
+		<< setw(10) << "max ms" << "\n";
+	for (size_t t = BeesEvent::HEADER + 1; t < types.size(); ++t) {
+		const auto &ts = types[t];
+		if (!ts.m_count) {
+			continue;
+		}
+		cout << left << setw(8) << BeesEvent::type_name(t) << right << fixed << setprecision(3)
+			<< setw(10) << ts.m_count
+			<< setw(12) << mib(ts.m_bytes)
+			<< setw(10) << (span > 0 ? mib(ts.m_bytes) / span : 0)
+			<< setw(10) << (span > 0 ? ts.m_duration_ns / 1e9 / span * 100 : 0)
+			<< setw(10) << ts.m_latency.mean() / 1e6
+			<< setw(10) << ts.m_latency.percentile(0.5) / 1e6
+			<< setw(10) << ts.m_latency.percentile(0.99) / 1e6
+			<< setw(10) << ts.m_latency.max() / 1e6 << "\n";
+	}
+	cout << defaultfloat << setprecision(6) << "\nOutcomes:\n";
+	for (size_t t = BeesEvent::HEADER + 1; t < types.size(); ++t) {
+		for (const auto &i : types[t].m_outcomes) {
+			cout << "\t" << left << setw(8) << BeesEvent::type_name(t) << setw(10) << BeesEvent::outcome_name(i.first) << right
+				<< setw(10) << i.second.first << " " << mib(i.second.second) << " MiB\n";
+		}
+	}
+
+	const auto &scan = types[BeesEvent::SCAN];
+	const auto &dedup = types[BeesEvent::DEDUP];
+	const auto &copy = types[BeesEvent::COPY];
+	const auto dedup_ok = dedup.m_outcomes.count(BeesEvent::OK) ? dedup.m_outcomes.at(BeesEvent::OK) : make_pair(uint64_t(0), uint64_t(0));
+	cout << "\nDedup efficiency:\n";
+	cout << "\tscanned " << mib(scan.m_bytes) << " MiB, deduped " << mib(dedup_ok.second) << " MiB, copied " << mib(copy.m_bytes) << " MiB\n";
+	if (scan.m_bytes) {
+		cout << "\tdeduped/scanned " << 100.0 * dedup_ok.second / scan.m_bytes << "%\n";
+	}
+	if (dedup_ok.second) {
+		cout << "\tcopied/deduped " << 100.0 * copy.m_bytes / dedup_ok.second << "%\n";
+	}
+	if (dedup.m_count) {
+		cout << "\tdedup success " << 100.0 * dedup_ok.first / dedup.m_count << "% of " << dedup.m_count << " requests\n";
+	}
+
+	if (!slowest.empty()) {
+		vector<BeesEventRecord> slow_list;
+		while (!slowest.empty()) {
+			slow_list.push_back(slowest.top());
+			slowest.pop();
+		}
+		reverse(slow_list.begin(), slow_list.end());
+		cout << "\nSlowest " << slow_list.size() << " operations:\n";
+		for (const auto &rec : slow_list) {
+			cout << "\t" << format_ns(rec.m_time_ns)
+				<< " " << fixed << setprecision(3) << setw(10) << rec.m_duration_ns / 1e6 << " ms"
+				<< " " << left << setw(8) << BeesEvent::type_name(rec.m_type)
+				<< setw(10) << BeesEvent::outcome_name(rec.m_outcome) << right
+				<< " tid " << rec.m_tid;
+			if (rec.m_type == BeesEvent::RESOLVE) {
+				cout << " addr " << to_hex(rec.m_offset);
+			} else {
+				cout << " root " << rec.m_root << " ino " << rec.m_ino << " offset " << to_hex(rec.m_offset) << " size " << rec.m_bytes;
+			}
+			cout << "\n";
+		}
+	}
+
+	return rv;
+}
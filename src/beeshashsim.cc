@@ -0,0 +1,281 @@
+#include "bees.h"
+
+#include "crucible/error.h"
+#include "crucible/fd.h"
+#include "crucible/string.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+
+using namespace crucible;
+using namespace std;
+
+// Replay hash table traces written by bees --hash-trace against
+// in-memory hash tables of other sizes and replacement policies.
+//
+// The replay uses the real BeesHashTable code.  Lookups are scored
+// against the simulated table, while inserts, promotes and erases are
+// replayed as recorded.  A bigger table would have led bees to make
+// different changes, so results for sizes far from the recorded size
+// are estimates.
+
+struct Policy {
+	const char		*m_name;
+	BeesHashTable::Policy	m_policy;
+	bool			m_insert_front;	// Insert with push_front_hash_addr, i.e. LRU
+};
+
+static const Policy policies_all[] = {
+	{ "random",	BeesHashTable::RANDOM,	false },
+	{ "front",	BeesHashTable::RANDOM,	true },
+	{ "clock",	BeesHashTable::CLOCK,	false },
+	{ "slru",	BeesHashTable::SLRU,	false },
+};
+
+struct SimResult {
+	uint64_t	m_records = 0;
+	uint64_t	m_lookups = 0;
+	uint64_t	m_hits = 0;
+	uint64_t	m_dedup_blocks = 0;
+	uint64_t	m_found_blocks = 0;
+	uint64_t	m_extra_hits = 0;
+};
+
+static
+void
+usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " [-s SIZE]... [-p POLICY]... beeshash-trace.dat [more files...]\n"
+		"Replay hash table traces from bees --hash-trace against other table\n"
+		"sizes and replacement policies, and report hit rates and dedup found.\n"
+		"Give .old files before the current file to replay them in order.\n"
+		"\n"
+		"    -s SIZE     Table size with optional K, M, G suffix (repeatable).\n"
+		"                Default: 1/4, 1/2, 1, 2 and 4 times the recorded size.\n"
+		"    -p POLICY   Bucket replacement policy (repeatable):  random (bees\n"
+		"                default), front (insert new blocks at the front, i.e.\n"
+		"                LRU), clock, or slru.  Default: all of them.\n"
+		<< endl;
+}
+
+static
+uint64_t
+parse_size(const string &s)
+{
+	size_t end = 0;
+	uint64_t rv = stoull(s, &end);
+	const string suffix = s.substr(end);
+	if (suffix == "K" || suffix == "k") {
+		rv <<= 10;
+	} else if (suffix == "M" || suffix == "m") {
+		rv <<= 20;
+	} else if (suffix == "G" || suffix == "g") {
+		rv <<= 30;
+	} else if (!suffix.empty()) {
+		THROW_ERROR(invalid_argument, "unknown size suffix '" << suffix << "' in '" << s << "'");
+	}
+	// Tables are made of whole extents
+	rv = (rv + BLOCK_SIZE_HASHTAB_EXTENT - 1) / BLOCK_SIZE_HASHTAB_EXTENT * BLOCK_SIZE_HASHTAB_EXTENT;
+	THROW_CHECK1(invalid_argument, s, rv > 0);
+	return rv;
+}
+
+// Calls f for each record in the files, in order.  Returns the table
+// size from the first header that has one.
+template <class F>
+static
+uint64_t
+for_each_record(const vector<string> &files, F f)
+{
+	uint64_t table_size = 0;
+	vector<BeesHashTraceRecord> buf(64 * 1024);
+	for (const auto &file : files) {
+		Fd fd = open_or_die(file, O_RDONLY | O_CLOEXEC);
+		while (true) {
+			size_t got = 0;
+			read_partial_or_die(fd, buf.data(), buf.size() * sizeof(buf[0]), got);
+			if (!got) {
+				break;
+			}
+			if (got % sizeof(buf[0])) {
+				cerr << file << ": ignoring truncated record at end of file" << endl;
+			}
+			for (size_t j = 0; j < got / sizeof(buf[0]); ++j) {
+				const auto &rec = buf[j];
+				if (rec.m_op == BeesHashTraceRecord::HEADER) {
+					THROW_CHECK1(runtime_error, rec.m_hash, rec.m_hash == BeesHashTraceRecord::c_magic);
+					THROW_CHECK1(runtime_error, rec.m_blocks, rec.m_blocks == sizeof(BeesHashTraceRecord));
+					if (!table_size) {
+						table_size = rec.m_addr;
+					}
+					continue;
+				}
+				THROW_CHECK1(runtime_error, rec.m_op, rec.m_op < BeesHashTraceRecord::OP_MAX);
+				f(rec);
+			}
+		}
+	}
+	return table_size;
+}
+
+static
+SimResult
+simulate(const vector<string> &files, uint64_t size, const Policy &policy)
+{
+	SimResult rv;
+	BeesHashTable table(nullptr, "", size);
+	table.set_policy(policy.m_policy);
+	for_each_record(files, [&](const BeesHashTraceRecord &rec) {
+		++rv.m_records;
+		switch (rec.m_op) {
+			case BeesHashTraceRecord::LOOKUP: {
+				++rv.m_lookups;
+				// A cell with the block's own address is not a match
+				const auto physical = BeesAddress(rec.m_addr).get_physical_or_zero();
+				bool hit = false;
+				for (const auto &cell : table.find_cell(rec.m_hash)) {
+					if (BeesAddress(cell.e_addr).get_physical_or_zero() != physical) {
+						hit = true;
+						break;
+					}
+				}
+				if (rec.m_outcome == BeesHashTraceRecord::DEDUPED) {
+					rv.m_dedup_blocks += rec.m_blocks;
+					if (hit) {
+						rv.m_found_blocks += rec.m_blocks;
+					}
+				} else if (rec.m_outcome == BeesHashTraceRecord::MISS && hit) {
+					// bees didn't find a match here, but this table would have
+					++rv.m_extra_hits;
+				}
+				rv.m_hits += hit;
+				break;
+			}
+			case BeesHashTraceRecord::INSERT:
+				if (policy.m_insert_front) {
+					table.push_front_hash_addr(rec.m_hash, rec.m_addr);
+				} else {
+					table.push_random_hash_addr(rec.m_hash, rec.m_addr);
+				}
+				break;
+			case BeesHashTraceRecord::PROMOTE:
+				table.push_front_hash_addr(rec.m_hash, rec.m_addr);
+				break;
+			case BeesHashTraceRecord::ERASE:
+				table.erase_hash_addr(rec.m_hash, rec.m_addr);
+				break;
+		}
+	});
+	return rv;
+}
+
+static
+double
+mib(uint64_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+static
+double
+percent(uint64_t num, uint64_t den)
+{
+	return den ? 100.0 * num / den : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	vector<uint64_t> sizes;
+	vector<Policy> policies;
+	int c;
+	while ((c = getopt(argc, argv, "s:p:h")) != -1) {
+		switch (c) {
+			case 's':
+				sizes.push_back(parse_size(optarg));
+				break;
+			case 'p': {
+				auto found = find_if(begin(policies_all), end(policies_all), [&](const Policy &p) {
+					return optarg == string(p.m_name);
+				});
+				if (found == end(policies_all)) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				policies.push_back(*found);
+				break;
+			}
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const vector<string> files(argv + optind, argv + argc);
+
+	// Quiet the hash table's log messages
+	bees_log_level = LOG_WARNING;
+
+	int rv = EXIT_SUCCESS;
+	catch_all([&]() {
+		uint64_t records = 0;
+		const uint64_t recorded_size = for_each_record(files, [&](const BeesHashTraceRecord &) {
+			++records;
+		});
+		cout << "Records: " << records << ", recorded table size " << pretty(recorded_size) << "\n\n";
+
+		if (sizes.empty()) {
+			const uint64_t base = recorded_size ? recorded_size : 1024 * 1024 * 1024;
+			for (auto m : { 0.25, 0.5, 1.0, 2.0, 4.0 }) {
+				sizes.push_back(parse_size(to_string(uint64_t(base * m))));
+			}
+		}
+		if (policies.empty()) {
+			policies.assign(begin(policies_all), end(policies_all));
+		}
+
+		cout << right
+			<< setw(10) << "size"
+			<< setw(8) << "policy"
+			<< setw(12) << "lookups"
+			<< setw(8) << "hit%"
+			<< setw(12) << "dedup MiB"
+			<< setw(12) << "found MiB"
+			<< setw(8) << "found%"
+			<< setw(12) << "extra hits"
+			<< setw(12) << "found/GiB" << "\n";
+		for (auto size : sizes) {
+			for (const auto &policy : policies) {
+				const auto r = simulate(files, size, policy);
+				cout << setw(10) << pretty(size)
+					<< setw(8) << policy.m_name
+					<< setw(12) << r.m_lookups << fixed << setprecision(2)
+					<< setw(8) << percent(r.m_hits, r.m_lookups)
+					<< setw(12) << mib(r.m_dedup_blocks * BLOCK_SIZE_SUMS)
+					<< setw(12) << mib(r.m_found_blocks * BLOCK_SIZE_SUMS)
+					<< setw(8) << percent(r.m_found_blocks, r.m_dedup_blocks)
+					<< setw(12) << r.m_extra_hits
+					<< setw(12) << mib(r.m_found_blocks * BLOCK_SIZE_SUMS) / (size / (1024.0 * 1024.0 * 1024.0))
+					<< defaultfloat << "\n";
+			}
+		}
+		cout << "\n"
+			"dedup: blocks bees deduped after a lookup in the recorded run\n"
+			"found: the part of dedup whose lookup also matched in this table\n"
+			"extra: lookups that matched here but not in the recorded run (upper bound)\n"
+			"found/GiB: found MiB per GiB of hash table\n";
+	}, [&](string s) {
+		cerr << s << endl;
+		rv = EXIT_FAILURE;
+	});
+
+	return rv;
+}
@@ -0,0 +1,112 @@
+#include "tests.h"
+
+#include "crucible/cache.h"
+
+#include <cassert>
+#include <thread>
+
+using namespace crucible;
+
+static
+void
+test_prune()
+{
+	size_t calls = 0;
+	LRUCache<int, int, int> cache([&](int a, int b) -> int {
+		++calls;
+		return a * 100 + b;
+	}, 100);
+
+	for (int a = 0; a < 3; ++a) {
+		for (int b = 0; b < 5; ++b) {
+			assert(cache(a, b) == a * 100 + b);
+		}
+	}
+	assert(calls == 15);
+
+	// Remove everything with a == 1
+	assert(cache.prune_key([](const tuple<int, int> &k) { return get<0>(k) == 1; }) == 5);
+	assert(cache.prune_key([](const tuple<int, int> &k) { return get<0>(k) == 1; }) == 0);
+	assert(cache(0, 0) == 0);
+	assert(cache(2, 4) == 204);
+	assert(calls == 15);
+	assert(cache(1, 3) == 103);
+	assert(calls == 16);
+
+	// Remove odd values
+	cache.prune([](const int &v) { return v % 2; });
+	assert(cache(0, 2) == 2);
+	assert(calls == 16);
+	assert(cache(0, 1) == 1);
+	assert(calls == 17);
+}
+
+static
+void
+test_expire_idle()
+{
+	size_t calls = 0;
+	LRUCache<int, int> cache([&](int a) -> int {
+		++calls;
+		return a;
+	}, 100);
+
+	cache(1);
+	cache(2);
+	this_thread::sleep_for(chrono::milliseconds(200));
+	// Using 2 again makes it not idle
+	cache(2);
+	cache(3);
+	assert(calls == 3);
+
+	assert(cache.expire_idle(0.1) == 1);
+	cache(2);
+	cache(3);
+	assert(calls == 3);
+	cache(1);
+	assert(calls == 4);
+
+	assert(cache.expire_idle(10) == 0);
+	assert(cache.expire_idle(0) == 3);
+	cache(1);
+	assert(calls == 5);
+}
+
+static
+void
+test_peek()
+{
+	size_t calls = 0;
+	LRUCache<int, int> cache([&](int a) -> int {
+		++calls;
+		return a * 10;
+	}, 2);
+
+	int v = -1;
+	assert(!cache.peek(v, 1));
+	assert(v == -1);
+	assert(calls == 0);
+
+	cache(1);
+	cache(2);
+	assert(cache.peek(v, 1));
+	assert(v == 10);
+	assert(calls == 2);
+
+	// peek doesn't move 1 to the front, so 1 is evicted, not 2
+	cache(3);
+	assert(!cache.peek(v, 1));
+	assert(cache.peek(v, 2));
+	assert(v == 20);
+	assert(calls == 3);
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_prune());
+	RUN_A_TEST(test_expire_idle());
+	RUN_A_TEST(test_peek());
+
+	exit(EXIT_SUCCESS);
+}
@@ -6,6 +6,9 @@
 #include <cassert>
 #include <cstring>
 #include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include <unistd.h>
 
@@ -38,12 +41,51 @@ test_chatter_three()
 	c << "some \\ns";
 }
 
+static
+void
+test_chatter_async()
+{
+	ostringstream oss;
+	const size_t thread_count = 8;
+	const size_t line_count = 5000;
+	auto dropped_before = Chatter::dropped_count();
+	// Small enough to drop some messages
+	Chatter::enable_async(64 * 1024);
+	vector<thread> threads;
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.push_back(thread([&]() {
+			for (size_t i = 0; i < line_count; ++i) {
+				Chatter(0, "tca", oss) << "async line " << i;
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	Chatter::disable_async();
+	size_t lines = 0;
+	string line;
+	istringstream iss(oss.str());
+	while (getline(iss, line)) {
+		assert(line.find("async line ") != string::npos);
+		++lines;
+	}
+	auto dropped = Chatter::dropped_count() - dropped_before;
+	assert(lines + dropped == thread_count * line_count);
+
+	// Synchronous again
+	ostringstream oss2;
+	Chatter(0, "tcs", oss2) << "sync line";
+	assert(oss2.str().find("sync line\n") != string::npos);
+}
+
 int
 main(int, char**)
 {
 	RUN_A_TEST(test_chatter_one());
 	RUN_A_TEST(test_chatter_two());
 	RUN_A_TEST(test_chatter_three());
+	RUN_A_TEST(test_chatter_async());
 
 	exit(EXIT_SUCCESS);
 }
@@ -12,6 +12,7 @@
 #include <ios>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/types.h>
@@ -283,6 +284,49 @@ static void test_shared_close_method()
 	assert_is_closed(fd2, true);
 }
 
+static void test_close_method_reuse()
+{
+	Fd fd = open("fd.cc", O_RDONLY);
+	int i = fd;
+	fd->close();
+	assert_is_closed(i, true);
+	// The registry still holds a stale entry for i until i is reused
+	int j = open("fd.cc", O_RDONLY);
+	if (j != i) {
+		assert(dup2(j, i) == i);
+		close(j);
+	}
+	Fd fd2 = i;
+	assert_is_closed(fd2, false);
+	assert(fd2->get_fd() == i);
+}
+
+static void test_many_fds()
+{
+	vector<Fd> fds;
+	vector<int> ints;
+	for (int n = 0; n < 256; ++n) {
+		Fd fd = open("fd.cc", O_RDONLY);
+		fds.push_back(fd);
+		ints.push_back(fd);
+	}
+	// Copies share the same Resource
+	for (size_t n = 0; n < fds.size(); ++n) {
+		Fd copy = ints[n];
+		assert(copy.get_resource_ptr() == fds[n].get_resource_ptr());
+	}
+	// Reassignment releases only the old Resource
+	for (size_t n = 0; n < fds.size(); n += 2) {
+		fds[n] = fds[n + 1];
+		assert_is_closed(ints[n], true);
+		assert_is_closed(ints[n + 1], false);
+	}
+	fds.clear();
+	for (auto i : ints) {
+		assert_is_closed(i, true);
+	}
+}
+
 struct DerivedFdResource : public Fd::resource_type {
 	string	m_name;
 	DerivedFdResource(string name) : m_name(name) {
@@ -383,6 +427,8 @@ int main(int, const char **)
 	RUN_A_TEST(test_map());
 	RUN_A_TEST(test_close_method());
 	RUN_A_TEST(test_shared_close_method());
+	RUN_A_TEST(test_close_method_reuse());
+	RUN_A_TEST(test_many_fds());
 	RUN_A_TEST(test_derived_resource_type());
 	RUN_A_TEST(test_derived_map());
 	RUN_A_TEST(test_derived_cast());
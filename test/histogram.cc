@@ -0,0 +1,77 @@
+#include "tests.h"
+#include "crucible/histogram.h"
+
+#include <cassert>
+#include <thread>
+#include <vector>
+
+using namespace crucible;
+
+static
+void
+test_buckets()
+{
+	for (size_t i = 0; i < LatencyHistogram::c_bucket_count; ++i) {
+		auto lo = LatencyHistogram::bucket_low(i);
+		auto hi = LatencyHistogram::bucket_high(i);
+		assert(lo <= hi);
+		assert(LatencyHistogram::bucket_of(lo) == i);
+		assert(LatencyHistogram::bucket_of(hi) == i);
+		if (i + 1 < LatencyHistogram::c_bucket_count) {
+			assert(LatencyHistogram::bucket_low(i + 1) == hi + 1);
+		}
+	}
+	assert(LatencyHistogram::bucket_of(0) == 0);
+	assert(LatencyHistogram::bucket_high(LatencyHistogram::c_bucket_count - 1) == UINT64_MAX);
+}
+
+static
+void
+test_percentiles()
+{
+	LatencyHistogram lh;
+	assert(lh.count() == 0);
+	assert(lh.percentile(0.5) == 0);
+	for (uint64_t i = 1; i <= 1000; ++i) {
+		lh.add(i * 1000);
+	}
+	assert(lh.count() == 1000);
+	assert(lh.max() == 1000000);
+	assert(lh.mean() == 500500);
+	// Each bucket is within 1/16 of its lower bound
+	auto p50 = lh.percentile(0.5);
+	assert(p50 >= 500000 && p50 <= 500000 * 17 / 16);
+	auto p99 = lh.percentile(0.99);
+	assert(p99 >= 990000 && p99 <= 1000000);
+	assert(lh.percentile(1.0) == 1000000);
+}
+
+static
+void
+test_threads()
+{
+	LatencyHistogram lh;
+	vector<thread> threads;
+	for (int t = 0; t < 4; ++t) {
+		threads.push_back(thread([&]() {
+			for (uint64_t i = 0; i < 10000; ++i) {
+				lh.add(i);
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	assert(lh.count() == 40000);
+	assert(lh.max() == 9999);
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_buckets());
+	RUN_A_TEST(test_percentiles());
+	RUN_A_TEST(test_threads());
+
+	exit(EXIT_SUCCESS);
+}
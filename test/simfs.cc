@@ -0,0 +1,335 @@
+#include "tests.h"
+
+#include "crucible/extentwalker.h"
+#include "crucible/fs.h"
+#include "crucible/simfs.h"
+
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace crucible;
+
+static const off_t bs = BtrfsSimulator::c_block_size;
+
+static
+vector<uint8_t>
+read_file(int fd, off_t offset, size_t size)
+{
+	vector<uint8_t> buf(size);
+	btrfs_pread_or_die(fd, buf, offset);
+	return buf;
+}
+
+static
+vector<BtrfsInodeOffsetRoot>
+resolve(int fd, uint64_t bytenr)
+{
+	BtrfsIoctlLogicalInoArgs lia(bytenr);
+	if (!lia.do_ioctl_nothrow(fd)) {
+		return vector<BtrfsInodeOffsetRoot>();
+	}
+	return lia.m_iors;
+}
+
+static
+void
+test_extents()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	Fd fd = sim->add_file(257);
+	const auto a = sim->write(fd, 0, vector<uint64_t> { 1, 2, 3, 4 });
+	const auto b = sim->write(fd, 4 * bs, vector<uint64_t> { 5, 6 }, true);
+	// Overwrite the middle of the first extent
+	const auto c = sim->write(fd, bs, vector<uint64_t> { 7 });
+
+	BtrfsExtentWalker ew(fd, 0);
+	vector<Extent> extents;
+	do {
+		extents.push_back(ew.current());
+	} while (ew.next());
+	assert(extents.size() == 4);
+	assert(extents[0].begin() == 0 && extents[0].end() == bs && extents[0].bytenr() == a);
+	assert(extents[1].begin() == bs && extents[1].bytenr() == c);
+	assert(extents[2].begin() == 2 * bs && extents[2].end() == 4 * bs && extents[2].bytenr() == a);
+	assert(extents[2].flags() & Extent::OBSCURED);
+	assert(extents[3].compressed() && extents[3].bytenr() == b);
+	assert(extents[3].flags() & FIEMAP_EXTENT_LAST);
+
+	// Block data follows the content ids
+	vector<uint8_t> expected(bs);
+	BtrfsSimulator::block_data(7, expected.data());
+	assert(read_file(fd, bs, bs) == expected);
+	BtrfsSimulator::block_data(3, expected.data());
+	assert(read_file(fd, 2 * bs, bs) == expected);
+
+	assert(btrfs_get_root_id(fd) == 257);
+	assert(btrfs_get_root_transid(fd) == sim->transid());
+	assert(sim->count(BtrfsSimulator::TREE_SEARCH) > 0);
+
+	btrfs_backend(nullptr);
+}
+
+static
+void
+test_logical_ino()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	Fd fd1 = sim->add_file(257);
+	Fd fd2 = sim->add_file(258);
+	const auto a = sim->write(fd1, 0, vector<uint64_t> { 1, 2, 3, 4 });
+	sim->add_ref(fd2, 8 * bs, a, 2 * bs, 2 * bs);
+	const uint64_t ino1 = Stat(fd1).st_ino;
+	const uint64_t ino2 = Stat(fd2).st_ino;
+
+	// Block 0 is only in the first file
+	auto iors = resolve(fd1, a);
+	assert(iors.size() == 1);
+	assert(iors[0].m_inum == ino1 && iors[0].m_offset == 0 && iors[0].m_root == 257);
+
+	// Block 3 is in both
+	iors = resolve(fd1, a + 3 * bs);
+	assert(iors.size() == 2);
+	for (auto &i : iors) {
+		if (i.m_root == 257) {
+			assert(i.m_inum == ino1 && i.m_offset == uint64_t(3 * bs));
+		} else {
+			assert(i.m_root == 258 && i.m_inum == ino2 && i.m_offset == uint64_t(9 * bs));
+		}
+	}
+
+	// Ignoring the offset finds every ref
+	BtrfsIoctlLogicalInoArgs lia(a);
+	lia.set_flags(BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET);
+	lia.do_ioctl(fd1);
+	assert(lia.m_iors.size() == 2);
+
+	// Nothing there
+	BtrfsIoctlLogicalInoArgs none(a + 100 * bs);
+	assert(!none.do_ioctl_nothrow(fd1));
+	assert(errno == ENOENT);
+
+	BtrfsIoctlInoPathArgs ipa(ino2);
+	assert(ipa.do_ioctl_nothrow(fd2));
+	assert(ipa.m_paths.size() == 1);
+	assert(ipa.m_paths[0] == "ino" + to_string(ino2));
+
+	btrfs_backend(nullptr);
+}
+
+static
+void
+test_extent_same()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	Fd fd1 = sim->add_file(257);
+	Fd fd2 = sim->add_file(257);
+	const auto a = sim->write(fd1, 0, vector<uint64_t> { 1, 2, 3, 4 });
+	const auto b = sim->write(fd2, 0, vector<uint64_t> { 9, 2, 3, 8 });
+	sim->commit();
+
+	// Different data
+	assert(!btrfs_extent_same(fd1, 0, 2 * bs, fd2, 0));
+	assert(sim->extent_refs(b) == 1);
+
+	// Same data
+	assert(btrfs_extent_same(fd1, bs, 2 * bs, fd2, bs));
+	assert(read_file(fd1, bs, 2 * bs) == read_file(fd2, bs, 2 * bs));
+	assert(sim->extent_refs(a) == 2);
+	// b is split in two refs around the hole left by dedupe
+	assert(sim->extent_refs(b) == 2);
+	auto iors = resolve(fd1, a + bs);
+	assert(iors.size() == 2);
+
+	// Replacing every ref frees the extent
+	sim->add_ref(fd2, 0, a, 0, 4 * bs);
+	assert(sim->extent_refs(b) == 0);
+	assert(resolve(fd1, b).empty());
+	assert(read_file(fd1, 0, 4 * bs) == read_file(fd2, 0, 4 * bs));
+
+	assert(sim->count(BtrfsSimulator::EXTENT_SAME) == 2);
+
+	btrfs_backend(nullptr);
+}
+
+static
+void
+test_extent_same_partial()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	// Longer than one FILE_EXTENT_SAME call, different in the last block
+	const off_t blocks = BTRFS_MAX_DEDUPE_LEN / bs + 2;
+	vector<uint64_t> data1, data2;
+	for (off_t i = 0; i < blocks; ++i) {
+		data1.push_back(i + 1);
+		data2.push_back(i + 1);
+	}
+	data2.back() = 0x5a5a;
+	Fd fd1 = sim->add_file(257);
+	Fd fd2 = sim->add_file(257);
+	sim->write(fd1, 0, data1);
+	sim->write(fd2, 0, data2);
+	sim->commit();
+
+	off_t deduped = -1;
+	assert(!btrfs_extent_same(fd1, 0, blocks * bs, fd2, 0, deduped));
+	assert(deduped == BTRFS_MAX_DEDUPE_LEN);
+	assert(sim->count(BtrfsSimulator::EXTENT_SAME) == 2);
+
+	assert(btrfs_extent_same(fd1, 0, BTRFS_MAX_DEDUPE_LEN, fd2, 0, deduped));
+	assert(deduped == BTRFS_MAX_DEDUPE_LEN);
+
+	btrfs_backend(nullptr);
+}
+
+static
+void
+test_latency()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	Fd fd = sim->add_file(257);
+	sim->write(fd, 0, vector<uint64_t> { 1 });
+	sim->latency(BtrfsSimulator::PREAD, 0.01);
+	Timer t;
+	for (int i = 0; i < 5; ++i) {
+		read_file(fd, 0, bs);
+	}
+	assert(t.age() >= 0.05);
+	assert(sim->count(BtrfsSimulator::PREAD) == 5);
+
+	// Files that are not simulated go to the kernel and are not counted
+	Fd real_fd = open_or_die("/dev/zero");
+	assert(read_file(real_fd, 0, bs) == vector<uint8_t>(bs));
+	assert(sim->count(BtrfsSimulator::PREAD) == 5);
+
+	btrfs_backend(nullptr);
+}
+
+static
+void
+test_open_by_handle()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	Fd fd = sim->add_file(257);
+	sim->write(fd, 0, vector<uint64_t> { 1, 2 });
+	const uint64_t ino = Stat(fd).st_ino;
+
+	const auto gen = btrfs_get_inode_generation(fd, 257, ino);
+	assert(gen == 1);
+	assert(btrfs_get_inode_generation(fd, 257, ino + 1000000) == 0);
+
+	Fd opened = btrfs_open_by_handle(fd, 257, ino, gen, O_RDONLY);
+	assert(opened);
+	assert(Stat(opened).st_ino == ino);
+	assert(read_file(opened, bs, bs) == read_file(fd, bs, bs));
+
+	// Wrong generation or root
+	assert(btrfs_open_by_handle(fd, 257, ino, gen + 1, O_RDONLY) < 0);
+	assert(errno == ESTALE);
+	assert(btrfs_open_by_handle(fd, 258, ino, gen, O_RDONLY) < 0);
+	assert(errno == ESTALE);
+
+	assert(sim->count(BtrfsSimulator::OPEN_BY_HANDLE) == 3);
+
+	// The extent walker skips the inode item
+	BtrfsExtentWalker ew(fd, 0);
+	assert(ew.current().begin() == 0 && ew.current().end() == 2 * bs);
+
+	btrfs_backend(nullptr);
+}
+
+static
+vector<Extent>
+walk(BtrfsExtentWalker &ew)
+{
+	vector<Extent> rv;
+	do {
+		rv.push_back(ew.current());
+	} while (ew.next());
+	return rv;
+}
+
+static
+void
+test_extent_map()
+{
+	auto sim = make_shared<BtrfsSimulator>();
+	btrfs_backend(sim);
+
+	// One extent per block, with a hole in the middle
+	Fd fd = sim->add_file(257);
+	const size_t count = 2000;
+	for (size_t i = 0; i < count; ++i) {
+		if (i != count / 2) {
+			sim->write(fd, i * bs, vector<uint64_t> { i + 1 });
+		}
+	}
+	const auto ino = Stat(fd).st_ino;
+
+	auto searches = sim->count(BtrfsSimulator::TREE_SEARCH);
+	BtrfsExtentWalker ew(fd, 0);
+	const auto expected = walk(ew);
+	const auto walker_searches = sim->count(BtrfsSimulator::TREE_SEARCH) - searches;
+	assert(expected.size() == count);
+	assert(expected[count / 2].flags() & Extent::HOLE);
+
+	// Same extents from the map, in far fewer searches
+	auto map = make_shared<BtrfsExtentMap>(fd, 257, ino);
+	searches = sim->count(BtrfsSimulator::TREE_SEARCH);
+	BtrfsExtentWalker ew_map(fd, 0, map);
+	assert(walk(ew_map) == expected);
+	assert(map->searches() == sim->count(BtrfsSimulator::TREE_SEARCH) - searches);
+	assert(map->searches() < 10);
+	assert(map->searches() * 20 < walker_searches);
+
+	// Another walker on the same map doesn't search at all
+	const auto map_searches = map->searches();
+	BtrfsExtentWalker ew_map2(fd, count / 2 * bs, map);
+	assert(ew_map2.current() == expected[count / 2]);
+	assert(ew_map2.prev());
+	assert(ew_map2.current() == expected[count / 2 - 1]);
+	assert(map->searches() == map_searches);
+
+	// A different generation or a write empties the map
+	assert(map->generation(0));
+	assert(!map->generation(2));
+	assert(map->generation(2));
+	BtrfsExtentWalker ew_map3(fd, count / 2 * bs, map);
+	assert(ew_map3.current() == expected[count / 2]);
+	assert(map->searches() > map_searches);
+	sim->write(fd, count * bs, vector<uint64_t> { count + 1 });
+	BtrfsExtentWalker ew_map4(fd, 0, map);
+	const auto grown = walk(ew_map4);
+	assert(grown.size() == count + 1);
+	assert(grown[count - 2] == expected[count - 2]);
+	assert(grown[count].flags() & FIEMAP_EXTENT_LAST);
+
+	btrfs_backend(nullptr);
+}
+
+int
+main(int, char**)
+{
+	RUN_A_TEST(test_extents());
+	RUN_A_TEST(test_logical_ino());
+	RUN_A_TEST(test_extent_same());
+	RUN_A_TEST(test_extent_same_partial());
+	RUN_A_TEST(test_latency());
+	RUN_A_TEST(test_open_by_handle());
+	RUN_A_TEST(test_extent_map());
+
+	exit(EXIT_SUCCESS);
+}